@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: MIT
+
+#include <gst/gst.h>
+#include <stdlib.h>
+
+// Simulates the caps queries bursts happening on adaptive bitrate
+// representation switches: the sprkldecryptor pads are queried from both
+// directions, filtered by the caps of each representation in turn. Results
+// are printed as JSON.
+//
+// Usage: sprkl-bench-caps-query-storm [ITERATIONS]
+
+#define WIDEVINE_UUID "edef8ba9-79d6-4ace-a3c8-27dcd51d21ed"
+
+static const struct {
+    gint width;
+    gint height;
+    const gchar* level;
+} representations[] = {
+    { 416, 234, "3" },
+    { 640, 360, "3" },
+    { 768, 432, "3.1" },
+    { 1280, 720, "3.1" },
+    { 1920, 1080, "4" },
+    { 3840, 2160, "5.1" },
+};
+
+#define N_REPRESENTATIONS G_N_ELEMENTS(representations)
+
+typedef struct _StormData {
+    GstCaps* upstreamCaps;
+    GstCaps* downstreamCaps;
+    GstCaps* filters[N_REPRESENTATIONS];
+} StormData;
+
+static GstCaps*
+representation_caps(guint index)
+{
+    return gst_caps_new_simple("application/x-cenc",
+        "original-media-type", G_TYPE_STRING, "video/x-h264",
+        "protection-system", G_TYPE_STRING, WIDEVINE_UUID,
+        "stream-format", G_TYPE_STRING, "avc",
+        "alignment", G_TYPE_STRING, "au",
+        "profile", G_TYPE_STRING, "high",
+        "level", G_TYPE_STRING, representations[index].level,
+        "width", G_TYPE_INT, representations[index].width,
+        "height", G_TYPE_INT, representations[index].height,
+        "framerate", GST_TYPE_FRACTION, 25, 1,
+        NULL);
+}
+
+static gboolean
+peer_query(GstPad* pad, GstObject* parent, GstQuery* query)
+{
+    StormData* data = g_object_get_data(G_OBJECT(pad), "storm-data");
+
+    if (GST_QUERY_TYPE(query) != GST_QUERY_CAPS)
+        return gst_pad_query_default(pad, parent, query);
+
+    // Demuxers and decoders answer with freshly allocated caps.
+    GstCaps* filter;
+    gst_query_parse_caps(query, &filter);
+    GstCaps* caps = gst_caps_copy(GST_PAD_DIRECTION(pad) == GST_PAD_SRC ? data->upstreamCaps : data->downstreamCaps);
+    if (filter) {
+        GstCaps* intersection = gst_caps_intersect_full(filter, caps, GST_CAPS_INTERSECT_FIRST);
+        gst_caps_unref(caps);
+        caps = intersection;
+    }
+    gst_query_set_caps_result(query, caps);
+    gst_caps_unref(caps);
+    return TRUE;
+}
+
+static int
+compare_times(gconstpointer a, gconstpointer b)
+{
+    gint64 first = *(const gint64*)a;
+    gint64 second = *(const gint64*)b;
+    return first < second ? -1 : first > second;
+}
+
+int main(int argc, char** argv)
+{
+    gst_init(&argc, &argv);
+
+    guint iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    if (!iterations) {
+        g_printerr("Invalid number of iterations\n");
+        return EXIT_FAILURE;
+    }
+
+    GstElement* decryptor = gst_element_factory_make("sprkldecryptor", NULL);
+    if (!decryptor) {
+        g_printerr("sprkldecryptor not found, check GST_PLUGIN_PATH\n");
+        return EXIT_FAILURE;
+    }
+    gst_object_ref_sink(decryptor);
+
+    StormData data;
+    data.upstreamCaps = gst_caps_new_empty();
+    for (guint i = 0; i < N_REPRESENTATIONS; i++) {
+        data.filters[i] = representation_caps(i);
+        gst_caps_append(data.upstreamCaps, gst_caps_ref(data.filters[i]));
+    }
+    data.downstreamCaps = gst_caps_from_string("video/x-h264, stream-format=(string){ avc, avc3, byte-stream }, alignment=(string){ au, nal }");
+
+    GstPad* upstream = gst_pad_new("upstream", GST_PAD_SRC);
+    GstPad* downstream = gst_pad_new("downstream", GST_PAD_SINK);
+    GstPad* sinkPad = gst_element_get_static_pad(decryptor, "sink");
+    GstPad* srcPad = gst_element_get_static_pad(decryptor, "src");
+    g_object_set_data(G_OBJECT(upstream), "storm-data", &data);
+    g_object_set_data(G_OBJECT(downstream), "storm-data", &data);
+    gst_pad_set_query_function(upstream, peer_query);
+    gst_pad_set_query_function(downstream, peer_query);
+    if (gst_pad_link(upstream, sinkPad) != GST_PAD_LINK_OK || gst_pad_link(srcPad, downstream) != GST_PAD_LINK_OK) {
+        g_printerr("Unable to link the decryptor pads\n");
+        return EXIT_FAILURE;
+    }
+
+    gint64* times = g_new(gint64, 2 * iterations);
+    gint64 start = g_get_monotonic_time();
+    for (guint i = 0; i < iterations; i++) {
+        GstCaps* filter = data.filters[i % N_REPRESENTATIONS];
+
+        gint64 queryStart = g_get_monotonic_time();
+        GstCaps* caps = gst_pad_query_caps(sinkPad, filter);
+        times[2 * i] = g_get_monotonic_time() - queryStart;
+        gst_caps_unref(caps);
+
+        queryStart = g_get_monotonic_time();
+        caps = gst_pad_query_caps(srcPad, NULL);
+        times[2 * i + 1] = g_get_monotonic_time() - queryStart;
+        gst_caps_unref(caps);
+    }
+    gint64 total = g_get_monotonic_time() - start;
+
+    guint nQueries = 2 * iterations;
+    qsort(times, nQueries, sizeof(gint64), compare_times);
+    g_print("{\"benchmark\": \"caps-query-storm\", \"representations\": %u, \"queries\": %u, \"total_ms\": %.3f, "
+            "\"latency_us\": {\"mean\": %.2f, \"p50\": %" G_GINT64_FORMAT ", \"p99\": %" G_GINT64_FORMAT ", \"max\": %" G_GINT64_FORMAT "}}\n",
+        (guint)N_REPRESENTATIONS, nQueries, total / 1000., (double)total / nQueries, times[nQueries / 2], times[nQueries * 99 / 100], times[nQueries - 1]);
+
+    g_free(times);
+    gst_pad_unlink(upstream, sinkPad);
+    gst_pad_unlink(srcPad, downstream);
+    gst_object_unref(sinkPad);
+    gst_object_unref(srcPad);
+    gst_object_unref(upstream);
+    gst_object_unref(downstream);
+    gst_object_unref(decryptor);
+    for (guint i = 0; i < N_REPRESENTATIONS; i++)
+        gst_caps_unref(data.filters[i]);
+    gst_caps_unref(data.upstreamCaps);
+    gst_caps_unref(data.downstreamCaps);
+    gst_deinit();
+    return EXIT_SUCCESS;
+}
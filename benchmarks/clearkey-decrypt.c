@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: MIT
+
+#include "open_cdm.h"
+#include "open_cdm_adapter.h"
+#include "sprkl-tool.h"
+#include <gst/gst.h>
+#include <stdlib.h>
+
+// Measures the ClearKey decryption throughput through the OpenCDM entry
+// points, for full-sample and subsampled encryption, audio frame and 4K
+// keyframe sizes, 8 and 16 bytes IVs, and concurrent decryption threads.
+// Results are printed as JSON.
+//
+// Usage: sprkl-bench-clearkey [MEGABYTES]
+//
+// MEGABYTES is the amount of data each thread decrypts per case, 64 by
+// default. The ClearKey module is looked up in WEBKIT_SPARKLE_CDM_MODULE_PATH.
+
+#define CLEARKEY_KEY_SYSTEM "org.w3.clearkey"
+
+// Subsampled samples alternate clear NAL headers and encrypted payloads.
+#define SUBSAMPLE_SIZE 4096
+#define SUBSAMPLE_CLEAR_SIZE 32
+
+static const SprklToolKey key = {
+    { 0x10, 0x77, 0xef, 0xec, 0xc0, 0xb2, 0x4d, 0x02, 0xac, 0xe3, 0x3c, 0x1e, 0x52, 0xe2, 0xfb, 0x4b },
+    { 0x3c, 0x51, 0x1f, 0x46, 0xa9, 0x5e, 0x06, 0x2b, 0x8f, 0x73, 0x1d, 0x42, 0xd8, 0x15, 0xf9, 0x64 },
+};
+
+static const struct {
+    const gchar* name;
+    gsize size;
+} sampleSizes[] = {
+    { "audio", 768 },
+    { "4k-keyframe", 1024 * 1024 },
+};
+
+static const guint threadCounts[] = { 1, 4 };
+
+typedef struct _BenchCase {
+    struct OpenCDMSession* session;
+    gboolean subsampled;
+    const gchar* sampleName;
+    gsize sampleSize;
+    guint ivSize;
+    guint64 samples; // Per thread.
+} BenchCase;
+
+typedef struct _BenchThread {
+    const BenchCase* benchCase;
+    GThread* thread;
+    gint64 elapsed;
+    gboolean success;
+} BenchThread;
+
+static GstBuffer*
+subsamples_buffer(gsize sampleSize, guint* count)
+{
+    GByteArray* entries = g_byte_array_new();
+    *count = 0;
+    for (gsize offset = 0; offset < sampleSize; offset += SUBSAMPLE_SIZE) {
+        guint16 clear = SUBSAMPLE_CLEAR_SIZE;
+        guint32 encrypted = MIN(SUBSAMPLE_SIZE, sampleSize - offset) - clear;
+        guint8 entry[6] = { clear >> 8, clear & 0xff, encrypted >> 24, (encrypted >> 16) & 0xff, (encrypted >> 8) & 0xff, encrypted & 0xff };
+        g_byte_array_append(entries, entry, sizeof(entry));
+        (*count)++;
+    }
+    guint size = entries->len;
+    return gst_buffer_new_wrapped(g_byte_array_free(entries, FALSE), size);
+}
+
+static gpointer
+decrypt_samples(gpointer data)
+{
+    BenchThread* thread = data;
+    const BenchCase* benchCase = thread->benchCase;
+
+    // Decrypting the same buffer over and over, AES-CTR does not care about
+    // the contents.
+    GstBuffer* buffer = gst_buffer_new_allocate(NULL, benchCase->sampleSize, NULL);
+    gst_buffer_memset(buffer, 0, 0x5a, benchCase->sampleSize);
+    GstBuffer* iv = gst_buffer_new_allocate(NULL, benchCase->ivSize, NULL);
+    gst_buffer_memset(iv, 0, 0, benchCase->ivSize);
+    GstBuffer* kid = gst_buffer_new_memdup(key.id, sizeof(key.id));
+    guint subSampleCount = 0;
+    GstBuffer* subSamples = benchCase->subsampled ? subsamples_buffer(benchCase->sampleSize, &subSampleCount) : NULL;
+
+    thread->success = TRUE;
+    gint64 start = g_get_monotonic_time();
+    for (guint64 i = 0; i < benchCase->samples && thread->success; i++)
+        thread->success = opencdm_gstreamer_session_decrypt(benchCase->session, buffer, subSamples, subSampleCount, iv, kid, 0) == ERROR_NONE;
+    thread->elapsed = g_get_monotonic_time() - start;
+
+    gst_buffer_unref(buffer);
+    gst_buffer_unref(iv);
+    gst_buffer_unref(kid);
+    if (subSamples)
+        gst_buffer_unref(subSamples);
+    return NULL;
+}
+
+static gboolean
+run_case(const BenchCase* benchCase, guint nThreads, gboolean first)
+{
+    BenchThread* threads = g_new0(BenchThread, nThreads);
+
+    gint64 start = g_get_monotonic_time();
+    for (guint i = 0; i < nThreads; i++) {
+        threads[i].benchCase = benchCase;
+        threads[i].thread = g_thread_new("decrypt", decrypt_samples, &threads[i]);
+    }
+
+    gboolean success = TRUE;
+    gint64 threadTime = 0;
+    for (guint i = 0; i < nThreads; i++) {
+        g_thread_join(threads[i].thread);
+        success &= threads[i].success;
+        threadTime += threads[i].elapsed;
+    }
+    gint64 wallTime = MAX(g_get_monotonic_time() - start, 1);
+    g_free(threads);
+
+    if (!success) {
+        g_printerr("Decryption failed\n");
+        return FALSE;
+    }
+
+    guint64 samples = benchCase->samples * nThreads;
+    double megabytes = (double)samples * benchCase->sampleSize / 1e6;
+    g_print("%s    {\"layout\": \"%s\", \"sample\": \"%s\", \"sample_size\": %" G_GSIZE_FORMAT ", \"iv_size\": %u, \"threads\": %u, "
+            "\"samples\": %" G_GUINT64_FORMAT ", \"mb_per_s\": %.2f, \"ns_per_sample\": %.1f}",
+        first ? "" : ",\n", benchCase->subsampled ? "subsampled" : "full", benchCase->sampleName, benchCase->sampleSize, benchCase->ivSize, nThreads, samples,
+        megabytes / (wallTime / 1e6), threadTime * 1000. / samples);
+    return TRUE;
+}
+
+int main(int argc, char** argv)
+{
+    gst_init(&argc, &argv);
+
+    guint64 megabytes = argc > 1 ? g_ascii_strtoull(argv[1], NULL, 10) : 64;
+    if (!megabytes) {
+        g_printerr("Invalid amount of data\n");
+        return EXIT_FAILURE;
+    }
+
+    struct OpenCDMSystem* system = opencdm_create_system(CLEARKEY_KEY_SYSTEM);
+    if (!system) {
+        g_printerr("ClearKey module not found, check WEBKIT_SPARKLE_CDM_MODULE_PATH\n");
+        return EXIT_FAILURE;
+    }
+
+    struct OpenCDMSession* session = sprkl_tool_create_clearkey_session(system, &key, 1);
+    if (!session) {
+        g_printerr("Unable to set up the ClearKey session\n");
+        opencdm_destruct_system(system);
+        return EXIT_FAILURE;
+    }
+
+    gboolean success = TRUE;
+    gboolean first = TRUE;
+    g_print("{\"benchmark\": \"clearkey-decrypt\", \"megabytes_per_thread\": %" G_GUINT64_FORMAT ", \"cases\": [\n", megabytes);
+    for (guint layout = 0; layout < 2 && success; layout++) {
+        for (guint size = 0; size < G_N_ELEMENTS(sampleSizes) && success; size++) {
+            for (guint ivSize = 8; ivSize <= 16 && success; ivSize += 8) {
+                for (guint threads = 0; threads < G_N_ELEMENTS(threadCounts) && success; threads++) {
+                    BenchCase benchCase = {
+                        session,
+                        layout == 1,
+                        sampleSizes[size].name,
+                        sampleSizes[size].size,
+                        ivSize,
+                        MAX(megabytes * 1000000 / sampleSizes[size].size, 16),
+                    };
+                    success = run_case(&benchCase, threadCounts[threads], first);
+                    first = FALSE;
+                }
+            }
+        }
+    }
+    g_print("\n]}\n");
+
+    opencdm_destruct_session(session);
+    opencdm_destruct_system(system);
+    gst_deinit();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,421 @@
+// SPDX-License-Identifier: MIT
+
+#include "open_cdm.h"
+#include "open_cdm_adapter.h"
+#include "sprkl-tool.h"
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Measures the throughput and latency of appsrc ! sprkldecryptor ! fakesink
+// on a synthetic CENC stream, against appsrc ! identity ! fakesink on the
+// same stream in clear, for audio frames, HD frames and 4K keyframes. The
+// stream is encrypted under a known ClearKey key, announced with a DASH
+// protection event, and the license is answered from the spkl-challenge
+// message, as a player would do. Results are printed as JSON.
+//
+// Usage: sprkl-bench-pipeline [MEGABYTES]
+//
+// MEGABYTES is the amount of data pushed per case, 128 by default. The
+// ClearKey module is looked up in WEBKIT_SPARKLE_CDM_MODULE_PATH and the
+// element in GST_PLUGIN_PATH.
+
+#define CLEARKEY_KEY_SYSTEM "org.w3.clearkey"
+#define CLEARKEY_UUID "1077efec-c0b2-4d02-ace3-3c1e52e2fb4b"
+
+// Subsampled samples alternate clear NAL headers and encrypted payloads.
+#define SUBSAMPLE_SIZE 4096
+#define SUBSAMPLE_CLEAR_SIZE 32
+
+#define IV_SIZE 8
+
+// Buffers left out of the sustained rates and latencies, the first one
+// waits for the license.
+#define WARMUP_BUFFERS 16
+
+// Buffers queued in appsrc, so that latencies do not include a deep queue.
+#define QUEUED_BUFFERS 4
+
+static const SprklToolKey key = {
+    { 0x10, 0x77, 0xef, 0xec, 0xc0, 0xb2, 0x4d, 0x02, 0xac, 0xe3, 0x3c, 0x1e, 0x52, 0xe2, 0xfb, 0x4b },
+    { 0x3c, 0x51, 0x1f, 0x46, 0xa9, 0x5e, 0x06, 0x2b, 0x8f, 0x73, 0x1d, 0x42, 0xd8, 0x15, 0xf9, 0x64 },
+};
+static const guint8 iv[IV_SIZE] = { 0x9a, 0x1b, 0x27, 0xe3, 0x00, 0x00, 0x00, 0x00 };
+
+typedef struct _BenchCase {
+    const gchar* name;
+    gsize sampleSize;
+    gboolean subsampled;
+    const gchar* caps;
+    GstClockTime duration;
+    // Filled in by prepare_case().
+    guint64 buffers;
+    GstBuffer* plaintext;
+    GstBuffer* ciphertext;
+    GstStructure* protection;
+} BenchCase;
+
+static BenchCase benchCases[] = {
+    { "audio", 768, FALSE, "audio/mpeg, mpegversion=(int)4, stream-format=(string)raw", GST_SECOND / 48, 0, NULL, NULL, NULL },
+    { "hd-frame", 64 * 1024, TRUE, "video/x-h264, stream-format=(string)byte-stream, alignment=(string)au", GST_SECOND / 30, 0, NULL, NULL, NULL },
+    { "4k-keyframe", 1024 * 1024, TRUE, "video/x-h264, stream-format=(string)byte-stream, alignment=(string)au", GST_SECOND / 30, 0, NULL, NULL, NULL },
+};
+
+typedef struct _BenchRun {
+    const BenchCase* benchCase;
+    gboolean decrypt;
+    GstElement* pipeline;
+    GstElement* source;
+    GThread* feeder;
+    GstClockTime* pushTimes;
+    GstClockTime* latencies;
+    guint64 received;
+    GstClockTime startTime;
+    GstClockTime firstBufferTime;
+    GstClockTime measureStart;
+    GstClockTime measureEnd;
+    gboolean protectionSent;
+    gboolean verified;
+} BenchRun;
+
+static GstBuffer*
+subsamples_buffer(gsize sampleSize, guint* count)
+{
+    GByteArray* entries = g_byte_array_new();
+    *count = 0;
+    for (gsize offset = 0; offset < sampleSize; offset += SUBSAMPLE_SIZE) {
+        guint16 clear = SUBSAMPLE_CLEAR_SIZE;
+        guint32 encrypted = MIN(SUBSAMPLE_SIZE, sampleSize - offset) - clear;
+        guint8 entry[6] = { clear >> 8, clear & 0xff, encrypted >> 24, (encrypted >> 16) & 0xff, (encrypted >> 8) & 0xff, encrypted & 0xff };
+        g_byte_array_append(entries, entry, sizeof(entry));
+        (*count)++;
+    }
+    guint size = entries->len;
+    return gst_buffer_new_wrapped(g_byte_array_free(entries, FALSE), size);
+}
+
+// Generates the plaintext sample of the case, and its encryption. AES-CTR
+// being symmetric, decrypting the plaintext with the key encrypts it. All the
+// samples of a case share the same IV, which does not matter to throughput.
+static gboolean
+prepare_case(BenchCase* benchCase, struct OpenCDMSession* session, guint64 megabytes)
+{
+    benchCase->buffers = MAX(megabytes * 1000000 / benchCase->sampleSize, WARMUP_BUFFERS * 4);
+
+    guint8* data = g_malloc(benchCase->sampleSize);
+    for (gsize i = 0; i < benchCase->sampleSize; i++)
+        data[i] = (i * 31 + (i >> 8)) & 0xff;
+    benchCase->plaintext = gst_buffer_new_wrapped(data, benchCase->sampleSize);
+    benchCase->ciphertext = gst_buffer_copy_deep(benchCase->plaintext);
+
+    GstBuffer* kid = gst_buffer_new_memdup(key.id, sizeof(key.id));
+    GstBuffer* ivBuffer = gst_buffer_new_memdup(iv, sizeof(iv));
+    guint subSampleCount = 0;
+    GstBuffer* subSamples = benchCase->subsampled ? subsamples_buffer(benchCase->sampleSize, &subSampleCount) : NULL;
+
+    gboolean success = opencdm_gstreamer_session_decrypt(session, benchCase->ciphertext, subSamples, subSampleCount, ivBuffer, kid, 0) == ERROR_NONE;
+
+    benchCase->protection = gst_structure_new("application/x-cenc",
+        "iv_size", G_TYPE_UINT, IV_SIZE,
+        "encrypted", G_TYPE_BOOLEAN, TRUE,
+        "kid", GST_TYPE_BUFFER, kid,
+        "iv", GST_TYPE_BUFFER, ivBuffer,
+        "subsample_count", G_TYPE_UINT, subSampleCount,
+        NULL);
+    if (subSamples)
+        gst_structure_set(benchCase->protection, "subsamples", GST_TYPE_BUFFER, subSamples, NULL);
+
+    gst_buffer_unref(kid);
+    gst_buffer_unref(ivBuffer);
+    if (subSamples)
+        gst_buffer_unref(subSamples);
+    return success;
+}
+
+static void
+clear_case(BenchCase* benchCase)
+{
+    g_clear_pointer(&benchCase->plaintext, gst_buffer_unref);
+    g_clear_pointer(&benchCase->ciphertext, gst_buffer_unref);
+    g_clear_pointer(&benchCase->protection, gst_structure_free);
+}
+
+static GstCaps*
+stream_caps(const BenchCase* benchCase, gboolean encrypted)
+{
+    GstCaps* caps = gst_caps_from_string(benchCase->caps);
+    if (encrypted) {
+        GstStructure* structure = gst_caps_get_structure(caps, 0);
+        gst_structure_set(structure, "original-media-type", G_TYPE_STRING, gst_structure_get_name(structure),
+            "protection-system", G_TYPE_STRING, CLEARKEY_UUID, NULL);
+        gst_structure_set_name(structure, "application/x-cenc");
+    }
+    return caps;
+}
+
+static GstEvent*
+protection_event(void)
+{
+    g_autofree gchar* markup = g_strdup_printf("<ContentProtection xmlns:cenc=\"urn:mpeg:cenc:2013\" schemeIdUri=\"urn:uuid:" CLEARKEY_UUID "\" "
+                                               "cenc:default_KID=\"%08x-%04x-%04x-%04x-%04x%08x\"/>",
+        GST_READ_UINT32_BE(key.id), GST_READ_UINT16_BE(key.id + 4), GST_READ_UINT16_BE(key.id + 6), GST_READ_UINT16_BE(key.id + 8),
+        GST_READ_UINT16_BE(key.id + 10), GST_READ_UINT32_BE(key.id + 12));
+    gsize size = strlen(markup);
+    GstBuffer* data = gst_buffer_new_wrapped(g_steal_pointer(&markup), size);
+    GstEvent* event = gst_event_new_protection(CLEARKEY_UUID, data, "dash/mpd");
+    gst_buffer_unref(data);
+    return event;
+}
+
+static GstPadProbeReturn
+on_buffer_pushed(GstPad* pad, GstPadProbeInfo* info, gpointer userData)
+{
+    BenchRun* run = userData;
+    GstBuffer* buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+
+    // Like demuxers, announce the protection once caps and segment are out.
+    if (run->decrypt && !run->protectionSent) {
+        run->protectionSent = TRUE;
+        gst_pad_push_event(pad, protection_event());
+    }
+
+    run->pushTimes[GST_BUFFER_OFFSET(buffer)] = gst_util_get_timestamp();
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+on_handoff(GstElement* sink, GstBuffer* buffer, GstPad* pad, gpointer userData)
+{
+    (void)sink;
+    (void)pad;
+    BenchRun* run = userData;
+    GstClockTime now = gst_util_get_timestamp();
+    guint64 index = GST_BUFFER_OFFSET(buffer);
+
+    if (!index) {
+        run->firstBufferTime = now;
+        // Only the first buffer is checked, to keep comparisons out of the
+        // measurements.
+        GstMapInfo info;
+        if (gst_buffer_get_size(buffer) == run->benchCase->sampleSize && gst_buffer_map(run->benchCase->plaintext, &info, GST_MAP_READ)) {
+            run->verified = !gst_buffer_memcmp(buffer, 0, info.data, info.size);
+            gst_buffer_unmap(run->benchCase->plaintext, &info);
+        }
+    }
+
+    run->latencies[run->received++] = now - run->pushTimes[index];
+    if (run->received == WARMUP_BUFFERS)
+        run->measureStart = now;
+    run->measureEnd = now;
+}
+
+static gpointer
+feed_buffers(gpointer data)
+{
+    BenchRun* run = data;
+    const BenchCase* benchCase = run->benchCase;
+    GstBuffer* sample = run->decrypt ? benchCase->ciphertext : benchCase->plaintext;
+
+    for (guint64 i = 0; i < benchCase->buffers; i++) {
+        // Demuxers hand out a fresh writable buffer per sample.
+        GstBuffer* buffer = gst_buffer_new_allocate(NULL, benchCase->sampleSize, NULL);
+        GstMapInfo info;
+        gst_buffer_map(sample, &info, GST_MAP_READ);
+        gst_buffer_fill(buffer, 0, info.data, info.size);
+        gst_buffer_unmap(sample, &info);
+        GST_BUFFER_PTS(buffer) = i * benchCase->duration;
+        GST_BUFFER_DURATION(buffer) = benchCase->duration;
+        GST_BUFFER_OFFSET(buffer) = i;
+        if (run->decrypt)
+            gst_buffer_add_protection_meta(buffer, gst_structure_copy(benchCase->protection));
+
+        if (gst_app_src_push_buffer(GST_APP_SRC(run->source), buffer) != GST_FLOW_OK)
+            return NULL;
+    }
+    gst_app_src_end_of_stream(GST_APP_SRC(run->source));
+    return NULL;
+}
+
+static void
+answer_challenge(GstMessage* message)
+{
+    g_autofree gchar* response = sprkl_tool_clearkey_license(&key, 1);
+    gsize size = strlen(response);
+    GstBuffer* buffer = gst_buffer_new_wrapped(g_steal_pointer(&response), size);
+
+    GstElement* decryptor = GST_ELEMENT_CAST(GST_MESSAGE_SRC(message));
+    const gchar* sessionId = gst_structure_get_string(gst_message_get_structure(message), "session-id");
+    GstPad* pad = gst_element_get_static_pad(decryptor, "sink");
+    GstPad* peer = gst_pad_get_peer(pad);
+    gst_pad_push_event(peer, gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM_OOB, gst_structure_new("spkl-session-update", "message", GST_TYPE_BUFFER, buffer, "session-id", G_TYPE_STRING, sessionId, NULL)));
+    gst_object_unref(peer);
+    gst_object_unref(pad);
+    gst_buffer_unref(buffer);
+}
+
+static gint
+compare_times(gconstpointer a, gconstpointer b)
+{
+    GstClockTime first = *(const GstClockTime*)a;
+    GstClockTime second = *(const GstClockTime*)b;
+    return first < second ? -1 : first > second;
+}
+
+static double
+percentile(const GstClockTime* sorted, guint64 count, guint rank)
+{
+    return sorted[MIN(count * rank / 100, count - 1)] / 1000.;
+}
+
+// Returns the sustained buffer rate, or 0 on failure.
+static double
+run_pipeline(const BenchCase* benchCase, gboolean decrypt, double baselineRate, gboolean first)
+{
+    BenchRun run = { 0 };
+    run.benchCase = benchCase;
+    run.decrypt = decrypt;
+
+    GError* error = NULL;
+    run.pipeline = gst_parse_launch(decrypt ? "appsrc name=source ! sprkldecryptor ! fakesink name=sink"
+                                            : "appsrc name=source ! identity ! fakesink name=sink",
+        &error);
+    if (!run.pipeline) {
+        g_printerr("Unable to build the pipeline: %s\n", error->message);
+        g_error_free(error);
+        return 0;
+    }
+
+    GstCaps* caps = stream_caps(benchCase, decrypt);
+    run.source = gst_bin_get_by_name(GST_BIN(run.pipeline), "source");
+    g_object_set(run.source, "caps", caps, "format", GST_FORMAT_TIME, "block", TRUE,
+        "max-bytes", (guint64)(QUEUED_BUFFERS * benchCase->sampleSize), NULL);
+    gst_caps_unref(caps);
+
+    GstElement* sink = gst_bin_get_by_name(GST_BIN(run.pipeline), "sink");
+    g_object_set(sink, "sync", FALSE, "signal-handoffs", TRUE, NULL);
+    g_signal_connect(sink, "handoff", G_CALLBACK(on_handoff), &run);
+    gst_object_unref(sink);
+
+    GstPad* pad = gst_element_get_static_pad(run.source, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_buffer_pushed, &run, NULL);
+    gst_object_unref(pad);
+
+    run.pushTimes = g_new0(GstClockTime, benchCase->buffers);
+    run.latencies = g_new0(GstClockTime, benchCase->buffers);
+
+    gboolean success = TRUE;
+    GstBus* bus = gst_element_get_bus(run.pipeline);
+    run.startTime = gst_util_get_timestamp();
+    gst_element_set_state(run.pipeline, GST_STATE_PLAYING);
+    run.feeder = g_thread_new("feeder", feed_buffers, &run);
+
+    for (gboolean done = FALSE; !done;) {
+        GstMessage* message = gst_bus_timed_pop_filtered(bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_ELEMENT | GST_MESSAGE_ERROR | GST_MESSAGE_EOS);
+        switch (GST_MESSAGE_TYPE(message)) {
+        case GST_MESSAGE_ELEMENT:
+            if (gst_message_has_name(message, "spkl-challenge"))
+                answer_challenge(message);
+            break;
+        case GST_MESSAGE_ERROR: {
+            GError* messageError = NULL;
+            gst_message_parse_error(message, &messageError, NULL);
+            g_printerr("Pipeline error: %s\n", messageError->message);
+            g_error_free(messageError);
+            success = FALSE;
+            done = TRUE;
+            break;
+        }
+        default:
+            done = TRUE;
+            break;
+        }
+        gst_message_unref(message);
+    }
+
+    // Unblocks the feeder on errors.
+    gst_element_set_state(run.pipeline, GST_STATE_NULL);
+    g_thread_join(run.feeder);
+    gst_object_unref(bus);
+    gst_object_unref(run.source);
+    gst_object_unref(run.pipeline);
+
+    if (success && (run.received != benchCase->buffers || !run.verified)) {
+        g_printerr("%s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " buffers received, %s\n", benchCase->name, run.received, benchCase->buffers,
+            run.verified ? "verified" : "output mismatch");
+        success = FALSE;
+    }
+
+    double rate = 0;
+    if (success) {
+        guint64 measured = run.received - WARMUP_BUFFERS;
+        GstClockTime elapsed = MAX(run.measureEnd - run.measureStart, 1);
+        rate = measured * 1e9 / elapsed;
+        GstClockTime* sorted = run.latencies + WARMUP_BUFFERS;
+        qsort(sorted, measured, sizeof(GstClockTime), compare_times);
+
+        g_print("%s    {\"sample\": \"%s\", \"sample_size\": %" G_GSIZE_FORMAT ", \"layout\": \"%s\", \"mode\": \"%s\", \"buffers\": %" G_GUINT64_FORMAT ", "
+                "\"first_buffer_ms\": %.2f, \"buffers_per_s\": %.1f, \"mb_per_s\": %.2f, "
+                "\"latency_us\": {\"p50\": %.1f, \"p95\": %.1f, \"p99\": %.1f}",
+            first ? "" : ",\n", benchCase->name, benchCase->sampleSize, benchCase->subsampled ? "subsampled" : "full", decrypt ? "decrypt" : "passthrough",
+            run.received, (run.firstBufferTime - run.startTime) / 1e6, rate, rate * benchCase->sampleSize / 1e6,
+            percentile(sorted, measured, 50), percentile(sorted, measured, 95), percentile(sorted, measured, 99));
+        if (decrypt && baselineRate > 0)
+            g_print(", \"overhead_ns_per_buffer\": %.1f", (1 / rate - 1 / baselineRate) * 1e9);
+        g_print("}");
+    }
+
+    g_free(run.pushTimes);
+    g_free(run.latencies);
+    return rate;
+}
+
+int main(int argc, char** argv)
+{
+    gst_init(&argc, &argv);
+
+    guint64 megabytes = argc > 1 ? g_ascii_strtoull(argv[1], NULL, 10) : 128;
+    if (!megabytes) {
+        g_printerr("Invalid amount of data\n");
+        return EXIT_FAILURE;
+    }
+
+    GstElementFactory* factory = gst_element_factory_find("sprkldecryptor");
+    if (!factory) {
+        g_printerr("sprkldecryptor not found, check GST_PLUGIN_PATH\n");
+        return EXIT_FAILURE;
+    }
+    gst_object_unref(factory);
+
+    struct OpenCDMSystem* system = opencdm_create_system(CLEARKEY_KEY_SYSTEM);
+    if (!system) {
+        g_printerr("ClearKey module not found, check WEBKIT_SPARKLE_CDM_MODULE_PATH\n");
+        return EXIT_FAILURE;
+    }
+
+    struct OpenCDMSession* session = sprkl_tool_create_clearkey_session(system, &key, 1);
+    gboolean success = session != NULL;
+    for (guint i = 0; i < G_N_ELEMENTS(benchCases) && success; i++)
+        success = prepare_case(&benchCases[i], session, megabytes);
+    if (session)
+        opencdm_destruct_session(session);
+    opencdm_destruct_system(system);
+    if (!success) {
+        g_printerr("Unable to encrypt the samples\n");
+        return EXIT_FAILURE;
+    }
+
+    gboolean first = TRUE;
+    g_print("{\"benchmark\": \"pipeline-throughput\", \"megabytes_per_case\": %" G_GUINT64_FORMAT ", \"cases\": [\n", megabytes);
+    for (guint i = 0; i < G_N_ELEMENTS(benchCases) && success; i++) {
+        double baselineRate = run_pipeline(&benchCases[i], FALSE, 0, first);
+        first = FALSE;
+        success = baselineRate > 0 && run_pipeline(&benchCases[i], TRUE, baselineRate, first) > 0;
+    }
+    g_print("\n]}\n");
+
+    for (guint i = 0; i < G_N_ELEMENTS(benchCases); i++)
+        clear_case(&benchCases[i]);
+    gst_deinit();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,558 @@
+// SPDX-License-Identifier: MIT
+
+#include "open_cdm.h"
+#include "open_cdm_adapter.h"
+#include "sprkl-tool.h"
+#include <gst/app/gstappsrc.h>
+#include <gst/gst.h>
+#include <libsoup/soup.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Runs an increasing number of concurrent appsrc ! sprkldecryptor ! fakesink
+// pipelines in one process, each with its own ClearKey key, against a
+// ClearKey license server listening on loopback. For each round, reports the
+// session setup latency (protection event to license applied), the time to
+// the first decrypted buffer and the aggregate decryption throughput, which
+// expose contention in the process-wide registries and session locks.
+// Results are printed as JSON.
+//
+// Usage: sprkl-bench-session-load [MAX_SESSIONS] [BUFFERS]
+//
+// Rounds double the number of pipelines up to MAX_SESSIONS, 32 by default.
+// Each pipeline decrypts BUFFERS frames of 64 KiB, 256 by default. The
+// ClearKey module is looked up in WEBKIT_SPARKLE_CDM_MODULE_PATH and the
+// element in GST_PLUGIN_PATH.
+
+#define CLEARKEY_KEY_SYSTEM "org.w3.clearkey"
+#define CLEARKEY_UUID "1077efec-c0b2-4d02-ace3-3c1e52e2fb4b"
+
+#define SAMPLE_SIZE (64 * 1024)
+#define SAMPLE_DURATION (GST_SECOND / 30)
+#define IV_SIZE 8
+#define QUEUED_BUFFERS 4
+
+static const guint8 iv[IV_SIZE] = { 0x9a, 0x1b, 0x27, 0xe3, 0x00, 0x00, 0x00, 0x00 };
+
+typedef struct _LicenseServer {
+    GMainContext* context;
+    GMainLoop* loop;
+    GThread* thread;
+    SoupServer* server;
+    gchar* url;
+    gint requests;
+} LicenseServer;
+
+typedef struct _BenchPipeline {
+    guint index;
+    guint64 buffers;
+    SoupSession* soupSession;
+    const gchar* licenseUrl;
+    gchar* sessionId;
+    guint8 keyID[16];
+    GstBuffer* ciphertext;
+    GstStructure* protection;
+    GstElement* pipeline;
+    GstElement* source;
+    GThread* feeder;
+    gboolean protectionSent;
+    gboolean verified;
+    gboolean failed;
+    gboolean finished;
+    guint64 received;
+    GstClockTime protectionTime;
+    GstClockTime licenseTime;
+    GstClockTime firstBufferTime;
+    GstClockTime lastBufferTime;
+} BenchPipeline;
+
+typedef struct _BenchRound {
+    GMainLoop* loop;
+    guint pending;
+} BenchRound;
+
+static GstBuffer* plaintext;
+
+// The server knows all the keys, derived from their ID.
+static void
+derive_key(const guint8* keyID, SprklToolKey* key)
+{
+    memcpy(key->id, keyID, sizeof(key->id));
+    for (guint i = 0; i < 16; i++)
+        key->value[i] = keyID[15 - i] ^ (0xa5 + i * 7);
+}
+
+// Answers {"kids":["base64url", ...],"type":"temporary"} requests with a JWK
+// set holding the keys. No need for a JSON parser for these.
+static void
+handle_license(SoupServer* server, SoupServerMessage* message, const char* path, GHashTable* query, gpointer userData)
+{
+    (void)server;
+    (void)path;
+    (void)query;
+    LicenseServer* licenseServer = userData;
+    g_atomic_int_inc(&licenseServer->requests);
+
+    SoupMessageBody* body = soup_server_message_get_request_body(message);
+    g_autoptr(GBytes) request = soup_message_body_flatten(body);
+    gsize size;
+    const gchar* data = g_bytes_get_data(request, &size);
+    g_autofree gchar* json = g_strndup(data, size);
+
+    GArray* keys = g_array_new(FALSE, FALSE, sizeof(SprklToolKey));
+    const gchar* kids = strstr(json, "\"kids\"");
+    const gchar* position = kids ? strchr(kids, '[') : NULL;
+    const gchar* end = position ? strchr(position, ']') : NULL;
+    while (position && end) {
+        const gchar* start = strchr(position, '"');
+        if (!start || start > end)
+            break;
+        const gchar* stop = strchr(start + 1, '"');
+        if (!stop)
+            break;
+
+        g_autofree gchar* kid = g_strndup(start + 1, stop - start - 1);
+        g_strdelimit(kid, "-", '+');
+        g_strdelimit(kid, "_", '/');
+        g_autofree gchar* padded = g_strdup_printf("%s%.*s", kid, (int)((4 - strlen(kid) % 4) % 4), "==");
+        gsize keyIDSize;
+        g_autofree guchar* keyID = g_base64_decode(padded, &keyIDSize);
+        if (keyIDSize == 16) {
+            SprklToolKey key;
+            derive_key(keyID, &key);
+            g_array_append_val(keys, key);
+        }
+        position = stop + 1;
+    }
+    gchar* license = sprkl_tool_clearkey_license((const SprklToolKey*)keys->data, keys->len);
+    soup_server_message_set_response(message, "application/json", SOUP_MEMORY_TAKE, license, strlen(license));
+    soup_server_message_set_status(message, keys->len ? SOUP_STATUS_OK : SOUP_STATUS_BAD_REQUEST, NULL);
+    g_array_unref(keys);
+}
+
+static gpointer
+run_server(gpointer data)
+{
+    LicenseServer* licenseServer = data;
+    g_main_context_push_thread_default(licenseServer->context);
+    g_main_loop_run(licenseServer->loop);
+    g_main_context_pop_thread_default(licenseServer->context);
+    return NULL;
+}
+
+// Listens on loopback, serving requests from a thread of its own as a remote
+// server would.
+static gboolean
+start_server(LicenseServer* licenseServer)
+{
+    licenseServer->context = g_main_context_new();
+    licenseServer->loop = g_main_loop_new(licenseServer->context, FALSE);
+
+    g_main_context_push_thread_default(licenseServer->context);
+    licenseServer->server = soup_server_new(NULL, NULL);
+    soup_server_add_handler(licenseServer->server, "/license", handle_license, licenseServer, NULL);
+    GError* error = NULL;
+    gboolean listening = soup_server_listen_local(licenseServer->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+    g_main_context_pop_thread_default(licenseServer->context);
+    if (!listening) {
+        g_printerr("Unable to start the license server: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    GSList* uris = soup_server_get_uris(licenseServer->server);
+    g_autofree gchar* uri = g_uri_to_string(uris->data);
+    g_slist_free_full(uris, (GDestroyNotify)g_uri_unref);
+    licenseServer->url = g_strdup_printf("%slicense", uri);
+
+    licenseServer->thread = g_thread_new("license-server", run_server, licenseServer);
+    return TRUE;
+}
+
+static void
+stop_server(LicenseServer* licenseServer)
+{
+    g_main_loop_quit(licenseServer->loop);
+    g_thread_join(licenseServer->thread);
+    g_object_unref(licenseServer->server);
+    g_main_loop_unref(licenseServer->loop);
+    g_main_context_unref(licenseServer->context);
+    g_free(licenseServer->url);
+}
+
+// Encrypts the plaintext sample with the key of the pipeline. AES-CTR being
+// symmetric, decrypting the plaintext with the key encrypts it.
+static gboolean
+encrypt_sample(BenchPipeline* benchPipeline, struct OpenCDMSystem* system)
+{
+    SprklToolKey key;
+    derive_key(benchPipeline->keyID, &key);
+    struct OpenCDMSession* session = sprkl_tool_create_clearkey_session(system, &key, 1);
+    if (!session)
+        return FALSE;
+
+    GstBuffer* keyID = gst_buffer_new_memdup(benchPipeline->keyID, 16);
+    GstBuffer* ivBuffer = gst_buffer_new_memdup(iv, sizeof(iv));
+    benchPipeline->ciphertext = gst_buffer_copy_deep(plaintext);
+    gboolean success = opencdm_gstreamer_session_decrypt(session, benchPipeline->ciphertext, NULL, 0, ivBuffer, keyID, 0) == ERROR_NONE;
+    opencdm_destruct_session(session);
+
+    benchPipeline->protection = gst_structure_new("application/x-cenc",
+        "iv_size", G_TYPE_UINT, IV_SIZE,
+        "encrypted", G_TYPE_BOOLEAN, TRUE,
+        "kid", GST_TYPE_BUFFER, keyID,
+        "iv", GST_TYPE_BUFFER, ivBuffer,
+        "subsample_count", G_TYPE_UINT, 0,
+        NULL);
+    gst_buffer_unref(keyID);
+    gst_buffer_unref(ivBuffer);
+    return success;
+}
+
+static GstEvent*
+protection_event(const guint8* keyID)
+{
+    g_autofree gchar* markup = g_strdup_printf("<ContentProtection xmlns:cenc=\"urn:mpeg:cenc:2013\" schemeIdUri=\"urn:uuid:" CLEARKEY_UUID "\" "
+                                               "cenc:default_KID=\"%08x-%04x-%04x-%04x-%04x%08x\"/>",
+        GST_READ_UINT32_BE(keyID), GST_READ_UINT16_BE(keyID + 4), GST_READ_UINT16_BE(keyID + 6), GST_READ_UINT16_BE(keyID + 8),
+        GST_READ_UINT16_BE(keyID + 10), GST_READ_UINT32_BE(keyID + 12));
+    gsize size = strlen(markup);
+    GstBuffer* data = gst_buffer_new_wrapped(g_steal_pointer(&markup), size);
+    GstEvent* event = gst_event_new_protection(CLEARKEY_UUID, data, "dash/mpd");
+    gst_buffer_unref(data);
+    return event;
+}
+
+static GstPadProbeReturn
+on_buffer_pushed(GstPad* pad, GstPadProbeInfo* info, gpointer userData)
+{
+    (void)info;
+    BenchPipeline* benchPipeline = userData;
+
+    // Like demuxers, announce the protection once caps and segment are out.
+    if (!benchPipeline->protectionSent) {
+        benchPipeline->protectionSent = TRUE;
+        benchPipeline->protectionTime = gst_util_get_timestamp();
+        gst_pad_push_event(pad, protection_event(benchPipeline->keyID));
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+on_handoff(GstElement* sink, GstBuffer* buffer, GstPad* pad, gpointer userData)
+{
+    (void)sink;
+    (void)pad;
+    BenchPipeline* benchPipeline = userData;
+    GstClockTime now = gst_util_get_timestamp();
+
+    if (!benchPipeline->received++) {
+        benchPipeline->firstBufferTime = now;
+        GstMapInfo info;
+        if (gst_buffer_get_size(buffer) == SAMPLE_SIZE && gst_buffer_map(plaintext, &info, GST_MAP_READ)) {
+            benchPipeline->verified = !gst_buffer_memcmp(buffer, 0, info.data, info.size);
+            gst_buffer_unmap(plaintext, &info);
+        }
+    }
+    benchPipeline->lastBufferTime = now;
+}
+
+static gpointer
+feed_buffers(gpointer data)
+{
+    BenchPipeline* benchPipeline = data;
+    GstMapInfo info;
+    gst_buffer_map(benchPipeline->ciphertext, &info, GST_MAP_READ);
+
+    for (guint64 i = 0; i < benchPipeline->buffers; i++) {
+        GstBuffer* buffer = gst_buffer_new_allocate(NULL, SAMPLE_SIZE, NULL);
+        gst_buffer_fill(buffer, 0, info.data, info.size);
+        GST_BUFFER_PTS(buffer) = i * SAMPLE_DURATION;
+        GST_BUFFER_DURATION(buffer) = SAMPLE_DURATION;
+        gst_buffer_add_protection_meta(buffer, gst_structure_copy(benchPipeline->protection));
+        if (gst_app_src_push_buffer(GST_APP_SRC(benchPipeline->source), buffer) != GST_FLOW_OK)
+            break;
+    }
+
+    gst_buffer_unmap(benchPipeline->ciphertext, &info);
+    gst_app_src_end_of_stream(GST_APP_SRC(benchPipeline->source));
+    return NULL;
+}
+
+// The pipeline is stopped along with the others once the round is over.
+static void
+finish_pipeline(BenchPipeline* benchPipeline)
+{
+    BenchRound* round = g_object_get_data(G_OBJECT(benchPipeline->pipeline), "bench-round");
+    if (benchPipeline->finished)
+        return;
+    benchPipeline->finished = TRUE;
+    if (!--round->pending)
+        g_main_loop_quit(round->loop);
+}
+
+static void
+on_license(GObject* object, GAsyncResult* result, gpointer userData)
+{
+    BenchPipeline* benchPipeline = userData;
+    GError* error = NULL;
+    GBytes* response = soup_session_send_and_read_finish(SOUP_SESSION(object), result, &error);
+    if (!response) {
+        g_printerr("Pipeline %u: license request failed: %s\n", benchPipeline->index, error->message);
+        g_error_free(error);
+        // The round would otherwise wait for buffers that cannot be decrypted.
+        benchPipeline->failed = TRUE;
+        finish_pipeline(benchPipeline);
+        return;
+    }
+
+    GstBuffer* message = gst_buffer_new_wrapped_bytes(response);
+    g_bytes_unref(response);
+
+    GstPad* pad = gst_element_get_static_pad(benchPipeline->source, "src");
+    gst_pad_push_event(pad, gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM_OOB, gst_structure_new("spkl-session-update", "message", GST_TYPE_BUFFER, message, "session-id", G_TYPE_STRING, benchPipeline->sessionId, NULL)));
+    benchPipeline->licenseTime = gst_util_get_timestamp();
+    gst_object_unref(pad);
+    gst_buffer_unref(message);
+}
+
+static void
+request_license(BenchPipeline* benchPipeline, GstMessage* message)
+{
+    GstBuffer* challenge = NULL;
+    gst_structure_get(gst_message_get_structure(message), "challenge", GST_TYPE_BUFFER, &challenge, NULL);
+    if (!challenge)
+        return;
+
+    g_free(benchPipeline->sessionId);
+    benchPipeline->sessionId = g_strdup(gst_structure_get_string(gst_message_get_structure(message), "session-id"));
+
+    GstMapInfo info;
+    gst_buffer_map(challenge, &info, GST_MAP_READ);
+    GBytes* body = g_bytes_new(info.data, info.size);
+    gst_buffer_unmap(challenge, &info);
+    gst_buffer_unref(challenge);
+
+    SoupMessage* request = soup_message_new(SOUP_METHOD_POST, benchPipeline->licenseUrl);
+    soup_message_set_request_body_from_bytes(request, "application/json", body);
+    soup_session_send_and_read_async(benchPipeline->soupSession, request, G_PRIORITY_DEFAULT, NULL, on_license, benchPipeline);
+    g_object_unref(request);
+    g_bytes_unref(body);
+}
+
+static gboolean
+on_bus_message(GstBus* bus, GstMessage* message, gpointer userData)
+{
+    (void)bus;
+    BenchPipeline* benchPipeline = userData;
+
+    switch (GST_MESSAGE_TYPE(message)) {
+    case GST_MESSAGE_ELEMENT:
+        if (gst_message_has_name(message, "spkl-challenge"))
+            request_license(benchPipeline, message);
+        break;
+    case GST_MESSAGE_ERROR: {
+        GError* error = NULL;
+        gst_message_parse_error(message, &error, NULL);
+        g_printerr("Pipeline %u error: %s\n", benchPipeline->index, error->message);
+        g_error_free(error);
+        benchPipeline->failed = TRUE;
+    }
+        // Fall through.
+    case GST_MESSAGE_EOS:
+        finish_pipeline(benchPipeline);
+        break;
+    default:
+        break;
+    }
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+setup_pipeline(BenchPipeline* benchPipeline, BenchRound* round)
+{
+    GError* error = NULL;
+    benchPipeline->pipeline = gst_parse_launch("appsrc name=source ! sprkldecryptor ! fakesink name=sink", &error);
+    if (!benchPipeline->pipeline) {
+        g_printerr("Unable to build the pipeline: %s\n", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+    g_object_set_data(G_OBJECT(benchPipeline->pipeline), "bench-round", round);
+
+    GstCaps* caps = gst_caps_from_string("application/x-cenc, original-media-type=(string)video/x-h264, "
+                                         "protection-system=(string)" CLEARKEY_UUID ", stream-format=(string)byte-stream, alignment=(string)au");
+    benchPipeline->source = gst_bin_get_by_name(GST_BIN(benchPipeline->pipeline), "source");
+    g_object_set(benchPipeline->source, "caps", caps, "format", GST_FORMAT_TIME, "block", TRUE,
+        "max-bytes", (guint64)(QUEUED_BUFFERS * SAMPLE_SIZE), NULL);
+    gst_caps_unref(caps);
+
+    GstElement* sink = gst_bin_get_by_name(GST_BIN(benchPipeline->pipeline), "sink");
+    g_object_set(sink, "sync", FALSE, "signal-handoffs", TRUE, NULL);
+    g_signal_connect(sink, "handoff", G_CALLBACK(on_handoff), benchPipeline);
+    gst_object_unref(sink);
+
+    GstPad* pad = gst_element_get_static_pad(benchPipeline->source, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, on_buffer_pushed, benchPipeline, NULL);
+    gst_object_unref(pad);
+
+    GstBus* bus = gst_element_get_bus(benchPipeline->pipeline);
+    gst_bus_add_watch(bus, on_bus_message, benchPipeline);
+    gst_object_unref(bus);
+    return TRUE;
+}
+
+static void
+teardown_pipeline(BenchPipeline* benchPipeline)
+{
+    if (benchPipeline->pipeline) {
+        // Unblocks the feeder on errors.
+        gst_element_set_state(benchPipeline->pipeline, GST_STATE_NULL);
+        if (benchPipeline->feeder)
+            g_thread_join(benchPipeline->feeder);
+        GstBus* bus = gst_element_get_bus(benchPipeline->pipeline);
+        gst_bus_remove_watch(bus);
+        gst_object_unref(bus);
+        gst_object_unref(benchPipeline->source);
+        gst_object_unref(benchPipeline->pipeline);
+    }
+    if (benchPipeline->ciphertext)
+        gst_buffer_unref(benchPipeline->ciphertext);
+    if (benchPipeline->protection)
+        gst_structure_free(benchPipeline->protection);
+    g_free(benchPipeline->sessionId);
+}
+
+static gint
+compare_times(gconstpointer a, gconstpointer b)
+{
+    GstClockTime first = *(const GstClockTime*)a;
+    GstClockTime second = *(const GstClockTime*)b;
+    return first < second ? -1 : first > second;
+}
+
+static gboolean
+run_round(guint sessions, guint round, guint64 buffers, SoupSession* soupSession, LicenseServer* licenseServer, struct OpenCDMSystem* system, gboolean first)
+{
+    BenchRound benchRound = { g_main_loop_new(NULL, FALSE), sessions };
+    BenchPipeline* pipelines = g_new0(BenchPipeline, sessions);
+    gint requests = g_atomic_int_get(&licenseServer->requests);
+
+    gboolean success = TRUE;
+    for (guint i = 0; i < sessions && success; i++) {
+        BenchPipeline* benchPipeline = &pipelines[i];
+        benchPipeline->index = i;
+        benchPipeline->buffers = buffers;
+        benchPipeline->soupSession = soupSession;
+        benchPipeline->licenseUrl = licenseServer->url;
+        // A distinct key per pipeline and round, so that no session is shared.
+        memset(benchPipeline->keyID, 0x5e, 12);
+        GST_WRITE_UINT16_BE(benchPipeline->keyID + 12, round);
+        GST_WRITE_UINT16_BE(benchPipeline->keyID + 14, i);
+        success = encrypt_sample(benchPipeline, system) && setup_pipeline(benchPipeline, &benchRound);
+    }
+
+    GstClockTime start = gst_util_get_timestamp();
+    for (guint i = 0; i < sessions && success; i++) {
+        gst_element_set_state(pipelines[i].pipeline, GST_STATE_PLAYING);
+        pipelines[i].feeder = g_thread_new("feeder", feed_buffers, &pipelines[i]);
+    }
+    if (success)
+        g_main_loop_run(benchRound.loop);
+
+    GstClockTime* setupTimes = g_new0(GstClockTime, sessions);
+    GstClockTime* firstBufferTimes = g_new0(GstClockTime, sessions);
+    GstClockTime end = start;
+    guint64 bytes = 0;
+    for (guint i = 0; i < sessions && success; i++) {
+        BenchPipeline* benchPipeline = &pipelines[i];
+        if (benchPipeline->failed || benchPipeline->received != buffers || !benchPipeline->verified) {
+            g_printerr("Pipeline %u: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " buffers received, %s\n", i, benchPipeline->received, buffers,
+                benchPipeline->verified ? "verified" : "output mismatch");
+            success = FALSE;
+            break;
+        }
+        setupTimes[i] = benchPipeline->licenseTime - benchPipeline->protectionTime;
+        firstBufferTimes[i] = benchPipeline->firstBufferTime - start;
+        end = MAX(end, benchPipeline->lastBufferTime);
+        bytes += benchPipeline->received * SAMPLE_SIZE;
+    }
+
+    if (success) {
+        qsort(setupTimes, sessions, sizeof(GstClockTime), compare_times);
+        qsort(firstBufferTimes, sessions, sizeof(GstClockTime), compare_times);
+        g_print("%s    {\"sessions\": %u, \"license_requests\": %d, "
+                "\"setup_ms\": {\"p50\": %.2f, \"max\": %.2f}, \"first_buffer_ms\": {\"p50\": %.2f, \"max\": %.2f}, "
+                "\"aggregate_mb_per_s\": %.2f}",
+            first ? "" : ",\n", sessions, g_atomic_int_get(&licenseServer->requests) - requests,
+            setupTimes[sessions / 2] / 1e6, setupTimes[sessions - 1] / 1e6,
+            firstBufferTimes[sessions / 2] / 1e6, firstBufferTimes[sessions - 1] / 1e6,
+            bytes / 1e6 / ((end - start) / 1e9));
+    }
+
+    for (guint i = 0; i < sessions; i++)
+        teardown_pipeline(&pipelines[i]);
+    g_free(setupTimes);
+    g_free(firstBufferTimes);
+    g_free(pipelines);
+    g_main_loop_unref(benchRound.loop);
+    return success;
+}
+
+int main(int argc, char** argv)
+{
+    gst_init(&argc, &argv);
+
+    guint64 maxSessions = argc > 1 ? g_ascii_strtoull(argv[1], NULL, 10) : 32;
+    guint64 buffers = argc > 2 ? g_ascii_strtoull(argv[2], NULL, 10) : 256;
+    if (!maxSessions || maxSessions > G_MAXUINT16 || !buffers) {
+        g_printerr("Invalid number of sessions or buffers\n");
+        return EXIT_FAILURE;
+    }
+
+    GstElementFactory* factory = gst_element_factory_find("sprkldecryptor");
+    if (!factory) {
+        g_printerr("sprkldecryptor not found, check GST_PLUGIN_PATH\n");
+        return EXIT_FAILURE;
+    }
+    gst_object_unref(factory);
+
+    struct OpenCDMSystem* system = opencdm_create_system(CLEARKEY_KEY_SYSTEM);
+    if (!system) {
+        g_printerr("ClearKey module not found, check WEBKIT_SPARKLE_CDM_MODULE_PATH\n");
+        return EXIT_FAILURE;
+    }
+
+    LicenseServer licenseServer = { 0 };
+    if (!start_server(&licenseServer)) {
+        opencdm_destruct_system(system);
+        return EXIT_FAILURE;
+    }
+
+    guint8* data = g_malloc(SAMPLE_SIZE);
+    for (gsize i = 0; i < SAMPLE_SIZE; i++)
+        data[i] = (i * 31 + (i >> 8)) & 0xff;
+    plaintext = gst_buffer_new_wrapped(data, SAMPLE_SIZE);
+
+    // Do not let the connection limits serialize the license requests.
+    SoupSession* soupSession = soup_session_new_with_options("max-conns", 1024, "max-conns-per-host", 1024, NULL);
+
+    gboolean success = TRUE;
+    gboolean first = TRUE;
+    guint round = 0;
+    g_print("{\"benchmark\": \"session-load\", \"buffers_per_session\": %" G_GUINT64_FORMAT ", \"buffer_size\": %d, \"rounds\": [\n", buffers, SAMPLE_SIZE);
+    for (guint64 sessions = 1; success; sessions = MIN(sessions * 2, maxSessions)) {
+        success = run_round(sessions, round++, buffers, soupSession, &licenseServer, system, first);
+        first = FALSE;
+        if (sessions == maxSessions)
+            break;
+    }
+    g_print("\n]}\n");
+
+    g_object_unref(soupSession);
+    gst_buffer_unref(plaintext);
+    stop_server(&licenseServer);
+    opencdm_destruct_system(system);
+    gst_deinit();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
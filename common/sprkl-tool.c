@@ -0,0 +1,111 @@
+// SPDX-License-Identifier: MIT
+
+#include "sprkl-tool.h"
+#include <string.h>
+
+static void
+ignore_challenge(struct OpenCDMSession* session, void* userData, const char url[], const uint8_t challenge[], const uint16_t challengeLength)
+{
+    (void)session;
+    (void)userData;
+    (void)url;
+    (void)challenge;
+    (void)challengeLength;
+}
+
+static void
+ignore_key_update(struct OpenCDMSession* session, void* userData, const uint8_t keyId[], const uint8_t length)
+{
+    (void)session;
+    (void)userData;
+    (void)keyId;
+    (void)length;
+}
+
+static void
+print_error(struct OpenCDMSession* session, void* userData, const char message[])
+{
+    (void)session;
+    (void)userData;
+    g_printerr("CDM error: %s\n", message);
+}
+
+static void
+ignore_keys_updated(const struct OpenCDMSession* session, void* userData)
+{
+    (void)session;
+    (void)userData;
+}
+
+OpenCDMSessionCallbacks sprkl_tool_callbacks = {
+    ignore_challenge,
+    ignore_key_update,
+    print_error,
+    ignore_keys_updated,
+};
+
+gchar*
+sprkl_tool_base64url(const guint8* data, gsize size)
+{
+    gchar* encoded = g_base64_encode(data, size);
+    g_strdelimit(encoded, "+", '-');
+    g_strdelimit(encoded, "/", '_');
+    gchar* padding = strchr(encoded, '=');
+    if (padding)
+        *padding = '\0';
+    return encoded;
+}
+
+gchar*
+sprkl_tool_clearkey_license(const SprklToolKey* keys, gsize count)
+{
+    GString* license = g_string_new("{\"keys\":[");
+    for (gsize i = 0; i < count; i++) {
+        g_autofree gchar* kid = sprkl_tool_base64url(keys[i].id, sizeof(keys[i].id));
+        g_autofree gchar* key = sprkl_tool_base64url(keys[i].value, sizeof(keys[i].value));
+        g_string_append_printf(license, "%s{\"kty\":\"oct\",\"kid\":\"%s\",\"k\":\"%s\"}", i ? "," : "", kid, key);
+    }
+    g_string_append(license, "]}");
+    return g_string_free(license, FALSE);
+}
+
+struct OpenCDMSession*
+sprkl_tool_create_clearkey_session(struct OpenCDMSystem* system, const SprklToolKey* keys, gsize count)
+{
+    GString* initData = g_string_new("{\"kids\":[");
+    for (gsize i = 0; i < count; i++) {
+        g_autofree gchar* kid = sprkl_tool_base64url(keys[i].id, sizeof(keys[i].id));
+        g_string_append_printf(initData, "%s\"%s\"", i ? "," : "", kid);
+    }
+    g_string_append(initData, "]}");
+    g_autofree gchar* license = sprkl_tool_clearkey_license(keys, count);
+
+    struct OpenCDMSession* session = NULL;
+    OpenCDMError result = opencdm_construct_session(system, Temporary, "keyids", (const uint8_t*)initData->str, initData->len, NULL, 0, &sprkl_tool_callbacks, NULL, &session);
+    g_string_free(initData, TRUE);
+    if (result != ERROR_NONE)
+        return NULL;
+
+    if (opencdm_session_update(session, (const uint8_t*)license, strlen(license)) != ERROR_NONE) {
+        opencdm_destruct_session(session);
+        return NULL;
+    }
+    return session;
+}
+
+gchar*
+sprkl_tool_json_path(const gchar* path)
+{
+    g_autofree gchar* displayName = g_filename_display_name(path);
+    GString* json = g_string_new("\"");
+    for (const gchar* c = displayName; *c; c++) {
+        if (*c == '"' || *c == '\\')
+            g_string_append_printf(json, "\\%c", *c);
+        else if ((guchar)*c < 0x20)
+            g_string_append_printf(json, "\\u%04x", *c);
+        else
+            g_string_append_c(json, *c);
+    }
+    g_string_append_c(json, '"');
+    return g_string_free(json, FALSE);
+}
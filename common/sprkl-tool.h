@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include "open_cdm.h"
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+// Helpers shared by the benchmarks and the tools, which drive the CDM modules
+// through the OpenCDM entry points without a license server.
+
+typedef struct _SprklToolKey {
+    guint8 id[16];
+    guint8 value[16];
+} SprklToolKey;
+
+// Session callbacks ignoring everything but the errors, which are printed.
+extern OpenCDMSessionCallbacks sprkl_tool_callbacks;
+
+// Base64 URL encoding without padding, as used by ClearKey init data and
+// licenses.
+gchar* sprkl_tool_base64url(const guint8* data, gsize size);
+
+// JWK set holding the given keys, as answered by ClearKey license servers.
+gchar* sprkl_tool_clearkey_license(const SprklToolKey* keys, gsize count);
+
+// ClearKey session requesting the given keys and already updated with their
+// license, or NULL on failure.
+struct OpenCDMSession* sprkl_tool_create_clearkey_session(struct OpenCDMSystem* system, const SprklToolKey* keys,
+    gsize count);
+
+// Returns the path as a JSON string literal, quotes included. Paths that are
+// not valid UTF-8 are converted for display first.
+gchar* sprkl_tool_json_path(const gchar* path);
+
+G_END_DECLS
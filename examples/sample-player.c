@@ -10,22 +10,61 @@
 GST_DEBUG_CATEGORY(player_debug);
 #define GST_CAT_DEFAULT player_debug
 
+// License requests are sent from a worker thread of their own, with a
+// session keeping connections alive, so that neither the streaming threads
+// nor the main loop wait for the license server, and the tracks of a stream
+// get their licenses concurrently.
+typedef struct _LicenseClient {
+    GMainContext* context;
+    GMainLoop* loop;
+    GThread* thread;
+    SoupSession* soupSession;
+    // Only used on the license client thread.
+    GCancellable* cancellable;
+    guint pending;
+    gboolean stopping;
+} LicenseClient;
+
 typedef struct _AppData {
     GMainLoop* loop;
     GstElement* pipeline;
     GstBus* bus;
     SoupSession* soupSession;
+    LicenseClient licenseClient;
+    GMutex lock; // Protects the license URL, set from streaming threads.
     gboolean parsingLaurl;
     gchar* licenseUrl;
     GMarkupParser markupParser;
     GMarkupParseContext* markupParseContext;
     const gchar* system_uuid;
+    gint64 startTime;
+    gboolean playing;
 } AppData;
 
+typedef struct _LicenseRequest {
+    LicenseClient* client;
+    GstElement* decryptor;
+    gchar* sessionId;
+    gchar* url;
+    GBytes* challenge;
+    gint64 startTime;
+} LicenseRequest;
+
+static void
+license_request_free(LicenseRequest* request)
+{
+    gst_object_unref(request->decryptor);
+    g_free(request->sessionId);
+    g_free(request->url);
+    g_bytes_unref(request->challenge);
+    g_free(request);
+}
+
 static void
 app_data_free(AppData* app_data)
 {
     g_object_unref(app_data->soupSession);
+    g_mutex_clear(&app_data->lock);
     gst_object_unref(app_data->bus);
     gst_object_unref(app_data->pipeline);
     g_main_loop_unref(app_data->loop);
@@ -46,22 +85,126 @@ create_dummy_cookie()
     return cookie;
 }
 
-static GstBuffer*
-processChallenge(GstBuffer* challenge, AppData* app_data)
+static SoupSession*
+create_soup_session()
 {
-    GstMapInfo info = GST_MAP_INFO_INIT;
+    // Licenses are requested concurrently for all the tracks.
+    SoupSession* session = soup_session_new_with_options("max-conns-per-host", 8, NULL);
+    if (g_getenv("SAMPLE_PLAYER_SOUP_DEBUG")) {
+        g_autoptr(SoupLogger) logger = soup_logger_new(SOUP_LOGGER_LOG_HEADERS);
+        soup_session_add_feature(session, SOUP_SESSION_FEATURE(logger));
+    }
+    soup_session_add_feature_by_type(session, SOUP_TYPE_COOKIE_JAR);
+    SoupCookieJar* jar = SOUP_COOKIE_JAR(soup_session_get_feature(session, SOUP_TYPE_COOKIE_JAR));
+    soup_cookie_jar_add_cookie(jar, create_dummy_cookie());
+    return session;
+}
 
-    if (!app_data->licenseUrl) {
-        GST_WARNING("License URL not found. Not declared in DASH manifest?");
-        return NULL;
+static gpointer
+license_client_run(gpointer data)
+{
+    LicenseClient* client = (LicenseClient*)data;
+    g_main_context_push_thread_default(client->context);
+    client->soupSession = create_soup_session();
+    g_main_loop_run(client->loop);
+    g_clear_object(&client->soupSession);
+    g_main_context_pop_thread_default(client->context);
+    return NULL;
+}
+
+static void
+license_client_start(LicenseClient* client)
+{
+    client->context = g_main_context_new();
+    client->loop = g_main_loop_new(client->context, FALSE);
+    client->cancellable = g_cancellable_new();
+    client->pending = 0;
+    client->stopping = FALSE;
+    client->thread = g_thread_new("license-client", license_client_run, client);
+}
+
+// Runs on the license client thread, after the requests queued before it were
+// sent. The loop is quit once their callbacks ran.
+static gboolean
+license_client_shutdown(gpointer user_data)
+{
+    LicenseClient* client = (LicenseClient*)user_data;
+    client->stopping = TRUE;
+    g_cancellable_cancel(client->cancellable);
+    if (!client->pending)
+        g_main_loop_quit(client->loop);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+license_client_stop(LicenseClient* client)
+{
+    GSource* source = g_idle_source_new();
+    g_source_set_callback(source, license_client_shutdown, client, NULL);
+    g_source_attach(source, client->context);
+    g_source_unref(source);
+
+    g_thread_join(client->thread);
+    g_object_unref(client->cancellable);
+    g_main_loop_unref(client->loop);
+    g_main_context_unref(client->context);
+}
+
+static void
+license_received(GObject* object, GAsyncResult* result, gpointer user_data)
+{
+    LicenseRequest* request = (LicenseRequest*)user_data;
+    LicenseClient* client = request->client;
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GBytes) response = soup_session_send_and_read_finish(SOUP_SESSION(object), result, &error);
+    if (!--client->pending && client->stopping)
+        g_main_loop_quit(client->loop);
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        GST_DEBUG("License request for %s cancelled", GST_OBJECT_NAME(request->decryptor));
+        license_request_free(request);
+        return;
+    }
+    if (error) {
+        GST_WARNING("Error: %s", error->message);
+        license_request_free(request);
+        return;
     }
-    g_autoptr(SoupMessage) soup_msg = soup_message_new(SOUP_METHOD_POST, app_data->licenseUrl);
-    gst_buffer_map(challenge, &info, GST_MAP_READ);
-    gchar* request_type = (char)info.data[0] == '{' ? "application/json" : "application/octet-stream";
-    g_autoptr(GBytes) bytes = g_bytes_new(info.data, info.size);
 
-    soup_message_set_request_body_from_bytes(soup_msg, request_type, bytes);
-    gst_buffer_unmap(challenge, &info);
+    gst_println("License for %s received in %.1f ms", GST_OBJECT_NAME(request->decryptor),
+        (g_get_monotonic_time() - request->startTime) / 1000.);
+    g_autoptr(GstBuffer) resultMessage = gst_buffer_new_wrapped_bytes(response);
+    g_autoptr(GstPad) pad = gst_element_get_static_pad(request->decryptor, "sink");
+    g_autoptr(GstPad) peer = gst_pad_get_peer(pad);
+    if (peer)
+        gst_pad_push_event(peer,
+            gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM_OOB,
+                gst_structure_new("spkl-session-update", "message",
+                    GST_TYPE_BUFFER, resultMessage, "session-id", G_TYPE_STRING,
+                    request->sessionId, NULL)));
+    license_request_free(request);
+}
+
+// Runs on the license client thread.
+static gboolean
+send_license_request(gpointer user_data)
+{
+    LicenseRequest* request = (LicenseRequest*)user_data;
+    if (request->client->stopping) {
+        license_request_free(request);
+        return G_SOURCE_REMOVE;
+    }
+
+    g_autoptr(SoupMessage) soup_msg = soup_message_new(SOUP_METHOD_POST, request->url);
+    if (!soup_msg) {
+        GST_WARNING("Invalid license URL %s", request->url);
+        license_request_free(request);
+        return G_SOURCE_REMOVE;
+    }
+
+    gsize size;
+    const gchar* data = (const gchar*)g_bytes_get_data(request->challenge, &size);
+    const gchar* request_type = size && data[0] == '{' ? "application/json" : "application/octet-stream";
+    soup_message_set_request_body_from_bytes(soup_msg, request_type, request->challenge);
 
     const gchar* token = g_getenv("TOKEN");
     if (token) {
@@ -69,25 +212,54 @@ processChallenge(GstBuffer* challenge, AppData* app_data)
         soup_message_headers_replace(request_headers, "X-AxDRM-Message", token);
     }
 
-    g_autoptr(GError) error = NULL;
-    g_autoptr(GBytes) response = soup_session_send_and_read(app_data->soupSession, soup_msg, NULL, &error);
-    if (error) {
-        GST_WARNING("Error: %s", error->message);
-        return NULL;
+    request->client->pending++;
+    soup_session_send_and_read_async(request->client->soupSession, soup_msg, G_PRIORITY_DEFAULT,
+        request->client->cancellable, license_received, request);
+    return G_SOURCE_REMOVE;
+}
+
+// Called from the streaming thread posting the challenge, the request is
+// handed over to the license client without waiting for the main loop.
+static void
+processChallenge(GstElement* decryptor, const gchar* sessionId, GstBuffer* challenge, AppData* app_data)
+{
+    g_mutex_lock(&app_data->lock);
+    gchar* url = g_strdup(app_data->licenseUrl);
+    g_mutex_unlock(&app_data->lock);
+    if (!url) {
+        GST_WARNING("License URL not found. Not declared in DASH manifest?");
+        return;
     }
-    return gst_buffer_new_wrapped_bytes(response);
+
+    GstMapInfo info = GST_MAP_INFO_INIT;
+    gst_buffer_map(challenge, &info, GST_MAP_READ);
+    LicenseRequest* request = g_new0(LicenseRequest, 1);
+    request->client = &app_data->licenseClient;
+    request->decryptor = gst_object_ref(decryptor);
+    request->sessionId = g_strdup(sessionId);
+    request->url = url;
+    request->challenge = g_bytes_new(info.data, info.size);
+    request->startTime = g_get_monotonic_time();
+    gst_buffer_unmap(challenge, &info);
+
+    GSource* source = g_idle_source_new();
+    g_source_set_callback(source, send_license_request, request, NULL);
+    g_source_attach(source, app_data->licenseClient.context);
+    g_source_unref(source);
 }
 
 static void
 extract_license_server_url(AppData* app_data, const guint8* data, gsize size)
 {
     g_autoptr(GError) error = NULL;
+    g_mutex_lock(&app_data->lock);
     if (!g_markup_parse_context_parse(app_data->markupParseContext,
             (const gchar*)data, size, &error)) {
         GST_WARNING("XML parse error: %s", error->message);
     } else {
         gst_println("License server URL: %s", app_data->licenseUrl);
     }
+    g_mutex_unlock(&app_data->lock);
 }
 
 static void
@@ -100,6 +272,10 @@ _bus_watch(G_GNUC_UNUSED GstBus* bus, GstMessage* msg, gpointer user_data)
             GstState old, new, pending;
 
             gst_message_parse_state_changed(msg, &old, &new, &pending);
+            if (new == GST_STATE_PLAYING && !app_data->playing) {
+                app_data->playing = TRUE;
+                gst_println("Playing after %.1f ms", (g_get_monotonic_time() - app_data->startTime) / 1000.);
+            }
 
             {
                 gchar* dump_name = g_strconcat("state_changed-",
@@ -134,45 +310,41 @@ _bus_watch(G_GNUC_UNUSED GstBus* bus, GstMessage* msg, gpointer user_data)
         g_main_loop_quit(app_data->loop);
         break;
     }
-    case GST_MESSAGE_ELEMENT: {
-        const GstStructure* structure = gst_message_get_structure(msg);
-        if (gst_structure_has_name(structure, "spkl-protection")) {
-            GstMapInfo info = GST_MAP_INFO_INIT;
-            GstBuffer* payload;
-            const gchar* origin;
-            const GstStructure* structure = gst_message_get_structure(msg);
-            gchar* dumped;
-            gst_structure_get(structure, "payload", GST_TYPE_BUFFER, &payload,
-                "origin", G_TYPE_STRING, &origin, NULL);
-            gst_printerrln("Protection data received from origin %s", origin);
-            gst_buffer_map(payload, &info, GST_MAP_READ);
-            dumped = (gchar*)info.data;
-            dumped[info.size] = 0;
-            gst_printerrln("payload: %s", dumped);
-            extract_license_server_url(app_data, info.data, info.size);
-            gst_buffer_unmap(payload, &info);
-        } else if (gst_structure_has_name(structure, "spkl-challenge")) {
-            GstBuffer* challenge;
-            gst_structure_get(structure, "challenge", GST_TYPE_BUFFER, &challenge,
-                NULL);
-            GstBuffer* resultMessage = processChallenge(challenge, app_data);
-            if (resultMessage) {
-                GstElement* decryptor = GST_ELEMENT_CAST(GST_MESSAGE_SRC(msg));
-                g_autoptr(GstPad) pad = gst_element_get_static_pad(decryptor, "sink");
-                g_autoptr(GstPad) peer = gst_pad_get_peer(pad);
-                gst_pad_push_event(peer,
-                    gst_event_new_custom(GST_EVENT_CUSTOM_DOWNSTREAM_OOB,
-                        gst_structure_new("spkl-session-update", "message",
-                            GST_TYPE_BUFFER, resultMessage, NULL)));
-            }
-        }
-        break;
-    }
     default:
         break;
     }
 }
 
+// Handled synchronously, so that the license request is sent as soon as the
+// challenge is posted, and the license URL known by then.
+static void
+handleElementMessage(G_GNUC_UNUSED GstBus* bus, GstMessage* msg,
+    gpointer user_data)
+{
+    AppData* app_data = (AppData*)user_data;
+    const GstStructure* structure = gst_message_get_structure(msg);
+    if (gst_structure_has_name(structure, "spkl-protection")) {
+        GstMapInfo info = GST_MAP_INFO_INIT;
+        GstBuffer* payload;
+        const gchar* origin;
+        gst_structure_get(structure, "payload", GST_TYPE_BUFFER, &payload,
+            "origin", G_TYPE_STRING, &origin, NULL);
+        gst_printerrln("Protection data received from origin %s", origin);
+        gst_buffer_map(payload, &info, GST_MAP_READ);
+        gst_printerrln("payload: %.*s", (int)info.size, (const gchar*)info.data);
+        extract_license_server_url(app_data, info.data, info.size);
+        gst_buffer_unmap(payload, &info);
+        gst_buffer_unref(payload);
+    } else if (gst_structure_has_name(structure, "spkl-challenge")) {
+        GstBuffer* challenge;
+        gst_structure_get(structure, "challenge", GST_TYPE_BUFFER, &challenge,
+            NULL);
+        processChallenge(GST_ELEMENT_CAST(GST_MESSAGE_SRC(msg)),
+            gst_structure_get_string(structure, "session-id"), challenge, app_data);
+        gst_buffer_unref(challenge);
+    }
+}
+
 static void
 handleNeedContextMessage(G_GNUC_UNUSED GstBus* bus, GstMessage* msg,
     gpointer user_data)
@@ -245,17 +417,9 @@ int main(int argc, char* argv[])
 
     AppData* app_data = g_new(AppData, 1);
     app_data->system_uuid = argv[1];
-    app_data->soupSession = soup_session_new();
-    if (g_getenv("SAMPLE_PLAYER_SOUP_DEBUG")) {
-        g_autoptr(SoupLogger) logger = soup_logger_new(SOUP_LOGGER_LOG_HEADERS);
-        soup_session_add_feature(app_data->soupSession,
-            SOUP_SESSION_FEATURE(logger));
-    }
-    soup_session_add_feature_by_type(app_data->soupSession,
-        SOUP_TYPE_COOKIE_JAR);
-    SoupCookieJar* jar = SOUP_COOKIE_JAR(soup_session_get_feature(app_data->soupSession,
-        SOUP_TYPE_COOKIE_JAR));
-    soup_cookie_jar_add_cookie(jar, create_dummy_cookie());
+    app_data->soupSession = create_soup_session();
+    g_mutex_init(&app_data->lock);
+    app_data->playing = FALSE;
 
     app_data->markupParser.start_element = markupStartElement;
     app_data->markupParser.end_element = markupEndElement;
@@ -280,15 +444,21 @@ int main(int argc, char* argv[])
     gst_bus_add_signal_watch(app_data->bus);
     g_signal_connect(app_data->bus, "sync-message::need-context",
         G_CALLBACK(handleNeedContextMessage), app_data);
+    g_signal_connect(app_data->bus, "sync-message::element",
+        G_CALLBACK(handleElementMessage), app_data);
     g_signal_connect(app_data->bus, "message", G_CALLBACK(_bus_watch),
         app_data);
 
     g_object_set(app_data->pipeline, "uri", argv[2], NULL);
 
+    license_client_start(&app_data->licenseClient);
+
     gst_println("Starting pipeline");
+    app_data->startTime = g_get_monotonic_time();
     gst_element_set_state(GST_ELEMENT(app_data->pipeline), GST_STATE_PLAYING);
     g_main_loop_run(app_data->loop);
     gst_element_set_state(GST_ELEMENT(app_data->pipeline), GST_STATE_NULL);
+    license_client_stop(&app_data->licenseClient);
     gst_println("Pipeline stopped");
 
     gst_bus_disable_sync_message_emission(app_data->bus);
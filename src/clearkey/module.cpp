@@ -2,8 +2,10 @@
 
 #include "common.h"
 #include "open_cdm.h"
+#include "session.h"
 #include "sprkl/sprkl-cdm.h"
 #include "system.h"
+#include <gmodule.h>
 #include <mutex>
 
 GST_DEBUG_CATEGORY(cdm_debug_category);
@@ -37,3 +39,9 @@ OpenCDMError sprkl_cdm_destruct_system(SparkleCDMSystem* system)
     delete static_cast<CKCDMSystem*>(system);
     return ERROR_NONE;
 }
+
+extern "C" G_MODULE_EXPORT void g_module_unload(GModule* module)
+{
+    UNUSED_PARAM(module);
+    freeKeystreamPool();
+}
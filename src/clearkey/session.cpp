@@ -4,9 +4,11 @@
 #include "open_cdm.h"
 #include "open_cdm_adapter.h"
 #include "sprkl/sprkl-cdm.h"
+#include <functional>
 #include <glib.h>
 #include <gst/base/gstbytereader.h>
 #include <json-glib/json-glib.h>
+#include <utility>
 
 #define GST_CAT_DEFAULT cdm_debug_category
 
@@ -26,7 +28,23 @@ private:
     GMutex& m;
 };
 
-CKCDMSession::CKCDMSession(std::string id,
+// Cipher context of the calling thread, so that several threads can decrypt
+// concurrently. The key schedule is kept while the same key is in use.
+struct CipherContext {
+    ~CipherContext()
+    {
+        if (ctx)
+            EVP_CIPHER_CTX_free(ctx);
+    }
+
+    EVP_CIPHER_CTX* ctx { nullptr };
+    std::string keyValue;
+};
+
+static thread_local CipherContext s_cipherContext;
+
+CKCDMSession::CKCDMSession(const CKCDMConfig& config,
+    std::string id,
     const char initDataType[],
     std::span<const uint8_t> initData,
     std::span<const uint8_t> customData,
@@ -44,12 +62,18 @@ CKCDMSession::CKCDMSession(std::string id,
 
     g_mutex_init(&m_mutex);
 
+    if (config.predictKeystream)
+        m_prediction = std::make_shared<KeystreamPrediction>();
+
     processInitData();
 }
 
 CKCDMSession::~CKCDMSession()
 {
     GST_DEBUG("Destroying session %p", this);
+    if (m_prediction)
+        GST_INFO("Session %s keystream predictions: %" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+            m_id.c_str(), predictionHits(), predictionMisses());
     g_mutex_clear(&m_mutex);
 }
 
@@ -163,6 +187,7 @@ KeyStatus CKCDMSession::status(std::span<const uint8_t> keyId)
     KeyStatus status = Expired;
     bool found = false;
     std::string key{ keyId.data(), keyId.data() + keyId.size() };
+    GMutexHolder lock(m_mutex);
     auto lookupResult = m_keyStatusMap.find(key);
     if (lookupResult != m_keyStatusMap.end()) {
         found = true;
@@ -175,6 +200,7 @@ KeyStatus CKCDMSession::status(std::span<const uint8_t> keyId)
 uint32_t CKCDMSession::hasKeyId(std::span<const uint8_t> key_id)
 {
     std::string key{ key_id.data(), key_id.data() + key_id.size() };
+    GMutexHolder lock(m_mutex);
     return m_keyStatusMap.find(key) != m_keyStatusMap.end();
 }
 
@@ -190,7 +216,10 @@ OpenCDMError CKCDMSession::update(std::span<const uint8_t> message)
 
     std::string response(message.begin(), message.end());
     if (response.find("kids") != std::string::npos && m_licenseType != Temporary) {
-        m_keyStatusMap.clear();
+        {
+            GMutexHolder lock(m_mutex);
+            m_keyStatusMap.clear();
+        }
         m_callbacks->keys_updated_callback(parent(), m_userData);
         return ERROR_NONE;
     }
@@ -261,7 +290,10 @@ void CKCDMSession::cacheKey(const gchar* keyID, const gchar* keyValue)
 
     std::string kid{ decodedKeyID, decodedKeyID + keyIDLen };
     std::string val{ decodedKeyValue, decodedKeyValue + keyValueLen };
-    m_keyStatusMap.insert({ kid, { Usable, val } });
+    {
+        GMutexHolder lock(m_mutex);
+        m_keyStatusMap.insert({ kid, { Usable, val } });
+    }
     m_callbacks->key_update_callback(parent(), m_userData, decodedKeyID, keyIDLen);
 }
 
@@ -274,10 +306,6 @@ OpenCDMError CKCDMSession::remove()
 OpenCDMError CKCDMSession::close()
 {
     GST_DEBUG("Closing session");
-    if (m_evpCtx) {
-        EVP_CIPHER_CTX_free(m_evpCtx);
-        m_evpCtx = nullptr;
-    }
     return ERROR_NONE;
 }
 
@@ -292,108 +320,364 @@ OpenCDMError sprkl_cdm_destruct_session(SparkleCDMSession* session)
     return static_cast<CKCDMSession*>(session)->destruct();
 }
 
-OpenCDMError CKCDMSession::decrypt(GstBuffer* buffer, GstBuffer* subSample, const uint32_t subSampleCount, GstBuffer* IV, GstBuffer* keyID, uint32_t initWithLast15)
+OpenCDMBool sprkl_cdm_session_requires_caps(SparkleCDMSession* session)
 {
-    UNUSED_PARAM(initWithLast15);
+    UNUSED_PARAM(session);
+    return OPENCDM_BOOL_FALSE;
+}
 
-    OpenCDMError ret = ERROR_FAIL;
-    GstMapInfo bufferMap, ivMap, keyIdMap;
-    GMutexHolder lock(m_mutex);
+OpenCDMError sprkl_cdm_session_decrypt_list(SparkleCDMSession* session, const SparkleCDMSample* samples, uint32_t count, uint32_t* decrypted)
+{
+    return static_cast<CKCDMSession*>(session)->decryptList(std::span(samples, count), *decrypted);
+}
 
-    gst_buffer_map(buffer, &bufferMap, GST_MAP_READWRITE);
-    gst_buffer_map(IV, &ivMap, GST_MAP_READ);
+bool CKCDMSession::lookupKey(GstBuffer* keyID, std::string& keyValue)
+{
+    GstMapInfo keyIdMap;
     gst_buffer_map(keyID, &keyIdMap, GST_MAP_READ);
+    std::string kid { keyIdMap.data, keyIdMap.data + keyIdMap.size };
+    gst_buffer_unmap(keyID, &keyIdMap);
 
-    // Add padding to IV, filling 16 bytes.
-    memcpy(m_iv, ivMap.data, (ivMap.size > 16 ? 16 : ivMap.size));
-    if (ivMap.size < 16) {
-        memset(&(m_iv[ivMap.size]), 0, 16 - ivMap.size);
+    auto statusAndValue = m_keyStatusMap.find(kid);
+    if (statusAndValue == m_keyStatusMap.end()) {
+        GST_MEMDUMP("Key ID not found:", reinterpret_cast<const uint8_t*>(kid.c_str()), kid.size());
+        return false;
     }
+    keyValue = statusAndValue->second.second;
+    return true;
+}
 
-    int outSize = 0;
+OpenCDMError CKCDMSession::decrypt(GstBuffer* buffer, GstBuffer* subSample, const uint32_t subSampleCount, GstBuffer* IV, GstBuffer* keyID, uint32_t initWithLast15)
+{
+    UNUSED_PARAM(initWithLast15);
 
-    auto* alg = EVP_aes_128_ctr();
-    if (!m_evpCtx) {
-        m_evpCtx = EVP_CIPHER_CTX_new();
-        if (!m_evpCtx) {
-            GST_ERROR("Ctx init");
-            goto out;
-        }
-        EVP_CIPHER_CTX_set_padding(m_evpCtx, 0);
+    std::string keyValue;
+    {
+        GMutexHolder lock(m_mutex);
+        if (!lookupKey(keyID, keyValue))
+            return ERROR_FAIL;
     }
+    return decryptWithKey(keyValue, buffer, subSample, subSampleCount, IV);
+}
 
+OpenCDMError CKCDMSession::decryptList(std::span<const SparkleCDMSample> samples, uint32_t& decrypted)
+{
+    // Resolve the keys of the whole batch at once. The samples of a fragment
+    // usually share the same key ID buffer.
+    std::vector<std::string> keyValues(samples.size());
+    size_t resolved = 0;
     {
-        std::string kid{ keyIdMap.data, keyIdMap.data + keyIdMap.size };
-        auto statusAndValue = m_keyStatusMap.find(kid);
-        if (statusAndValue == m_keyStatusMap.end()) {
-            GST_MEMDUMP("Key ID not found:", reinterpret_cast<const uint8_t*>(kid.c_str()), kid.size());
-            goto out;
-        }
-        const auto& keyValue = statusAndValue->second.second;
-        if (!EVP_CipherInit_ex(m_evpCtx, alg, NULL, reinterpret_cast<const unsigned char*>(keyValue.c_str()), m_iv, 0)) {
-            GST_ERROR("Init failure");
-            goto out;
+        GMutexHolder lock(m_mutex);
+        for (; resolved < samples.size(); resolved++) {
+            if (resolved && samples[resolved].keyID == samples[resolved - 1].keyID)
+                keyValues[resolved] = keyValues[resolved - 1];
+            else if (!lookupKey(samples[resolved].keyID, keyValues[resolved]))
+                break;
         }
     }
 
-    GST_TRACE("Decrypting with session %s", m_id.c_str());
+    GST_TRACE("Decrypting %zu samples with session %s", samples.size(), m_id.c_str());
+    for (decrypted = 0; decrypted < resolved; decrypted++) {
+        const auto& sample = samples[decrypted];
+        auto result = decryptWithKey(keyValues[decrypted], sample.buffer, sample.subSamples, sample.subSampleCount, sample.IV);
+        if (result != ERROR_NONE)
+            return result;
+    }
+    return resolved == samples.size() ? ERROR_NONE : ERROR_FAIL;
+}
+
+// Encrypted byte range of a sample.
+struct EncryptedRange {
+    gsize offset;
+    gsize size;
+};
+
+static bool encryptedRanges(GstBuffer* subSamples, uint32_t subSampleCount, gsize bufferSize, std::vector<EncryptedRange>& ranges)
+{
     if (!subSampleCount) {
-        if (!EVP_CipherUpdate(m_evpCtx, bufferMap.data,
-                &outSize, bufferMap.data, bufferMap.size)) {
-            GST_ERROR("Unable to decrypt data");
-            goto out;
+        ranges.push_back({ 0, bufferSize });
+        return true;
+    }
+
+    GstMapInfo subSampleInfo;
+    if (!gst_buffer_map(subSamples, &subSampleInfo, GST_MAP_READ))
+        return false;
+
+    GstByteReader reader;
+    gst_byte_reader_init(&reader, subSampleInfo.data, subSampleInfo.size);
+
+    bool valid = true;
+    gsize position = 0;
+    for (uint32_t sampleIndex = 0; sampleIndex < subSampleCount && position < bufferSize; sampleIndex++) {
+        guint16 nBytesClear = 0;
+        guint32 nBytesEncrypted = 0;
+        if (!gst_byte_reader_get_uint16_be(&reader, &nBytesClear) || !gst_byte_reader_get_uint32_be(&reader, &nBytesEncrypted)) {
+            GST_ERROR("Invalid subsample data");
+            valid = false;
+            break;
         }
-        ret = ERROR_NONE;
-    } else {
-        GstMapInfo subSampleInfo;
-        gst_buffer_map(subSample, &subSampleInfo, GST_MAP_READ);
-
-        GstByteReader reader;
-        gst_byte_reader_init(&reader, subSampleInfo.data, subSampleInfo.size);
-
-        unsigned position = 0;
-        unsigned sampleIndex = 0;
-        while (position < bufferMap.size) {
-            guint16 nBytesClear = 0;
-            guint32 nBytesEncrypted = 0;
-
-            if (sampleIndex < subSampleCount) {
-                if (!gst_byte_reader_get_uint16_be(&reader, &nBytesClear) || !gst_byte_reader_get_uint32_be(&reader, &nBytesEncrypted)) {
-                    GST_ERROR("Invalid subsample data");
-                    goto out2;
-                }
-            } else {
-                nBytesClear = 0;
-                nBytesEncrypted = bufferMap.size - position;
-            }
+        GST_TRACE("Sample %u: %" G_GUINT16_FORMAT " clear bytes, %" G_GUINT32_FORMAT " encrypted bytes",
+            sampleIndex, nBytesClear, nBytesEncrypted);
 
-            if (sampleIndex > subSampleCount - 1)
-                break;
-            GST_TRACE("Sample %u: %" G_GUINT16_FORMAT " clear bytes, %" G_GUINT32_FORMAT " encrypted bytes",
-                sampleIndex, nBytesClear, nBytesEncrypted);
-
-            position += nBytesClear;
-            sampleIndex++;
-            if (nBytesEncrypted) {
-                if (!EVP_CipherUpdate(m_evpCtx, bufferMap.data + position,
-                        &outSize, bufferMap.data + position, nBytesEncrypted)) {
-                    GST_ERROR("Unable to decrypt subsample data");
-                    goto out2;
-                }
+        position += nBytesClear;
+        if (nBytesEncrypted && position < bufferSize)
+            ranges.push_back({ position, MIN(nBytesEncrypted, bufferSize - position) });
+        position += nBytesEncrypted;
+    }
+
+    gst_buffer_unmap(subSamples, &subSampleInfo);
+    return valid;
+}
+
+// Applies transform to the ranges in place, mapping only the memories they
+// overlap so that multi-memory buffers are not merged into a contiguous copy.
+// Ranges are handed in order, split at memory boundaries.
+static bool transformRanges(GstBuffer* buffer, const std::vector<EncryptedRange>& ranges, const std::function<bool(uint8_t*, gsize)>& transform)
+{
+    size_t range = 0;
+    gsize memoryOffset = 0;
+    guint memoryCount = gst_buffer_n_memory(buffer);
+    for (guint index = 0; index < memoryCount && range < ranges.size(); index++) {
+        gsize memoryEnd = memoryOffset + gst_buffer_peek_memory(buffer, index)->size;
+        while (range < ranges.size() && ranges[range].offset + ranges[range].size <= memoryOffset)
+            range++;
+        if (range == ranges.size() || ranges[range].offset >= memoryEnd) {
+            memoryOffset = memoryEnd;
+            continue;
+        }
+
+        GstMapInfo map;
+        if (!gst_buffer_map_range(buffer, index, 1, &map, GST_MAP_READWRITE)) {
+            GST_ERROR("Unable to map memory %u", index);
+            return false;
+        }
+
+        for (size_t i = range; i < ranges.size() && ranges[i].offset < memoryEnd; i++) {
+            gsize start = MAX(ranges[i].offset, memoryOffset);
+            gsize end = MIN(ranges[i].offset + ranges[i].size, memoryEnd);
+            if (!transform(map.data + start - memoryOffset, end - start)) {
+                gst_buffer_unmap(buffer, &map);
+                return false;
             }
-            position += nBytesEncrypted;
         }
-        ret = ERROR_NONE;
 
-    out2:
-        gst_buffer_unmap(subSample, &subSampleInfo);
+        gst_buffer_unmap(buffer, &map);
+        memoryOffset = memoryEnd;
+    }
+    return true;
+}
+
+// Sets up the cipher context of the calling thread for the key and counter
+// block.
+static bool initCipher(CipherContext& cipher, const std::string& keyValue, const uint8_t iv[16])
+{
+    if (!cipher.ctx) {
+        cipher.ctx = EVP_CIPHER_CTX_new();
+        if (!cipher.ctx) {
+            GST_ERROR("Ctx init");
+            return false;
+        }
+        EVP_CIPHER_CTX_set_padding(cipher.ctx, 0);
+        cipher.keyValue.clear();
+    }
+
+    if (!cipher.keyValue.empty() && cipher.keyValue == keyValue) {
+        // Same key as the previous sample, skip the key schedule and only
+        // reset the counter.
+        if (!EVP_CipherInit_ex(cipher.ctx, nullptr, nullptr, nullptr, iv, 0)) {
+            GST_ERROR("IV init failure");
+            return false;
+        }
+        return true;
+    }
+
+    cipher.keyValue.clear();
+    if (!EVP_CipherInit_ex(cipher.ctx, EVP_aes_128_ctr(), NULL, reinterpret_cast<const unsigned char*>(keyValue.c_str()), iv, 0)) {
+        GST_ERROR("Init failure");
+        return false;
+    }
+    cipher.keyValue = keyValue;
+    return true;
+}
+
+// Keystream of the sample expected to follow the last decrypted one, computed
+// on a worker thread while the next sample is on its way. Shared with the
+// worker, so that sessions can go away while a computation is running.
+struct KeystreamPrediction {
+    KeystreamPrediction() { g_mutex_init(&mutex); }
+    ~KeystreamPrediction() { g_mutex_clear(&mutex); }
+
+    GMutex mutex;
+    uint64_t generation { 0 }; // Bumped for each new prediction.
+    std::string keyValue;
+    uint8_t iv[16];
+    size_t size { 0 };
+    std::vector<uint8_t> keystream; // Set once computed for generation.
+    bool ready { false };
+    bool computing { false };
+};
+
+static void computeKeystream(gpointer data, gpointer)
+{
+    std::unique_ptr<std::shared_ptr<KeystreamPrediction>> holder(static_cast<std::shared_ptr<KeystreamPrediction>*>(data));
+    auto& prediction = **holder;
+
+    g_mutex_lock(&prediction.mutex);
+    while (true) {
+        auto generation = prediction.generation;
+        std::string keyValue = prediction.keyValue;
+        uint8_t iv[16];
+        memcpy(iv, prediction.iv, sizeof(iv));
+        std::vector<uint8_t> keystream(prediction.size, 0);
+        g_mutex_unlock(&prediction.mutex);
+
+        // The keystream is the encryption of zeroes.
+        int outSize = 0;
+        auto& cipher = s_cipherContext;
+        bool success = initCipher(cipher, keyValue, iv)
+            && EVP_CipherUpdate(cipher.ctx, keystream.data(), &outSize, keystream.data(), keystream.size());
+
+        g_mutex_lock(&prediction.mutex);
+        if (prediction.generation == generation) {
+            // Otherwise another sample was decrypted in the meantime, start
+            // over with the latest prediction.
+            prediction.keystream = std::move(keystream);
+            prediction.ready = success;
+            break;
+        }
+    }
+    prediction.computing = false;
+    g_mutex_unlock(&prediction.mutex);
+}
+
+// Shared by all the sessions, freed when the module is unloaded.
+static GMutex s_keystreamPoolMutex;
+static GThreadPool* s_keystreamPool = nullptr;
+
+static GThreadPool* keystreamPool()
+{
+    GMutexHolder lock(s_keystreamPoolMutex);
+    if (!s_keystreamPool)
+        s_keystreamPool = g_thread_pool_new(computeKeystream, nullptr, 1, FALSE, nullptr);
+    return s_keystreamPool;
+}
+
+void freeKeystreamPool()
+{
+    GThreadPool* pool;
+    {
+        GMutexHolder lock(s_keystreamPoolMutex);
+        pool = std::exchange(s_keystreamPool, nullptr);
+    }
+    // Predictions still queued belong to sessions already destroyed, drop
+    // them and only wait for the one being computed.
+    if (pool)
+        g_thread_pool_free(pool, TRUE, TRUE);
+}
+
+// Decrypts with the predicted keystream, if it matches the key and counter
+// block of the sample.
+bool CKCDMSession::decryptWithPrediction(const std::string& keyValue, const uint8_t iv[16], GstBuffer* buffer,
+    const std::vector<EncryptedRange>& ranges, size_t encryptedSize)
+{
+    std::vector<uint8_t> keystream;
+    {
+        GMutexHolder lock(m_prediction->mutex);
+        if (!m_prediction->ready || m_prediction->keystream.size() < encryptedSize
+            || m_prediction->keyValue != keyValue || memcmp(m_prediction->iv, iv, 16))
+            return false;
+        keystream = std::move(m_prediction->keystream);
+        m_prediction->ready = false;
+    }
+
+    size_t position = 0;
+    return transformRanges(buffer, ranges, [&](uint8_t* data, gsize size) {
+        for (gsize i = 0; i < size; i++)
+            data[i] ^= keystream[position + i];
+        position += size;
+        return true;
+    });
+}
+
+// Starts computing the keystream of the next sample, assuming 8 bytes IVs
+// incremented by one per sample, as most packagers do.
+void CKCDMSession::predictKeystream(const std::string& keyValue, const uint8_t iv[16], size_t ivSize, size_t encryptedSize)
+{
+    if (ivSize != 8 || !encryptedSize)
+        return;
+
+    GMutexHolder lock(m_prediction->mutex);
+    m_prediction->generation++;
+    m_prediction->keyValue = keyValue;
+    memcpy(m_prediction->iv, iv, 16);
+    for (int i = 7; i >= 0; i--) {
+        if (++m_prediction->iv[i])
+            break;
     }
+    // Round up, samples of a stream usually have similar sizes.
+    m_prediction->size = (encryptedSize + 1023) & ~static_cast<size_t>(1023);
+    m_prediction->ready = false;
+
+    if (m_prediction->computing)
+        return;
+    m_prediction->computing = true;
+    g_thread_pool_push(keystreamPool(), new std::shared_ptr<KeystreamPrediction>(m_prediction), nullptr);
+}
+
+OpenCDMError CKCDMSession::decryptWithKey(const std::string& keyValue, GstBuffer* buffer, GstBuffer* subSample, const uint32_t subSampleCount, GstBuffer* IV)
+{
+    GstMapInfo ivMap;
+    uint8_t iv[16];
 
-out:
-    gst_buffer_unmap(buffer, &bufferMap);
+    std::vector<EncryptedRange> ranges;
+    if (!encryptedRanges(subSample, subSampleCount, gst_buffer_get_size(buffer), ranges))
+        return ERROR_FAIL;
+
+    if (!gst_buffer_map(IV, &ivMap, GST_MAP_READ))
+        return ERROR_FAIL;
+
+    // Add padding to IV, filling 16 bytes.
+    memcpy(iv, ivMap.data, (ivMap.size > 16 ? 16 : ivMap.size));
+    if (ivMap.size < 16) {
+        memset(&(iv[ivMap.size]), 0, 16 - ivMap.size);
+    }
+    gsize ivSize = ivMap.size;
     gst_buffer_unmap(IV, &ivMap);
-    gst_buffer_unmap(keyID, &keyIdMap);
-    return ret;
+
+    size_t encryptedSize = 0;
+    for (const auto& range : ranges)
+        encryptedSize += range.size;
+
+    if (m_prediction) {
+        if (decryptWithPrediction(keyValue, iv, buffer, ranges, encryptedSize)) {
+            m_predictionHits++;
+            GST_TRACE("Decrypted with the predicted keystream, session %s", m_id.c_str());
+            predictKeystream(keyValue, iv, ivSize, encryptedSize);
+            return ERROR_NONE;
+        }
+        m_predictionMisses++;
+    }
+
+    auto& cipher = s_cipherContext;
+    if (!initCipher(cipher, keyValue, iv))
+        return ERROR_FAIL;
+
+    GST_TRACE("Decrypting %zu ranges over %u memories with session %s", ranges.size(),
+        gst_buffer_n_memory(buffer), m_id.c_str());
+    // AES-CTR is a stream cipher, its state carries over from one memory to
+    // the next.
+    bool success = transformRanges(buffer, ranges, [&](uint8_t* data, gsize size) {
+        int outSize = 0;
+        if (!EVP_CipherUpdate(cipher.ctx, data, &outSize, data, size)) {
+            GST_ERROR("Unable to decrypt data");
+            return false;
+        }
+        return true;
+    });
+
+    if (success && m_prediction)
+        predictKeystream(keyValue, iv, ivSize, encryptedSize);
+    return success ? ERROR_NONE : ERROR_FAIL;
 }
 
 OpenCDMError CKCDMSession::decryptBuffer(GstBuffer* buffer, GstCaps*, GstBuffer* subSamples,
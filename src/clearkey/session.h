@@ -4,14 +4,19 @@
 
 #include "common.h"
 #include "system.h"
+#include <atomic>
 #include <map>
+#include <memory>
 #include <openssl/evp.h>
 #include <vector>
 #include "sprkl/sprkl-cdm.h"
 
+struct EncryptedRange;
+struct KeystreamPrediction;
+
 class CKCDMSession final : public SparkleCDMSession {
 public:
-    CKCDMSession(std::string id, const char initDataType[],
+    CKCDMSession(const CKCDMConfig&, std::string id, const char initDataType[],
                  std::span<const uint8_t> initData,
                  std::span<const uint8_t> customData,
         const LicenseType licenseType,
@@ -31,6 +36,7 @@ public:
                          GstBuffer* IV, GstBuffer* keyID, uint32_t initWithLast15) final;
     OpenCDMError decryptBuffer(GstBuffer* buffer, GstCaps* caps, GstBuffer* subSamples,
                                const uint32_t subSampleCount, GstBuffer* IV, GstBuffer* keyID) final;
+    OpenCDMError decryptList(std::span<const SparkleCDMSample> samples, uint32_t& decrypted);
 
     LicenseType licenseType() const { return m_licenseType; }
 
@@ -38,8 +44,18 @@ public:
 
     void cacheKey(const gchar* keyID, const gchar* keyValue);
 
+    // Samples decrypted with and without the predicted keystream.
+    uint64_t predictionHits() const { return m_predictionHits.load(); }
+    uint64_t predictionMisses() const { return m_predictionMisses.load(); }
+
 private:
     void processInitData();
+    bool lookupKey(GstBuffer* keyID, std::string& keyValue);
+    OpenCDMError decryptWithKey(const std::string& keyValue, GstBuffer* buffer, GstBuffer* subSamples,
+                                const uint32_t subSampleCount, GstBuffer* IV);
+    bool decryptWithPrediction(const std::string& keyValue, const uint8_t iv[16], GstBuffer* buffer,
+                               const std::vector<EncryptedRange>& ranges, size_t encryptedSize);
+    void predictKeystream(const std::string& keyValue, const uint8_t iv[16], size_t ivSize, size_t encryptedSize);
     gchar* encode_kid(const guint8* d, gsize size);
 
   std::string m_id;
@@ -50,8 +66,14 @@ private:
     std::span<const uint8_t> m_initData;
 
     std::map<std::string, std::pair<KeyStatus, std::string>> m_keyStatusMap;
-    uint8_t m_iv[16];
     std::vector<uint8_t> m_buffer;
-    EVP_CIPHER_CTX* m_evpCtx { nullptr };
-    GMutex m_mutex; // For basic MT-safety in decrypt().
+    GMutex m_mutex; // Protects m_keyStatusMap, decrypt() may run on several threads.
+
+    // Set when CKCDMConfig::predictKeystream is.
+    std::shared_ptr<KeystreamPrediction> m_prediction;
+    std::atomic<uint64_t> m_predictionHits { 0 };
+    std::atomic<uint64_t> m_predictionMisses { 0 };
 };
+
+// Stops the keystream prediction worker, before the module is unloaded.
+void freeKeystreamPool();
@@ -6,6 +6,11 @@
 #include "sprkl/sprkl-cdm.h"
 #include <sstream>
 
+CKCDMConfig::CKCDMConfig()
+    : predictKeystream(g_getenv("SPRKL_CLEARKEY_PREDICT_KEYSTREAM"))
+{
+}
+
 OpenCDMBool CKCDMSystem::supportsServerCertificate()
 {
     return OPENCDM_BOOL_FALSE;
@@ -27,6 +32,6 @@ OpenCDMError CKCDMSystem::constructSession(const LicenseType licenseType,
     m_sessionId++;
     auto id = stream.str();
 
-    *session = new CKCDMSession(id, initDataType, initData, CDMData, licenseType, callbacks, userData);
+    *session = new CKCDMSession(m_config, id, initDataType, initData, CDMData, licenseType, callbacks, userData);
     return ERROR_NONE;
 }
@@ -10,6 +10,18 @@
 
 class CKCDMSession;
 
+// Settings of the sessions of a system, read from the environment when the
+// system is created:
+//
+// - SPRKL_CLEARKEY_PREDICT_KEYSTREAM: compute the keystream of the next sample
+//   ahead of time, so that its decryption is a plain XOR when its IV follows
+//   the previous one. Disabled by default.
+struct CKCDMConfig {
+    CKCDMConfig();
+
+    bool predictKeystream { false };
+};
+
 class CKCDMSystem final : public SparkleCDMSystem {
 public:
     OpenCDMBool supportsServerCertificate() final;
@@ -17,6 +29,7 @@ public:
     OpenCDMError constructSession(const LicenseType, const char initDataType[], std::span<const uint8_t> initData, std::span<const uint8_t> cdmData, OpenCDMSessionCallbacks*, void*, SparkleCDMSession**) final;
 
 private:
+    const CKCDMConfig m_config;
     std::unordered_map<std::string, CKCDMSession*> m_sessions;
     unsigned m_sessionId { 0 };
 };
@@ -0,0 +1,577 @@
+// SPDX-License-Identifier: MIT
+
+#include "broker.h"
+#include <vector>
+
+GST_DEBUG_CATEGORY_STATIC (spkl_broker_debug_category);
+#define GST_CAT_DEFAULT spkl_broker_debug_category
+
+struct BrokerSystem
+{
+  gchar *keySystem;
+  struct OpenCDMSystem *system;
+  guint refCount;
+};
+
+struct BrokerSubscriber
+{
+  GstElement *element;          // Only used for lookups.
+  GWeakRef elementRef;
+  OpenCDMSessionCallbacks *callbacks;
+  SpklChallengeCallback challengeCallback;
+};
+
+struct BrokerEntry
+{
+  guint refCount;
+  gchar *id;
+  struct OpenCDMSystem *system;
+  LicenseType licenseType;
+  gchar *initDataType;
+  GBytes *initData;
+  struct OpenCDMSession *session;
+  gboolean constructing;
+  gboolean keysReady;
+
+  // Set once the session got renewed, new subscribers are then directed to
+  // the successor.
+  gboolean retired;
+  BrokerEntry *successor;
+
+  GList *subscribers;
+  BrokerSubscriber *owner;      // Receives the license challenges.
+};
+
+// Protects all the fields above.
+static GMutex brokerMutex;
+static GCond brokerCondition;
+static GList *systems;
+static GList *entries;
+static guint lastEntryId;
+
+class BrokerLock
+{
+public:
+  BrokerLock ()
+  {
+    g_mutex_lock (&brokerMutex);
+  }
+   ~BrokerLock ()
+  {
+    g_mutex_unlock (&brokerMutex);
+  }
+};
+
+static void
+ensureDebugCategory ()
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized)) {
+    GST_DEBUG_CATEGORY_INIT (spkl_broker_debug_category, "sprklbroker", 0,
+        "Sparkle-CDM session broker");
+    g_once_init_leave (&initialized, 1);
+  }
+}
+
+// Must be called with the broker mutex held.
+static BrokerSystem *
+findSystem (struct OpenCDMSystem *system)
+{
+  for (auto *link = systems; link; link = link->next) {
+    /* *INDENT-OFF* */
+    auto *brokerSystem = static_cast<BrokerSystem*>(link->data);
+    /* *INDENT-ON* */
+    if (brokerSystem->system == system)
+      return brokerSystem;
+  }
+  return nullptr;
+}
+
+struct OpenCDMSystem *
+spkl_session_broker_acquire_system (const gchar * keySystem)
+{
+  ensureDebugCategory ();
+
+  BrokerLock lock;
+  for (auto *link = systems; link; link = link->next) {
+    /* *INDENT-OFF* */
+    auto *brokerSystem = static_cast<BrokerSystem*>(link->data);
+    /* *INDENT-ON* */
+    if (g_str_equal (brokerSystem->keySystem, keySystem)) {
+      brokerSystem->refCount++;
+      return brokerSystem->system;
+    }
+  }
+
+  auto *system = opencdm_create_system (keySystem);
+  if (!system)
+    return nullptr;
+
+  GST_DEBUG ("Created %s system %p", keySystem, system);
+  auto *brokerSystem = g_new0 (BrokerSystem, 1);
+  brokerSystem->keySystem = g_strdup (keySystem);
+  brokerSystem->system = system;
+  brokerSystem->refCount = 1;
+  systems = g_list_prepend (systems, brokerSystem);
+  return system;
+}
+
+void
+spkl_session_broker_release_system (struct OpenCDMSystem *system)
+{
+  BrokerSystem *brokerSystem;
+  {
+    BrokerLock lock;
+    brokerSystem = findSystem (system);
+    if (!brokerSystem || --brokerSystem->refCount)
+      return;
+    systems = g_list_remove (systems, brokerSystem);
+  }
+
+  GST_DEBUG ("Destroying %s system %p", brokerSystem->keySystem, system);
+  opencdm_destruct_system (system);
+  g_free (brokerSystem->keySystem);
+  g_free (brokerSystem);
+}
+
+// Must be called with the broker mutex held.
+static BrokerEntry *
+findEntry (const struct OpenCDMSession *session)
+{
+  for (auto *link = entries; link; link = link->next) {
+    /* *INDENT-OFF* */
+    auto *entry = static_cast<BrokerEntry*>(link->data);
+    /* *INDENT-ON* */
+    if (session && entry->session == session)
+      return entry;
+  }
+  return nullptr;
+}
+
+// Must be called with the broker mutex held.
+static BrokerEntry *
+newEntry (struct OpenCDMSystem *system, LicenseType licenseType,
+    const gchar * initDataType, GBytes * initData)
+{
+  auto *entry = g_new0 (BrokerEntry, 1);
+  entry->id = g_strdup_printf ("%u", ++lastEntryId);
+  entry->system = system;
+  entry->licenseType = licenseType;
+  entry->initDataType = g_strdup (initDataType);
+  entry->initData = g_bytes_ref (initData);
+  entry->constructing = TRUE;
+  findSystem (system)->refCount++;
+  entries = g_list_append (entries, entry);
+  return entry;
+}
+
+// Must be called with the broker mutex held.
+static void
+subscribe (BrokerEntry * entry, GstElement * element,
+    OpenCDMSessionCallbacks * callbacks,
+    SpklChallengeCallback challengeCallback)
+{
+  auto *subscriber = g_new0 (BrokerSubscriber, 1);
+  subscriber->element = element;
+  g_weak_ref_init (&subscriber->elementRef, element);
+  subscriber->callbacks = callbacks;
+  subscriber->challengeCallback = challengeCallback;
+  entry->subscribers = g_list_append (entry->subscribers, subscriber);
+  if (!entry->owner)
+    entry->owner = subscriber;
+  entry->refCount++;
+}
+
+// Must be called with the broker mutex held. Returns the entry if it needs to
+// be freed, once the mutex is released.
+static BrokerEntry *
+unrefEntry (BrokerEntry * entry)
+{
+  if (--entry->refCount)
+    return nullptr;
+
+  entries = g_list_remove (entries, entry);
+  return entry;
+}
+
+static void
+freeSubscriber (BrokerSubscriber * subscriber)
+{
+  g_weak_ref_clear (&subscriber->elementRef);
+  g_free (subscriber);
+}
+
+static void
+freeEntry (BrokerEntry * entry)
+{
+  if (!entry)
+    return;
+
+  GST_DEBUG ("Destroying session %p", entry->session);
+  if (entry->session)
+    opencdm_destruct_session (entry->session);
+
+  BrokerEntry *successor = nullptr;
+  if (entry->successor) {
+    BrokerLock lock;
+    successor = unrefEntry (entry->successor);
+  }
+  freeEntry (successor);
+
+  // Subscribers are left over when the construction failed.
+  g_list_free_full (entry->subscribers, (GDestroyNotify) freeSubscriber);
+  spkl_session_broker_release_system (entry->system);
+  g_free (entry->id);
+  g_free (entry->initDataType);
+  g_bytes_unref (entry->initData);
+  g_free (entry);
+}
+
+static void
+spklBrokerProcessChallenge (struct OpenCDMSession *session, void *userData,
+    const char url[], const uint8_t challenge[],
+    const uint16_t challengeLength);
+static void spklBrokerKeyUpdate (struct OpenCDMSession *session,
+    void *userData, const uint8_t keyId[], const uint8_t length);
+static void spklBrokerErrorMessage (struct OpenCDMSession *session,
+    void *userData, const char message[]);
+static void spklBrokerKeysUpdated (const struct OpenCDMSession *session,
+    void *userData);
+
+static OpenCDMSessionCallbacks brokerCallbacks = {
+  spklBrokerProcessChallenge,
+  spklBrokerKeyUpdate,
+  spklBrokerErrorMessage,
+  spklBrokerKeysUpdated,
+};
+
+// Constructs the session of an entry created by newEntry(), with the broker
+// mutex released.
+static struct OpenCDMSession *
+constructSession (BrokerEntry * entry)
+{
+  gsize initDataSize;
+  auto *initData = g_bytes_get_data (entry->initData, &initDataSize);
+  struct OpenCDMSession *session = nullptr;
+
+  opencdm_construct_session (entry->system, entry->licenseType,
+      entry->initDataType, (const uint8_t *) initData, initDataSize, nullptr,
+      0, &brokerCallbacks, entry, &session);
+  GST_DEBUG ("Constructed session %p", session);
+
+  BrokerLock lock;
+  entry->session = session;
+  entry->constructing = FALSE;
+  g_cond_broadcast (&brokerCondition);
+  return session;
+}
+
+// Must be called with the broker mutex held, and a reference on the entry.
+static void
+waitForConstruction (BrokerEntry * entry)
+{
+  while (entry->constructing)
+    g_cond_wait (&brokerCondition, &brokerMutex);
+}
+
+struct OpenCDMSession *
+spkl_session_broker_acquire (struct OpenCDMSystem *system,
+    LicenseType licenseType, const gchar * initDataType,
+    const guint8 * initData, gsize initDataSize, GstElement * element,
+    OpenCDMSessionCallbacks * callbacks,
+    SpklChallengeCallback challengeCallback)
+{
+  g_autoptr (GBytes) initDataBytes = g_bytes_new (initData, initDataSize);
+  BrokerEntry *entry = nullptr;
+  BrokerEntry *unused = nullptr;
+  struct OpenCDMSession *session = nullptr;
+
+  {
+    BrokerLock lock;
+    for (auto *link = entries; link; link = link->next) {
+      /* *INDENT-OFF* */
+      auto *candidate = static_cast<BrokerEntry*>(link->data);
+      /* *INDENT-ON* */
+      if (!candidate->retired && candidate->system == system
+          && candidate->licenseType == licenseType
+          && g_str_equal (candidate->initDataType, initDataType)
+          && g_bytes_equal (candidate->initData, initDataBytes)) {
+        entry = candidate;
+        break;
+      }
+    }
+
+    if (entry) {
+      entry->refCount++;
+      waitForConstruction (entry);
+      session = entry->session;
+      if (session) {
+        GST_DEBUG_OBJECT (element, "Sharing session %p", session);
+        subscribe (entry, element, callbacks, challengeCallback);
+      }
+      unused = unrefEntry (entry);
+    }
+  }
+
+  if (entry) {
+    freeEntry (unused);
+    return session;
+  }
+
+  {
+    BrokerLock lock;
+    entry = newEntry (system, licenseType, initDataType, initDataBytes);
+    subscribe (entry, element, callbacks, challengeCallback);
+  }
+
+  session = constructSession (entry);
+  if (!session) {
+    BrokerLock lock;
+    unused = unrefEntry (entry);
+  }
+  freeEntry (unused);
+  return session;
+}
+
+struct OpenCDMSession *
+spkl_session_broker_renew (struct OpenCDMSession *expired,
+    GstElement * element, OpenCDMSessionCallbacks * callbacks,
+    SpklChallengeCallback challengeCallback)
+{
+  BrokerEntry *entry;
+  BrokerEntry *successor;
+  BrokerEntry *unused = nullptr;
+  struct OpenCDMSession *session = nullptr;
+
+  {
+    BrokerLock lock;
+    entry = findEntry (expired);
+    if (!entry)
+      return nullptr;
+
+    successor = entry->successor;
+    if (successor) {
+      successor->refCount++;
+      waitForConstruction (successor);
+      session = successor->session;
+      if (session) {
+        GST_DEBUG_OBJECT (element, "Joining renewed session %p", session);
+        subscribe (successor, element, callbacks, challengeCallback);
+      }
+      unused = unrefEntry (successor);
+    } else {
+      successor = newEntry (entry->system, entry->licenseType,
+          entry->initDataType, entry->initData);
+      // Reference held by the predecessor, the subscribers of the expired
+      // session are directed to the successor from now on.
+      successor->refCount++;
+      subscribe (successor, element, callbacks, challengeCallback);
+      entry->successor = successor;
+      entry->retired = TRUE;
+      successor = nullptr;
+    }
+  }
+
+  if (successor) {
+    freeEntry (unused);
+    return session;
+  }
+
+  GST_DEBUG_OBJECT (element, "Renewing session %p", expired);
+  successor = entry->successor;
+  session = constructSession (successor);
+  if (!session) {
+    BrokerLock lock;
+    entry->successor = nullptr;
+    entry->retired = FALSE;
+    unrefEntry (successor);
+    unused = unrefEntry (successor);
+  }
+  freeEntry (unused);
+  return session;
+}
+
+gboolean
+spkl_session_broker_keys_ready (struct OpenCDMSession *session)
+{
+  BrokerLock lock;
+  auto *entry = findEntry (session);
+  return entry && entry->keysReady;
+}
+
+void
+spkl_session_broker_release (struct OpenCDMSession *session,
+    GstElement * element)
+{
+  BrokerEntry *unused = nullptr;
+  {
+    BrokerLock lock;
+    auto *entry = findEntry (session);
+    if (!entry)
+      return;
+
+    for (auto *link = entry->subscribers; link; link = link->next) {
+      /* *INDENT-OFF* */
+      auto *subscriber = static_cast<BrokerSubscriber*>(link->data);
+      /* *INDENT-ON* */
+      if (subscriber->element != element)
+        continue;
+
+      entry->subscribers = g_list_delete_link (entry->subscribers, link);
+      if (entry->owner == subscriber) {
+        /* *INDENT-OFF* */
+        entry->owner = entry->subscribers ? static_cast<BrokerSubscriber*>(entry->subscribers->data) : nullptr;
+        /* *INDENT-ON* */
+      }
+      freeSubscriber (subscriber);
+      unused = unrefEntry (entry);
+      break;
+    }
+  }
+  freeEntry (unused);
+}
+
+gboolean
+spkl_session_broker_ref (struct OpenCDMSession *session)
+{
+  BrokerLock lock;
+  auto *entry = findEntry (session);
+  if (entry)
+    entry->refCount++;
+  return entry != nullptr;
+}
+
+struct OpenCDMSession *
+spkl_session_broker_lookup (const gchar * sessionId)
+{
+  BrokerEntry *unused = nullptr;
+  {
+    BrokerLock lock;
+    for (auto *link = entries; link; link = link->next) {
+      /* *INDENT-OFF* */
+      auto *entry = static_cast<BrokerEntry*>(link->data);
+      /* *INDENT-ON* */
+      if (!g_str_equal (entry->id, sessionId))
+        continue;
+
+      // The license might come back before the construction returned.
+      entry->refCount++;
+      waitForConstruction (entry);
+      if (entry->session)
+        return entry->session;
+      unused = unrefEntry (entry);
+      break;
+    }
+  }
+  freeEntry (unused);
+  return nullptr;
+}
+
+void
+spkl_session_broker_unref (struct OpenCDMSession *session)
+{
+  BrokerEntry *unused = nullptr;
+  {
+    BrokerLock lock;
+    auto *entry = findEntry (session);
+    if (entry)
+      unused = unrefEntry (entry);
+  }
+  freeEntry (unused);
+}
+
+// Invokes function for the subscribers of an entry, with the broker mutex
+// released.
+/* *INDENT-OFF* */
+template<typename Function>
+/* *INDENT-ON* */
+static void
+dispatch (void *userData, Function function)
+{
+  /* *INDENT-OFF* */
+  auto *entry = static_cast<BrokerEntry*>(userData);
+  std::vector<std::pair<GstElement*, OpenCDMSessionCallbacks*>> targets;
+  /* *INDENT-ON* */
+
+  {
+    BrokerLock lock;
+    for (auto *link = entry->subscribers; link; link = link->next) {
+      /* *INDENT-OFF* */
+      auto *subscriber = static_cast<BrokerSubscriber*>(link->data);
+      auto *element = static_cast<GstElement*>(g_weak_ref_get (&subscriber->elementRef));
+      /* *INDENT-ON* */
+      if (element)
+        targets.emplace_back (element, subscriber->callbacks);
+    }
+  }
+
+  for (auto &[element, callbacks] : targets) {
+    function (callbacks, element);
+    gst_object_unref (element);
+  }
+}
+
+static void
+spklBrokerProcessChallenge (struct OpenCDMSession *session, void *userData,
+    const char url[], const uint8_t challenge[],
+    const uint16_t challengeLength)
+{
+  /* *INDENT-OFF* */
+  auto *entry = static_cast<BrokerEntry*>(userData);
+  /* *INDENT-ON* */
+  GstElement *element = nullptr;
+  SpklChallengeCallback callback = nullptr;
+
+  GST_DEBUG ("Challenge received for session %p (%s)", session, entry->id);
+  {
+    BrokerLock lock;
+    if (entry->owner) {
+      /* *INDENT-OFF* */
+      element = static_cast<GstElement*>(g_weak_ref_get (&entry->owner->elementRef));
+      /* *INDENT-ON* */
+      callback = entry->owner->challengeCallback;
+    }
+  }
+
+  if (element) {
+    callback (element, entry->id, url, challenge, challengeLength);
+    gst_object_unref (element);
+  }
+}
+
+static void
+spklBrokerKeyUpdate (struct OpenCDMSession *session, void *userData,
+    const uint8_t keyId[], const uint8_t length)
+{
+  dispatch (userData, [&](OpenCDMSessionCallbacks * callbacks,
+          GstElement * element) {
+        callbacks->key_update_callback (session, element, keyId, length);
+      });
+}
+
+static void
+spklBrokerErrorMessage (struct OpenCDMSession *session, void *userData,
+    const char message[])
+{
+  dispatch (userData, [&](OpenCDMSessionCallbacks * callbacks,
+          GstElement * element) {
+        callbacks->error_message_callback (session, element, message);
+      });
+}
+
+static void
+spklBrokerKeysUpdated (const struct OpenCDMSession *session, void *userData)
+{
+  {
+    BrokerLock lock;
+    /* *INDENT-OFF* */
+    static_cast<BrokerEntry*>(userData)->keysReady = TRUE;
+    /* *INDENT-ON* */
+  }
+
+  dispatch (userData, [&](OpenCDMSessionCallbacks * callbacks,
+          GstElement * element) {
+        callbacks->keys_updated_callback (session, element);
+      });
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+#include "open_cdm.h"
+
+G_BEGIN_DECLS
+
+// Process-wide registry of CDM systems and sessions, so that the decryptors of
+// a pipeline (audio and video tracks, successive periods) share a single
+// license round-trip when they use the same keys.
+//
+// Sessions are keyed on their system, license type and init data. The session
+// callbacks are forwarded to all the subscribed elements, except license
+// challenges which are only forwarded to the element that triggered the
+// session construction. The application thus receives a single
+// `spkl-challenge` message per license.
+//
+// Challenges are forwarded along with an identifier of the session, which the
+// application echoes back with the license so that it reaches the session that
+// requested it.
+
+typedef void (*SpklChallengeCallback)(GstElement*, const gchar* sessionId, const char url[], const uint8_t challenge[],
+    const uint16_t challengeLength);
+
+struct OpenCDMSystem* spkl_session_broker_acquire_system(const gchar* keySystem);
+void spkl_session_broker_release_system(struct OpenCDMSystem*);
+
+// Returns the session matching the given init data, constructing it if needed,
+// and subscribes element to its callbacks until the session is released.
+// The process_challenge_callback of the session callbacks is not used.
+struct OpenCDMSession* spkl_session_broker_acquire(struct OpenCDMSystem*, LicenseType, const gchar* initDataType,
+    const guint8* initData, gsize initDataSize, GstElement*, OpenCDMSessionCallbacks*, SpklChallengeCallback);
+
+// Returns the session replacing an expired one, constructing it if no other
+// element did so already.
+struct OpenCDMSession* spkl_session_broker_renew(struct OpenCDMSession* expired, GstElement*, OpenCDMSessionCallbacks*,
+    SpklChallengeCallback);
+
+// Whether the keys-updated notification of the session was already
+// dispatched, in which case late subscribers will not receive it.
+gboolean spkl_session_broker_keys_ready(struct OpenCDMSession*);
+
+void spkl_session_broker_release(struct OpenCDMSession*, GstElement*);
+
+// Keep the session alive, for instance while it is being updated, even if all
+// its subscribers release it meanwhile. spkl_session_broker_ref() returns FALSE
+// if the session is unknown, spkl_session_broker_lookup() returns nullptr.
+gboolean spkl_session_broker_ref(struct OpenCDMSession*);
+struct OpenCDMSession* spkl_session_broker_lookup(const gchar* sessionId);
+void spkl_session_broker_unref(struct OpenCDMSession*);
+
+G_END_DECLS
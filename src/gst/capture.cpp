@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: MIT
+
+#include "capture.h"
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+
+GST_DEBUG_CATEGORY_STATIC (spkl_capture_debug_category);
+#define GST_CAT_DEFAULT spkl_capture_debug_category
+
+struct _SparkleCapture
+{
+  GMutex mutex;                 // Serializes the records.
+  FILE *file;
+  gchar *location;
+  gboolean failed;
+};
+
+struct SparkleCaptureChunk
+{
+  gconstpointer data;
+  gsize size;
+};
+
+static const guint8 padding[SPKL_CAPTURE_ALIGNMENT] = { 0, };
+
+static gsize
+paddingSize (gsize size)
+{
+  return (SPKL_CAPTURE_ALIGNMENT - size % SPKL_CAPTURE_ALIGNMENT)
+      % SPKL_CAPTURE_ALIGNMENT;
+}
+
+// Called with the mutex held.
+static void
+writeData (SparkleCapture * capture, gconstpointer data, gsize size)
+{
+  if (capture->failed || !size)
+    return;
+
+  if (fwrite (data, 1, size, capture->file) != size) {
+    GST_ERROR ("Unable to write to %s, stopping the capture",
+        capture->location);
+    capture->failed = TRUE;
+  }
+}
+
+static void
+writeRecord (SparkleCapture * capture, SparkleCaptureRecordType type,
+    const SparkleCaptureChunk * chunks, guint count)
+{
+  gsize size = 0;
+  for (guint i = 0; i < count; i++)
+    size += chunks[i].size;
+  if (size > G_MAXUINT32) {
+    GST_WARNING ("Record too large, skipping it");
+    return;
+  }
+
+  guint32 header[2] = { GUINT32_TO_LE (type), GUINT32_TO_LE (size) };
+  g_mutex_lock (&capture->mutex);
+  writeData (capture, header, sizeof (header));
+  for (guint i = 0; i < count; i++)
+    writeData (capture, chunks[i].data, chunks[i].size);
+  writeData (capture, padding, paddingSize (size));
+  g_mutex_unlock (&capture->mutex);
+}
+
+SparkleCapture *
+spkl_capture_new (const gchar * location, GError ** error)
+{
+  GST_DEBUG_CATEGORY_INIT (spkl_capture_debug_category, "sprklcapture", 0,
+      "Sparkle-CDM capture");
+
+  FILE *file = g_fopen (location, "wb");
+  if (!file) {
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (errno),
+        "Unable to open %s: %s", location, g_strerror (errno));
+    return nullptr;
+  }
+
+  auto *capture = g_new0 (SparkleCapture, 1);
+  g_mutex_init (&capture->mutex);
+  capture->file = file;
+  capture->location = g_strdup (location);
+
+  guint8 header[SPKL_CAPTURE_HEADER_SIZE] = { 0, };
+  memcpy (header, SPKL_CAPTURE_MAGIC, SPKL_CAPTURE_MAGIC_SIZE);
+  GST_WRITE_UINT32_LE (header + SPKL_CAPTURE_MAGIC_SIZE,
+      SPKL_CAPTURE_VERSION);
+  writeData (capture, header, sizeof (header));
+
+  GST_DEBUG ("Recording to %s", location);
+  return capture;
+}
+
+void
+spkl_capture_free (SparkleCapture * capture)
+{
+  if (fclose (capture->file))
+    GST_ERROR ("Unable to write to %s", capture->location);
+  g_mutex_clear (&capture->mutex);
+  g_free (capture->location);
+  g_free (capture);
+}
+
+void
+spkl_capture_add_key_system (SparkleCapture * capture,
+    const gchar * keySystem)
+{
+  SparkleCaptureChunk chunk = { keySystem, strlen (keySystem) };
+  writeRecord (capture, SPKL_CAPTURE_RECORD_KEY_SYSTEM, &chunk, 1);
+}
+
+void
+spkl_capture_add_protection (SparkleCapture * capture,
+    const gchar * systemId, const gchar * origin, GstBuffer * data)
+{
+  GstMapInfo info;
+  if (!gst_buffer_map (data, &info, GST_MAP_READ))
+    return;
+
+  guint16 systemIdSize = GUINT16_TO_LE (strlen (systemId));
+  guint16 originSize = GUINT16_TO_LE (origin ? strlen (origin) : 0);
+  SparkleCaptureChunk chunks[] = {
+    {&systemIdSize, sizeof (systemIdSize)},
+    {systemId, strlen (systemId)},
+    {&originSize, sizeof (originSize)},
+    {origin, origin ? strlen (origin) : 0},
+    {info.data, info.size},
+  };
+  writeRecord (capture, SPKL_CAPTURE_RECORD_PROTECTION, chunks,
+      G_N_ELEMENTS (chunks));
+  gst_buffer_unmap (data, &info);
+}
+
+void
+spkl_capture_add_init_data (SparkleCapture * capture,
+    const gchar * initDataType, GBytes * initData)
+{
+  gsize size;
+  auto *data = g_bytes_get_data (initData, &size);
+  guint16 typeSize = GUINT16_TO_LE (strlen (initDataType));
+  SparkleCaptureChunk chunks[] = {
+    {&typeSize, sizeof (typeSize)},
+    {initDataType, strlen (initDataType)},
+    {data, size},
+  };
+  writeRecord (capture, SPKL_CAPTURE_RECORD_INIT_DATA, chunks,
+      G_N_ELEMENTS (chunks));
+}
+
+void
+spkl_capture_add_license (SparkleCapture * capture, GstBuffer * license)
+{
+  GstMapInfo info;
+  if (!gst_buffer_map (license, &info, GST_MAP_READ))
+    return;
+
+  SparkleCaptureChunk chunk = { info.data, info.size };
+  writeRecord (capture, SPKL_CAPTURE_RECORD_LICENSE, &chunk, 1);
+  gst_buffer_unmap (license, &info);
+}
+
+void
+spkl_capture_add_sample (SparkleCapture * capture, GstBuffer * buffer,
+    GstBuffer * keyID, GstBuffer * iv, GstBuffer * subSamples,
+    guint subSampleCount)
+{
+  GstMapInfo bufferInfo;
+  if (!gst_buffer_map (buffer, &bufferInfo, GST_MAP_READ))
+    return;
+
+  GstMapInfo keyIDInfo = GST_MAP_INFO_INIT;
+  GstMapInfo ivInfo = GST_MAP_INFO_INIT;
+  GstMapInfo subSamplesInfo = GST_MAP_INFO_INIT;
+  gboolean keyIDMapped = gst_buffer_map (keyID, &keyIDInfo, GST_MAP_READ);
+  gboolean ivMapped = gst_buffer_map (iv, &ivInfo, GST_MAP_READ);
+  gboolean subSamplesMapped = subSamples
+      && gst_buffer_map (subSamples, &subSamplesInfo, GST_MAP_READ);
+
+  gsize subSamplesSize = MIN (subSamplesInfo.size,
+      (gsize) subSampleCount * SPKL_CAPTURE_SUBSAMPLE_ENTRY_SIZE);
+  SparkleCaptureSample header = {
+    GUINT64_TO_LE (GST_BUFFER_PTS (buffer)),
+    (guint8) MIN (keyIDInfo.size, G_MAXUINT8),
+    (guint8) MIN (ivInfo.size, G_MAXUINT8),
+    0,
+    GUINT32_TO_LE (subSamplesSize / SPKL_CAPTURE_SUBSAMPLE_ENTRY_SIZE),
+  };
+  gsize descriptionSize = sizeof (header) + header.keyIDSize + header.ivSize
+      + subSamplesSize;
+  SparkleCaptureChunk chunks[] = {
+    {&header, sizeof (header)},
+    {keyIDInfo.data, header.keyIDSize},
+    {ivInfo.data, header.ivSize},
+    {subSamplesInfo.data, subSamplesSize},
+    {padding, paddingSize (descriptionSize)},
+    {bufferInfo.data, bufferInfo.size},
+  };
+  writeRecord (capture, SPKL_CAPTURE_RECORD_SAMPLE, chunks,
+      G_N_ELEMENTS (chunks));
+
+  if (subSamplesMapped)
+    gst_buffer_unmap (subSamples, &subSamplesInfo);
+  if (ivMapped)
+    gst_buffer_unmap (iv, &ivInfo);
+  if (keyIDMapped)
+    gst_buffer_unmap (keyID, &keyIDInfo);
+  gst_buffer_unmap (buffer, &bufferInfo);
+}
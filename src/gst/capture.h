@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+// Capture files record the protected stream seen by a decryptor, so that it
+// can be replayed offline through the shim and the CDM module, see
+// tools/sprkl-replay.c.
+//
+// Files start with SPKL_CAPTURE_MAGIC and the format version, as a 32 bits
+// integer padded to 8 bytes. Then come records, made of a type and a payload
+// size, both 32 bits, followed by the payload padded to SPKL_CAPTURE_ALIGNMENT
+// bytes, so that payloads stay aligned when the file is mapped. Integers are
+// little-endian, except in subsample entries, kept as in protection metas.
+//
+// Payloads:
+// - KEY_SYSTEM: the key system of the following sessions.
+// - PROTECTION: the system ID and the origin of a protection event, each as a
+//   16 bits size followed by the string, then the protection data.
+// - INIT_DATA: the init data type, as a 16 bits size followed by the string,
+//   then the init data of a new session.
+// - LICENSE: a license response for the last session. Only ClearKey licenses
+//   are recorded, they hold the content keys in clear.
+// - SAMPLE: a SparkleCaptureSample header, the key ID, the IV and the
+//   subsample entries, padded to SPKL_CAPTURE_ALIGNMENT bytes, then the
+//   encrypted sample.
+
+#define SPKL_CAPTURE_MAGIC "SPKLCAP"
+#define SPKL_CAPTURE_MAGIC_SIZE 8
+#define SPKL_CAPTURE_VERSION 1
+#define SPKL_CAPTURE_HEADER_SIZE 16
+#define SPKL_CAPTURE_ALIGNMENT 8
+#define SPKL_CAPTURE_SUBSAMPLE_ENTRY_SIZE 6
+
+typedef enum {
+    SPKL_CAPTURE_RECORD_KEY_SYSTEM = 1,
+    SPKL_CAPTURE_RECORD_PROTECTION,
+    SPKL_CAPTURE_RECORD_INIT_DATA,
+    SPKL_CAPTURE_RECORD_LICENSE,
+    SPKL_CAPTURE_RECORD_SAMPLE,
+} SparkleCaptureRecordType;
+
+typedef struct {
+    guint64 pts; // GST_CLOCK_TIME_NONE if unknown.
+    guint8 keyIDSize;
+    guint8 ivSize;
+    guint16 reserved;
+    guint32 subSampleCount;
+} SparkleCaptureSample;
+
+typedef struct _SparkleCapture SparkleCapture;
+
+// Records are appended from any thread.
+SparkleCapture* spkl_capture_new(const gchar* location, GError**);
+void spkl_capture_free(SparkleCapture*);
+
+void spkl_capture_add_key_system(SparkleCapture*, const gchar* keySystem);
+void spkl_capture_add_protection(SparkleCapture*, const gchar* systemId, const gchar* origin, GstBuffer* data);
+void spkl_capture_add_init_data(SparkleCapture*, const gchar* initDataType, GBytes* initData);
+void spkl_capture_add_license(SparkleCapture*, GstBuffer* license);
+void spkl_capture_add_sample(SparkleCapture*, GstBuffer* buffer, GstBuffer* keyID, GstBuffer* iv, GstBuffer* subSamples, guint subSampleCount);
+
+G_END_DECLS
@@ -1,7 +1,10 @@
 // SPDX-License-Identifier: MIT
 
 #include "decryptor.h"
+#include "broker.h"
+#include "lazymemory.h"
 #include "open_cdm_adapter.h"
+#include "sprkl/sprkl-cdm.h"
 #include "sprkl/sprklgst.h"
 #include <uuid.h>
 
@@ -35,19 +38,79 @@
  * `dash/mpd`). This can be useful for manifests that include license server
  * URLs in the ContentProtection XML, for instance. The decryptor already keeps
  * track of the init data (PSSH), so applications do not need to handle this
- * part.
+ * part. All the key IDs and PSSH boxes announced in the manifest are
+ * requested in a single license, so that representation and period switches
+ * find their keys already available. When new keys get announced, a new
+ * license covering all of them is requested while decryption carries on with
+ * the current one.
  *
  * 2. Once the decryptor has received a license challenge from the underlying
  * CDM, it emits a `spkl-challenge` message, which the application needs to
  * forward to the license server. The message structure embeds the data in a
- * `challenge` GstBuffer. Application developer should refer to the
+ * `challenge` GstBuffer, along with a `session-id` string identifying the
+ * CDM session that issued it. Application developer should refer to the
  * content-provider documentation regarding the challenge submission process.
  * For DASH this is often handled with a POST HTTPs request.
  *
  * 3. Once the license server has provided a response to the challenge request,
  * this response needs to be sent to the decryptor, using a custom downstream
  * OOB event that includes a `spkl-session-update` structure containing one
- * `message` GstBuffer field that represents the unprocessed response.
+ * `message` GstBuffer field that represents the unprocessed response, and the
+ * `session-id` string of the challenge. Without it, the response is handed to
+ * the session of the latest challenge of the decryptor receiving the event.
+ *
+ * Decryptors using the same key system and init data, for instance the audio
+ * and video tracks of a stream, share a single CDM session. Only the first of
+ * them emits the `spkl-challenge` message, the license it receives unlocks
+ * all of them.
+ *
+ * While the license is pending, encrypted buffers are kept aside instead of
+ * blocking the streaming thread, so that upstream can keep downloading and
+ * parsing. Once the keys are usable the parked buffers are pushed downstream
+ * in a burst by the streaming thread, along with the next buffer or
+ * serialized event. The backlog is bounded by the `backlog-size` and
+ * `backlog-timeout` properties.
+ *
+ * When the CDM module reports an expiration time for the session keys, a new
+ * session is requested `renewal-margin` ahead of it, and used from the first
+ * sample following the reception of its keys.
+ *
+ * Setting `n-threads` moves decryption to a pool of worker threads, which
+ * helps high bitrate streams on multi-core devices. Output order is kept and
+ * at most twice as many buffers as threads are in flight. Otherwise, the
+ * samples of buffer lists are handed to the CDM module in a single call.
+ *
+ * The `stats` property reports the number of buffers and bytes decrypted, the
+ * number of buffers dropped before decryption, percentiles of the decryption
+ * time of recent buffers (in nanoseconds), the time spent waiting for keys,
+ * the number of session renewals and decryption failures, and the number of
+ * buffers parked in the backlog. When
+ * `stats-interval` is set, the same structure is periodically posted as a
+ * `spkl-stats` element message. The `sprkldecrypt` tracer reports the same
+ * decryption and key wait times per output buffer.
+ *
+ * Encrypted buffers flagged as droppable are not decrypted when they fall
+ * outside of the segment, or when downstream QoS events report a lateness
+ * above `qos-drop-threshold` and the buffer is already late. Delta units are
+ * not decrypted in segments with the key unit trick mode flag.
+ *
+ * The session holding each key is tracked, so that when keys rotate, samples
+ * of the previous keys keep being decrypted with the current session while
+ * the license of the new keys, requested as soon as they are announced, is
+ * used for the others once usable.
+ *
+ * With `lazy` enabled, encrypted buffers are pushed with memories that are
+ * only decrypted when one of them is first mapped, usually by the decoder on
+ * its thread. Buffers dropped before decoding are then never decrypted. Lazy
+ * decryption takes precedence over `n-threads`. It only starts once the keys
+ * are usable, and mapping never waits for them. Decryption failures surface
+ * as map failures downstream.
+ *
+ * Setting `record-location` records the protection events, the license
+ * requests, the ClearKey license responses and the encrypted samples with
+ * their protection metas into a capture file, which tools/sprkl-replay.c
+ * decrypts offline at full speed. Licenses of other key systems are left out,
+ * so those captures do not carry usable keys.
  *
  * An example player is provided, see examples/sample-player.c.
  *
@@ -91,6 +154,31 @@ static GstStaticPadTemplate srcTemplate =
     GST_STATIC_CAPS
     ("audio/x-opus; audio/x-flac; audio/mpeg; video/x-h264; video/x-h265"));
 
+enum
+{
+  PROP_0,
+  PROP_BACKLOG_SIZE,
+  PROP_BACKLOG_TIMEOUT,
+  PROP_N_THREADS,
+  PROP_RENEWAL_MARGIN,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_QOS_DROP_THRESHOLD,
+  PROP_LAZY,
+  PROP_RECORD_LOCATION,
+};
+
+#define DEFAULT_BACKLOG_SIZE 64
+#define DEFAULT_BACKLOG_TIMEOUT (10 * GST_SECOND)
+#define DEFAULT_N_THREADS 0
+#define DEFAULT_RENEWAL_MARGIN (30 * GST_SECOND)
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_QOS_DROP_THRESHOLD (40 * GST_MSECOND)
+#define DEFAULT_LAZY FALSE
+
+// Enough for the representations of an adaptation set, queried from both pads.
+#define CAPS_CACHE_SIZE 16
+
 #define spkl_decryptor_parent_class parent_class
 G_DEFINE_TYPE_WITH_CODE (SparkleDecryptor, spkl_decryptor,
     GST_TYPE_BASE_TRANSFORM,
@@ -98,6 +186,33 @@ G_DEFINE_TYPE_WITH_CODE (SparkleDecryptor, spkl_decryptor,
         "sprkldecryptor", 0, "Sparkle decryptor");
     );
 
+// Protection meta fields, interned once at class initialization.
+static GQuark ivSizeQuark;
+static GQuark encryptedQuark;
+static GQuark subSampleCountQuark;
+static GQuark subSamplesQuark;
+static GQuark kidQuark;
+static GQuark ivQuark;
+
+struct SparkleSample
+{
+  GstProtectionMeta *protectionMeta;
+  GstBuffer *subSamples;
+  guint subSampleCount;
+  GstBuffer *keyID;
+  GstBuffer *iv;
+};
+
+// Buffer handed over to the decryption thread pool. Jobs are queued in
+// submission order and only leave the queue from its head.
+struct SparkleDecryptJob
+{
+  GstBuffer *buffer;
+  SparkleSample sample;
+  GstFlowReturn ret;
+  gboolean done;
+};
+
 class GMutexHolder
 {
 public:
@@ -116,12 +231,184 @@ private:
 };
 
 
+static void spklKeysUpdated (const struct OpenCDMSession *session,
+    void *userData);
+static GstFlowReturn finishJobs (SparkleDecryptor * self);
+static gboolean shouldDrop (SparkleDecryptor * self, GstBuffer * buffer);
+static void recordSample (SparkleDecryptor * self, GstBuffer * buffer);
+
 static void
-spklProcessChallenge (G_GNUC_UNUSED struct OpenCDMSession *session,
-    void *userData, const char url[], const uint8_t challenge[],
-    const uint16_t challengeLength)
+recordDecryption (SparkleDecryptor * self, guint buffers, gsize bytes,
+    gint64 duration)
 {
-  auto *self = SPKL_DECRYPTOR (userData);
+  GMutexHolder lock (self->statsMutex);
+  auto *stats = &self->stats;
+
+  stats->buffers += buffers;
+  stats->bytes += bytes;
+
+  stats->decryptTime += duration * GST_USECOND;
+
+  // Batches are accounted as buffers of equal decryption time.
+  GstClockTime latency = duration * GST_USECOND / MAX (buffers, 1);
+  for (guint i = 0; i < buffers; i++) {
+    stats->latencies[stats->latencyIndex] = latency;
+    stats->latencyIndex =
+        (stats->latencyIndex + 1) % SPKL_DECRYPTOR_LATENCY_WINDOW;
+    stats->latencyCount =
+        MIN (stats->latencyCount + 1, SPKL_DECRYPTOR_LATENCY_WINDOW);
+  }
+}
+
+static void
+recordDrop (SparkleDecryptor * self)
+{
+  GMutexHolder lock (self->statsMutex);
+  self->stats.dropped++;
+}
+
+static void
+recordFailure (SparkleDecryptor * self)
+{
+  GMutexHolder lock (self->statsMutex);
+  self->stats.failures++;
+}
+
+static void
+recordRenewal (SparkleDecryptor * self)
+{
+  GMutexHolder lock (self->statsMutex);
+  self->stats.renewals++;
+}
+
+void
+spkl_decryptor_get_times (SparkleDecryptor * self, GstClockTime * decryptTime,
+    GstClockTime * waitTime)
+{
+  GMutexHolder lock (self->statsMutex);
+  *decryptTime = self->stats.decryptTime;
+  *waitTime = self->stats.waitTime;
+}
+
+gboolean
+spkl_decryptor_decrypts_in_order (SparkleDecryptor * self)
+{
+  // Worker threads decrypt ahead of the pushes and lazy buffers are decrypted
+  // by their consumer after being pushed.
+  return !self->workerPool && !self->lazy;
+}
+
+static int
+compareClockTimes (gconstpointer a, gconstpointer b)
+{
+  auto first = *(const GstClockTime *) a;
+  auto second = *(const GstClockTime *) b;
+  return first < second ? -1 : first > second;
+}
+
+static GstStructure *
+buildStats (SparkleDecryptor * self)
+{
+  SparkleDecryptorStats stats;
+  {
+    GMutexHolder lock (self->statsMutex);
+    stats = self->stats;
+  }
+
+  guint backlog;
+  {
+    GMutexHolder lock (self->cdmAttachmentMutex);
+    backlog = g_queue_get_length (&self->backlog);
+  }
+
+  GstClockTime percentiles[3] = { 0, 0, 0 };
+  if (stats.latencyCount) {
+    qsort (stats.latencies, stats.latencyCount, sizeof (GstClockTime),
+        compareClockTimes);
+    percentiles[0] = stats.latencies[stats.latencyCount * 50 / 100];
+    percentiles[1] = stats.latencies[stats.latencyCount * 95 / 100];
+    percentiles[2] = stats.latencies[stats.latencyCount * 99 / 100];
+  }
+
+  return gst_structure_new ("spkl-stats",
+      "buffers", G_TYPE_UINT64, stats.buffers,
+      "bytes", G_TYPE_UINT64, stats.bytes,
+      "dropped", G_TYPE_UINT64, stats.dropped,
+      "latency-p50", G_TYPE_UINT64, percentiles[0],
+      "latency-p95", G_TYPE_UINT64, percentiles[1],
+      "latency-p99", G_TYPE_UINT64, percentiles[2],
+      "wait-time", G_TYPE_UINT64, stats.waitTime,
+      "renewals", G_TYPE_UINT, stats.renewals,
+      "failures", G_TYPE_UINT, stats.failures,
+      "backlog", G_TYPE_UINT, backlog, nullptr);
+}
+
+// Posts a spkl-stats message if stats-interval elapsed since the last one,
+// called from the streaming thread.
+static void
+postStatsIfNeeded (SparkleDecryptor * self)
+{
+  GST_OBJECT_LOCK (self);
+  auto interval = self->statsInterval;
+  GST_OBJECT_UNLOCK (self);
+  if (!interval)
+    return;
+
+  auto now = g_get_monotonic_time ();
+  if (self->lastStatsTime
+      && now - self->lastStatsTime < (gint64) GST_TIME_AS_USECONDS (interval))
+    return;
+  self->lastStatsTime = now;
+
+  gst_element_post_message (GST_ELEMENT_CAST (self),
+      gst_message_new_element (GST_OBJECT_CAST (self), buildStats (self)));
+}
+
+// Must be called with cdmAttachmentMutex held.
+static GstFlowReturn
+waitForProvisioning (SparkleDecryptor * self, gint64 endTime)
+{
+  if (self->provisioned || self->flushing)
+    return self->flushing ? GST_FLOW_FLUSHING : GST_FLOW_OK;
+
+  GstFlowReturn ret = GST_FLOW_OK;
+  auto start = g_get_monotonic_time ();
+  while (!self->provisioned && !self->flushing) {
+    if (!g_cond_wait_until (&self->cdmAttachmentCondition,
+            &self->cdmAttachmentMutex, endTime)) {
+      GST_ERROR_OBJECT (self, "CDM still not configured after %"
+          GST_TIME_FORMAT " of waiting", GST_TIME_ARGS (self->backlogTimeout));
+      ret = GST_FLOW_NOT_SUPPORTED;
+      break;
+    }
+  }
+
+  {
+    GMutexHolder lock (self->statsMutex);
+    self->stats.waitTime += (g_get_monotonic_time () - start) * GST_USECOND;
+  }
+
+  if (ret == GST_FLOW_OK && self->flushing)
+    ret = GST_FLOW_FLUSHING;
+  return ret;
+}
+
+// Keys are delivered on the application, CDM or sibling decryptor threads,
+// which must not push downstream. Parked buffers are drained by the streaming
+// thread with the next buffer or serialized event.
+static void
+signalProvisioned (SparkleDecryptor * self)
+{
+  GMutexHolder lock (self->cdmAttachmentMutex);
+  self->provisioned = TRUE;
+  g_cond_signal (&self->cdmAttachmentCondition);
+}
+
+static void
+spklProcessChallenge (GstElement * element, const gchar * sessionId,
+    const char url[], const uint8_t challenge[], const uint16_t challengeLength)
+{
+  auto *self = SPKL_DECRYPTOR (element);
 
   GST_DEBUG_OBJECT (self, "Challenge received from CDM");
   if (challenge[0] != '0') {
@@ -138,25 +425,225 @@ spklProcessChallenge (G_GNUC_UNUSED struct OpenCDMSession *session,
   gst_bus_post (bus, gst_message_new_element (GST_OBJECT_CAST (self),
           gst_structure_new ("spkl-challenge", "challenge", GST_TYPE_BUFFER,
               challengeBuffer, "url", G_TYPE_STRING, url, "session-id",
-              G_TYPE_STRING, GST_OBJECT_NAME (self), nullptr)));
+              G_TYPE_STRING, sessionId, nullptr)));
 }
 
-static void
-renewSession (SparkleDecryptor *self)
+// Builds init data covering all the key IDs and PSSH boxes announced so far.
+// ClearKey sessions are given the list of key IDs, so that a single license
+// covers all the representations and periods.
+static GBytes *
+sessionInitData (SparkleDecryptor * self, const gchar * keySystem,
+    const gchar ** initDataType)
 {
-  gsize pssh_size;
-  gconstpointer pssh_data;
+  gboolean preferKeyIDs = g_str_equal (keySystem, "org.w3.clearkey");
+
+  if (self->psshs->len && !(preferKeyIDs && self->kids->len)) {
+    // CENC init data can hold several concatenated PSSH boxes.
+    *initDataType = "cenc";
+    GByteArray *initData = g_byte_array_new ();
+    for (guint i = 0; i < self->psshs->len; i++) {
+      gsize size;
+      /* *INDENT-OFF* */
+      auto *data = static_cast<const guint8*>(g_bytes_get_data (static_cast<GBytes*>(g_ptr_array_index (self->psshs, i)), &size));
+      /* *INDENT-ON* */
+      g_byte_array_append (initData, data, size);
+    }
+    return g_byte_array_free_to_bytes (initData);
+  }
+
+  *initDataType = "keyids";
+  GString *initData = g_string_new ("{\"kids\":[");
+  for (guint i = 0; i < self->kids->len; i++) {
+    g_string_append_printf (initData, "%s\"%s\"", i ? "," : "",
+        (const gchar *) g_ptr_array_index (self->kids, i));
+  }
+  g_string_append (initData, "]}");
+  return g_string_free_to_bytes (initData);
+}
 
-  // We might need to close the pending session before attempting to construct a
-  // new one?
-  g_return_if_fail (self->pending_session == nullptr);
+static void
+renewSession (SparkleDecryptor * self)
+{
+  // Decryption threads might concurrently notice the session expired.
+  g_rw_lock_writer_lock (&self->sessionLock);
+  gboolean renewing = self->pending_session || self->renewing;
+  self->renewing = TRUE;
+  auto *expiredSession = self->session;
+  g_rw_lock_writer_unlock (&self->sessionLock);
+  if (renewing) {
+    GST_DEBUG_OBJECT (self, "Session renewal already in progress");
+    return;
+  }
 
+  // Other decryptors sharing the session might have renewed it already.
   GST_DEBUG_OBJECT (self, "Renewing session");
+  recordRenewal (self);
   self->clearBufferNotified = FALSE;
-  pssh_data = g_bytes_get_data (self->pssh, &pssh_size);
-  opencdm_construct_session (self->system, Temporary, "cenc",
-                             (const uint8_t *) pssh_data, pssh_size, nullptr, 0,
-                             &self->sessionCallbacks, self, &self->pending_session);
+  auto *session = spkl_session_broker_renew (expiredSession,
+      GST_ELEMENT_CAST (self), &self->sessionCallbacks, spklProcessChallenge);
+
+  g_rw_lock_writer_lock (&self->sessionLock);
+  self->pending_session = session;
+  self->pendingSessionReady = FALSE;
+  self->renewing = FALSE;
+  g_rw_lock_writer_unlock (&self->sessionLock);
+
+  if (session && spkl_session_broker_keys_ready (session))
+    spklKeysUpdated (session, self);
+}
+
+// Returns the session known to hold the key, if any. Must be called with the
+// session lock held.
+static struct OpenCDMSession *
+lookupKeySession (SparkleDecryptor * self, GstBuffer * keyIDBuffer)
+{
+  struct OpenCDMSession *session = nullptr;
+  GstMapInfo info GST_MAP_INFO_INIT;
+  gst_buffer_map (keyIDBuffer, &info, GST_MAP_READ);
+  for (guint i = 0; i < self->keySessions->len; i++) {
+    auto *entry = &g_array_index (self->keySessions, SparkleKeySession, i);
+    if (entry->keyIDSize == info.size
+        && !memcmp (entry->keyID, info.data, info.size)) {
+      session = entry->session;
+      break;
+    }
+  }
+  gst_buffer_unmap (keyIDBuffer, &info);
+  return session;
+}
+
+// Must be called with the session writer lock held.
+static void
+addKeySession (SparkleDecryptor * self, struct OpenCDMSession *session,
+    const guint8 * keyID, gsize keyIDSize)
+{
+  if (keyIDSize > sizeof (SparkleKeySession::keyID))
+    return;
+
+  for (guint i = 0; i < self->keySessions->len; i++) {
+    auto *entry = &g_array_index (self->keySessions, SparkleKeySession, i);
+    if (entry->keyIDSize == keyIDSize
+        && !memcmp (entry->keyID, keyID, keyIDSize)) {
+      entry->session = session;
+      return;
+    }
+  }
+
+  SparkleKeySession entry;
+  memcpy (entry.keyID, keyID, keyIDSize);
+  entry.keyIDSize = keyIDSize;
+  entry.session = session;
+  g_array_append_val (self->keySessions, entry);
+}
+
+// Forgets the given key of the session, or all its keys if keyID is null.
+// Must be called with the session writer lock held, and before releasing the
+// session.
+static void
+forgetKeySessions (SparkleDecryptor * self, struct OpenCDMSession *session,
+    const guint8 * keyID, gsize keyIDSize)
+{
+  for (guint i = self->keySessions->len; i > 0; i--) {
+    auto *entry = &g_array_index (self->keySessions, SparkleKeySession, i - 1);
+    if (entry->session == session && (!keyID
+            || (entry->keyIDSize == keyIDSize
+                && !memcmp (entry->keyID, keyID, keyIDSize))))
+      g_array_remove_index_fast (self->keySessions, i - 1);
+  }
+}
+
+// Finds out which session holds the key of a sample that is not in
+// keySessions yet. Returns nullptr when the key might come with the pending
+// session, in which case decryption has to wait for it.
+static struct OpenCDMSession *
+resolveKeySession (SparkleDecryptor * self, GstBuffer * keyIDBuffer)
+{
+  g_rw_lock_writer_lock (&self->sessionLock);
+  auto *session = lookupKeySession (self, keyIDBuffer);
+  if (session) {
+    g_rw_lock_writer_unlock (&self->sessionLock);
+    return session;
+  }
+
+  GstMapInfo info GST_MAP_INFO_INIT;
+  gst_buffer_map (keyIDBuffer, &info, GST_MAP_READ);
+  struct OpenCDMSession *candidates[] =
+      { self->pending_session, self->session };
+  for (auto *candidate : candidates) {
+    if (candidate
+        && opencdm_session_status (candidate, info.data, info.size) == Usable) {
+      session = candidate;
+      break;
+    }
+  }
+
+  // Modules might not report the status of all keys, the current session is
+  // then assumed to hold the key unless it might come with the pending
+  // session. Wrong guesses are forgotten once the session is replaced.
+  if (!session && !(self->pending_session && !self->pendingSessionReady))
+    session = self->session;
+
+  if (session) {
+    addKeySession (self, session, info.data, info.size);
+  } else {
+    // Still holding the session lock, so that the keys-updated notification
+    // of the pending session cannot be missed.
+    GST_DEBUG_OBJECT (self, "Key not usable yet, waiting for pending session");
+    GMutexHolder lock (self->cdmAttachmentMutex);
+    self->provisioned = FALSE;
+  }
+  gst_buffer_unmap (keyIDBuffer, &info);
+  g_rw_lock_writer_unlock (&self->sessionLock);
+  return session;
+}
+
+// Must be called with the session writer lock held.
+static void
+promotePendingSession (SparkleDecryptor * self)
+{
+  if (self->session) {
+    forgetKeySessions (self, self->session, nullptr, 0);
+    spkl_session_broker_release (self->session, GST_ELEMENT_CAST (self));
+  }
+  self->session = self->pending_session;
+  self->pending_session = nullptr;
+  self->pendingSessionReady = FALSE;
+
+  auto expiration = sprkl_session_expiration (self->session);
+  self->keyExpiration = expiration >= 0 ? expiration * 1000 : -1;
+}
+
+// Starts renewing the session once its keys are about to expire and switches
+// to the renewed session as soon as its keys are usable, so that decryption
+// does not stall on expiry. Called before decrypting each sample.
+static void
+renewSessionIfNeeded (SparkleDecryptor * self)
+{
+  g_rw_lock_reader_lock (&self->sessionLock);
+  gboolean ready = self->pendingSessionReady;
+  gboolean renewing = self->pending_session || self->renewing;
+  gint64 expiration = self->keyExpiration;
+  GstClockTime margin = self->renewalMargin;
+  g_rw_lock_reader_unlock (&self->sessionLock);
+
+  if (ready) {
+    g_rw_lock_writer_lock (&self->sessionLock);
+    if (self->pendingSessionReady) {
+      GST_DEBUG_OBJECT (self, "Switching to renewed session");
+      promotePendingSession (self);
+    }
+    g_rw_lock_writer_unlock (&self->sessionLock);
+    return;
+  }
+
+  if (renewing || expiration < 0
+      || g_get_real_time () + (gint64) GST_TIME_AS_USECONDS (margin) <
+      expiration)
+    return;
+
+  GST_DEBUG_OBJECT (self, "Session keys expire in %" G_GINT64_FORMAT
+      " ms, renewing", (expiration - g_get_real_time ()) / 1000);
+  renewSession (self);
 }
 
 static void
@@ -169,12 +656,19 @@ spklKeyUpdate (struct OpenCDMSession *session, void *userData,
   auto status = opencdm_session_status (session, keyId, length);
   GST_DEBUG_OBJECT (self, "Got new key update to %d", status);
 
-  if (status == Usable) {
-    g_mutex_lock (&self->cdmAttachmentMutex);
-    self->provisioned = TRUE;
-    g_cond_signal (&self->cdmAttachmentCondition);
-    g_mutex_unlock (&self->cdmAttachmentMutex);
+  // Keep track of the session holding each key, so that samples are decrypted
+  // with the right one when keys rotate.
+  g_rw_lock_writer_lock (&self->sessionLock);
+  if (session == self->session || session == self->pending_session) {
+    if (status == Usable)
+      addKeySession (self, session, keyId, length);
+    else
+      forgetKeySessions (self, session, keyId, length);
   }
+  g_rw_lock_writer_unlock (&self->sessionLock);
+
+  if (status == Usable)
+    signalProvisioned (self);
 
   if (status == Expired)
     renewSession(self);
@@ -189,20 +683,34 @@ spklErrorMessage (G_GNUC_UNUSED struct OpenCDMSession *session, void *userData,
 }
 
 static void
-spklKeysUpdated (G_GNUC_UNUSED const struct OpenCDMSession *session,
-    void *userData)
+spklKeysUpdated (const struct OpenCDMSession *session, void *userData)
 {
   auto *self = SPKL_DECRYPTOR (userData);
-  if (self->pending_session) {
+
+  g_rw_lock_writer_lock (&self->sessionLock);
+  if (self->pending_session && session == self->pending_session) {
+    self->pendingSessionReady = TRUE;
+    g_rw_lock_writer_unlock (&self->sessionLock);
+    GST_DEBUG_OBJECT (self,
+        "Renewed session ready, switching at the next sample");
+    // Wake up samples waiting for keys of the pending session.
+    signalProvisioned (self);
+    return;
+  }
+
+  if (self->pending_session || self->renewing) {
+    g_rw_lock_writer_unlock (&self->sessionLock);
     GST_DEBUG_OBJECT (self,
         "Session pending renewal, ignoring keys-updated notification");
     return;
   }
+
+  auto expiration = sprkl_session_expiration (session);
+  self->keyExpiration = expiration >= 0 ? expiration * 1000 : -1;
+  g_rw_lock_writer_unlock (&self->sessionLock);
+
   GST_DEBUG_OBJECT (self, "All keys updated, starting decryption");
-  g_mutex_lock (&self->cdmAttachmentMutex);
-  self->provisioned = TRUE;
-  g_cond_signal (&self->cdmAttachmentCondition);
-  g_mutex_unlock (&self->cdmAttachmentMutex);
+  signalProvisioned (self);
 }
 
 static const gchar *
@@ -218,13 +726,25 @@ get_attr_val (const gchar ** names, const gchar ** vals, const gchar * name)
 }
 
 static void
-encode_key (SparkleDecryptor * self, const gchar * kid, gsize size)
+addKeyID (SparkleDecryptor * self, const guint8 * kid, gsize size)
 {
-  if (self->kid)
-    g_free (self->kid);
-  g_autofree gchar *encoded_kid = g_base64_encode ((const guchar *) kid, size);
-  // Convert to Base64-URL (remove trailing ==)
-  self->kid = g_strndup (encoded_kid, strlen (encoded_kid) - 2);
+  // Base64-URL without padding, as expected in keyids init data.
+  gchar *encodedKid = g_base64_encode (kid, size);
+  g_strdelimit (encodedKid, "+", '-');
+  g_strdelimit (encodedKid, "/", '_');
+  gchar *padding = strchr (encodedKid, '=');
+  if (padding)
+    *padding = '\0';
+
+  for (guint i = 0; i < self->kids->len; i++) {
+    if (g_str_equal (g_ptr_array_index (self->kids, i), encodedKid)) {
+      g_free (encodedKid);
+      return;
+    }
+  }
+
+  GST_DEBUG_OBJECT (self, "Found key ID %s", encodedKid);
+  g_ptr_array_add (self->kids, encodedKid);
 }
 
 static void
@@ -243,10 +763,10 @@ markupStartElement (G_GNUC_UNUSED GMarkupParseContext * context,
     if (kid != nullptr) {
       uuid_t uuid;
       if (uuid_parse (kid, uuid) != -1) {
-        encode_key (self, (const gchar *) uuid, 16);
+        addKeyID (self, uuid, 16);
       } else {
         GST_DEBUG_OBJECT (self, "default_KID is not a UUID, encoding as-is");
-        encode_key (self, kid, strlen (kid));
+        addKeyID (self, (const guint8 *) kid, strlen (kid));
       }
     }
   }
@@ -270,13 +790,19 @@ markupText (G_GNUC_UNUSED GMarkupParseContext * context,
 {
   auto *self = SPKL_DECRYPTOR (user_data);
   if (self->parsingPssh) {
-    if (self->pssh)
-      g_bytes_unref (self->pssh);
     g_autofree gchar *encodedPssh = g_strndup (text, text_len);
     gsize len;
-    guchar *pssh = g_base64_decode (encodedPssh, &len);
-    GST_MEMDUMP_OBJECT (self, "pssh", (const guint8 *) pssh, len);
-    self->pssh = g_bytes_new_take (pssh, len);
+    guchar *data = g_base64_decode (encodedPssh, &len);
+    GST_MEMDUMP_OBJECT (self, "pssh", (const guint8 *) data, len);
+    GBytes *pssh = g_bytes_new_take (data, len);
+
+    for (guint i = 0; i < self->psshs->len; i++) {
+      if (g_bytes_equal (g_ptr_array_index (self->psshs, i), pssh)) {
+        g_bytes_unref (pssh);
+        return;
+      }
+    }
+    g_ptr_array_add (self->psshs, pssh);
   }
 }
 
@@ -301,18 +827,33 @@ spkl_decryptor_init (SparkleDecryptor * self)
   gst_base_transform_set_in_place (base, TRUE);
   gst_base_transform_set_passthrough (base, FALSE);
   gst_base_transform_set_gap_aware (base, FALSE);
+  gst_pad_set_chain_list_function (GST_BASE_TRANSFORM_SINK_PAD (base),
+      GST_DEBUG_FUNCPTR (chainList));
 
   self->system = nullptr;
   self->session = nullptr;
   self->pending_session = nullptr;
-  self->pssh = nullptr;
-  self->sessionCallbacks.process_challenge_callback = spklProcessChallenge;
+  self->psshs = g_ptr_array_new_with_free_func ((GDestroyNotify) g_bytes_unref);
+  self->kids = g_ptr_array_new_with_free_func (g_free);
+  self->initData = nullptr;
+  self->keySystem = nullptr;
+  self->inputCaps = nullptr;
+  // Challenges are forwarded by the session broker to spklProcessChallenge().
+  self->sessionCallbacks.process_challenge_callback = nullptr;
   self->sessionCallbacks.key_update_callback = spklKeyUpdate;
   self->sessionCallbacks.error_message_callback = spklErrorMessage;
   self->sessionCallbacks.keys_updated_callback = spklKeysUpdated;
   self->provisioned = FALSE;
   self->clearBufferNotified = FALSE;
 
+  g_queue_init (&self->capsCache);
+  g_queue_init (&self->backlog);
+  self->backlogStart = 0;
+  self->maxBacklogSize = DEFAULT_BACKLOG_SIZE;
+  self->backlogTimeout = DEFAULT_BACKLOG_TIMEOUT;
+  self->flushing = FALSE;
+  self->listFiltered = FALSE;
+
   self->markupParser.start_element = markupStartElement;
   self->markupParser.end_element = markupEndElement;
   self->markupParser.text = markupText;
@@ -325,6 +866,27 @@ spkl_decryptor_init (SparkleDecryptor * self)
 
   g_cond_init (&self->cdmAttachmentCondition);
   g_mutex_init (&self->cdmAttachmentMutex);
+  g_rw_lock_init (&self->sessionLock);
+  self->renewing = FALSE;
+  self->pendingSessionReady = FALSE;
+  self->keyExpiration = -1;
+  self->renewalMargin = DEFAULT_RENEWAL_MARGIN;
+  self->keySessions = g_array_new (FALSE, FALSE, sizeof (SparkleKeySession));
+
+  self->lazy = DEFAULT_LAZY;
+  self->nThreads = DEFAULT_N_THREADS;
+  self->workerPool = nullptr;
+  g_queue_init (&self->jobs);
+  g_mutex_init (&self->workerMutex);
+  g_cond_init (&self->workerCondition);
+
+  memset (&self->stats, 0, sizeof (self->stats));
+  g_mutex_init (&self->statsMutex);
+  self->statsInterval = DEFAULT_STATS_INTERVAL;
+  self->lastStatsTime = 0;
+
+  self->qosDropThreshold = DEFAULT_QOS_DROP_THRESHOLD;
+  self->earliestTime = GST_CLOCK_TIME_NONE;
 }
 
 static gboolean
@@ -333,18 +895,97 @@ proposeAllocation (GstBaseTransform *, GstQuery *, GstQuery *)
   return FALSE;
 }
 
+static void
+freeCapsCacheEntry (SparkleCapsCacheEntry * entry)
+{
+  gst_caps_unref (entry->caps);
+  gst_clear_caps (&entry->filter);
+  gst_caps_unref (entry->result);
+  g_free (entry);
+}
+
+static void
+clearCapsCache (SparkleDecryptor * self)
+{
+  GST_OBJECT_LOCK (self);
+  g_queue_clear_full (&self->capsCache, (GDestroyNotify) freeCapsCacheEntry);
+  GST_OBJECT_UNLOCK (self);
+}
+
+static gboolean
+capsEqual (GstCaps * a, GstCaps * b)
+{
+  return a == b || (a && b && gst_caps_is_strictly_equal (a, b));
+}
+
+static GstCaps *
+lookupCapsCache (SparkleDecryptor * self, GstPadDirection direction,
+    GstCaps * caps, GstCaps * filter)
+{
+  GstCaps *result = nullptr;
+
+  GST_OBJECT_LOCK (self);
+  for (auto *link = self->capsCache.head; link; link = link->next) {
+    /* *INDENT-OFF* */
+    auto *entry = static_cast<SparkleCapsCacheEntry*>(link->data);
+    /* *INDENT-ON* */
+    if (entry->direction != direction || !capsEqual (entry->caps, caps)
+        || !capsEqual (entry->filter, filter))
+      continue;
+
+    g_queue_unlink (&self->capsCache, link);
+    g_queue_push_head_link (&self->capsCache, link);
+    result = gst_caps_ref (entry->result);
+    break;
+  }
+  GST_OBJECT_UNLOCK (self);
+
+  return result;
+}
+
+static void
+insertCapsCache (SparkleDecryptor * self, GstPadDirection direction,
+    GstCaps * caps, GstCaps * filter, GstCaps * result)
+{
+  auto *entry = g_new0 (SparkleCapsCacheEntry, 1);
+  entry->direction = direction;
+  entry->caps = gst_caps_ref (caps);
+  entry->filter = filter ? gst_caps_ref (filter) : nullptr;
+  entry->result = gst_caps_ref (result);
+
+  GST_OBJECT_LOCK (self);
+  g_queue_push_head (&self->capsCache, entry);
+  while (g_queue_get_length (&self->capsCache) > CAPS_CACHE_SIZE) {
+    /* *INDENT-OFF* */
+    freeCapsCacheEntry (static_cast<SparkleCapsCacheEntry*>(g_queue_pop_tail (&self->capsCache)));
+    /* *INDENT-ON* */
+  }
+  GST_OBJECT_UNLOCK (self);
+}
+
 static GstCaps *
 transformCaps (GstBaseTransform * base, GstPadDirection direction,
     GstCaps * caps, GstCaps * filter)
 {
+  auto *self = SPKL_DECRYPTOR (base);
+
   if (direction == GST_PAD_UNKNOWN)
     return nullptr;
 
+  // Caps queries come in bursts during representation switches, with the
+  // same caps on both sides.
+  GstCaps *transformedCaps = lookupCapsCache (self, direction, caps, filter);
+  if (transformedCaps) {
+    GST_LOG_OBJECT (base, "returning cached %" GST_PTR_FORMAT,
+        transformedCaps);
+    return transformedCaps;
+  }
+
   GST_DEBUG_OBJECT (base,
       "direction: %s, caps: %" GST_PTR_FORMAT " filter: %" GST_PTR_FORMAT,
       (direction == GST_PAD_SRC) ? "src" : "sink", caps, filter);
 
-  GstCaps *transformedCaps = gst_caps_new_empty ();
+  transformedCaps = gst_caps_new_empty ();
 
   unsigned size = gst_caps_get_size (caps);
   for (unsigned i = 0; i < size; ++i) {
@@ -405,17 +1046,73 @@ transformCaps (GstBaseTransform * base, GstPadDirection direction,
   }
 
   GST_DEBUG_OBJECT (base, "returning %" GST_PTR_FORMAT, transformedCaps);
+  insertCapsCache (self, direction, caps, filter, transformedCaps);
   return transformedCaps;
 }
 
-static GstFlowReturn
-transformInPlace (GstBaseTransform * base, GstBuffer * buffer)
+static gboolean
+sameMediaType (GstCaps * a, GstCaps * b)
+{
+  auto *first = gst_caps_get_structure (a, 0);
+  auto *second = gst_caps_get_structure (b, 0);
+
+  return gst_structure_has_name (first, gst_structure_get_name (second))
+      && !g_strcmp0 (gst_structure_get_string (first, "original-media-type"),
+      gst_structure_get_string (second, "original-media-type"));
+}
+
+static gboolean
+setCaps (GstBaseTransform * base, GstCaps * incaps,
+    G_GNUC_UNUSED GstCaps * outcaps)
 {
   auto *self = SPKL_DECRYPTOR (base);
+
+  if (self->inputCaps && gst_caps_is_strictly_equal (self->inputCaps, incaps))
+    return TRUE;
+
+  // Representation switches only change the codec parameters, the cached
+  // transforms remain useful then. Drop them when the media type changes,
+  // for instance on a new period.
+  if (!self->inputCaps || !sameMediaType (self->inputCaps, incaps))
+    clearCapsCache (self);
+
+  // Keep the input caps around, so that modules requiring them can be handed
+  // a SprklCapsMeta without querying the sink pad for every buffer.
+  GST_DEBUG_OBJECT (self, "Input caps: %" GST_PTR_FORMAT, incaps);
+  gst_caps_replace (&self->inputCaps, incaps);
+  return TRUE;
+}
+
+static gboolean
+sampleIsEncrypted (GstBuffer * buffer)
+{
+  /* *INDENT-OFF* */
+  auto *protectionMeta = reinterpret_cast<GstProtectionMeta*>(gst_buffer_get_protection_meta (buffer));
+  /* *INDENT-ON* */
+  if (!protectionMeta)
+    return FALSE;
+
+  unsigned ivSize;
+  gboolean encrypted;
+  // Malformed metas are reported by parseSample().
+  if (!gst_structure_id_get (protectionMeta->info, ivSizeQuark, G_TYPE_UINT,
+          &ivSize, encryptedQuark, G_TYPE_BOOLEAN, &encrypted, nullptr))
+    return TRUE;
+  return ivSize && encrypted;
+}
+
+// Parses the protection meta of a buffer. The protectionMeta field is left
+// unset for buffers that do not need decryption.
+static GstFlowReturn
+parseSample (SparkleDecryptor * self, GstBuffer * buffer,
+    SparkleSample * sample)
+{
   /* *INDENT-OFF* */
   auto *protectionMeta = reinterpret_cast<GstProtectionMeta*>(gst_buffer_get_protection_meta (buffer));
   /* *INDENT-ON* */
 
+  sample->protectionMeta = nullptr;
+
   if (!protectionMeta) {
     if (!self->clearBufferNotified) {
       GST_TRACE_OBJECT (self,
@@ -425,15 +1122,17 @@ transformInPlace (GstBaseTransform * base, GstBuffer * buffer)
     return GST_FLOW_OK;
   }
 
+  const GstStructure *info = protectionMeta->info;
   unsigned ivSize;
-  if (!gst_structure_get_uint (protectionMeta->info, "iv_size", &ivSize)) {
+  if (!gst_structure_id_get (info, ivSizeQuark, G_TYPE_UINT, &ivSize,
+          nullptr)) {
     GST_ERROR_OBJECT (self, "Failed to get iv_size");
     return GST_FLOW_NOT_SUPPORTED;
   }
 
   gboolean encrypted;
-  if (!gst_structure_get_boolean (protectionMeta->info, "encrypted",
-          &encrypted)) {
+  if (!gst_structure_id_get (info, encryptedQuark, G_TYPE_BOOLEAN, &encrypted,
+          nullptr)) {
     GST_ERROR_OBJECT (self, "Failed to get encrypted flag");
     return GST_FLOW_NOT_SUPPORTED;
   }
@@ -442,109 +1141,785 @@ transformInPlace (GstBaseTransform * base, GstBuffer * buffer)
     return GST_FLOW_OK;
   }
 
-  unsigned subSampleCount;
-  if (!gst_structure_get_uint (protectionMeta->info, "subsample_count",
-          &subSampleCount)) {
+  if (!gst_structure_id_get (info, subSampleCountQuark, G_TYPE_UINT,
+          &sample->subSampleCount, nullptr)) {
     GST_ERROR_OBJECT (self, "Failed to get subsample_count");
     return GST_FLOW_NOT_SUPPORTED;
   }
 
   const GValue *value;
-  GstBuffer *subSamplesBuffer = nullptr;
-  if (subSampleCount) {
-    value = gst_structure_get_value (protectionMeta->info, "subsamples");
+  sample->subSamples = nullptr;
+  if (sample->subSampleCount) {
+    value = gst_structure_id_get_value (info, subSamplesQuark);
     if (!value) {
       GST_ERROR_OBJECT (self, "Failed to get subsamples");
       return GST_FLOW_NOT_SUPPORTED;
     }
-    subSamplesBuffer = gst_value_get_buffer (value);
-    if (!subSamplesBuffer) {
+    sample->subSamples = gst_value_get_buffer (value);
+    if (!sample->subSamples) {
       GST_ERROR_OBJECT (self,
           "There is no subsamples buffer, but a positive subsample count");
       return GST_FLOW_NOT_SUPPORTED;
     }
   }
 
-  value = gst_structure_get_value (protectionMeta->info, "kid");
-  if (!value) {
+  value = gst_structure_id_get_value (info, kidQuark);
+  sample->keyID = value ? gst_value_get_buffer (value) : nullptr;
+  if (!sample->keyID) {
     GST_ERROR_OBJECT (self, "Failed to get key id for buffer");
     return GST_FLOW_NOT_SUPPORTED;
   }
-  GstBuffer *keyIDBuffer = gst_value_get_buffer (value);
 
-  value = gst_structure_get_value (protectionMeta->info, "iv");
+  value = gst_structure_id_get_value (info, ivQuark);
   if (!value) {
     GST_ERROR_OBJECT (self, "Failed to get IV for sample");
     return GST_FLOW_NOT_SUPPORTED;
   }
+  sample->iv = gst_value_get_buffer (value);
 
-  GstBuffer *ivBuffer = gst_value_get_buffer (value);
-  auto *sinkPad = GST_BASE_TRANSFORM_SINK_PAD (self);
-  GstCaps *inputCaps = gst_pad_get_current_caps (sinkPad);
-  auto *capsMeta = sprkl_gst_buffer_add_caps_meta (buffer, inputCaps);
+  sample->protectionMeta = protectionMeta;
+  return GST_FLOW_OK;
+}
 
-retry:
-  if (!self->provisioned) {
-    GMutexHolder lock (self->cdmAttachmentMutex);
-    auto endTime = g_get_monotonic_time () + 10 * G_TIME_SPAN_SECOND;
-    while (!self->provisioned) {
-      if (!g_cond_wait_until (&self->cdmAttachmentCondition,
-              &self->cdmAttachmentMutex, endTime)) {
-        GST_ERROR_OBJECT
-            (self, "CDM still not configured after 10 seconds of waiting");
-        return GST_FLOW_NOT_SUPPORTED;
-      }
-    }
+// Called after a decryption attempt failed with ERROR_INVALID_SESSION.
+static void
+switchSession (SparkleDecryptor * self, struct OpenCDMSession *expiredSession,
+    GstBuffer * keyIDBuffer)
+{
+  g_rw_lock_writer_lock (&self->sessionLock);
+  forgetKeySessions (self, expiredSession, nullptr, 0);
+  if (self->session != expiredSession) {
+    // Another decryption thread took care of it already.
+    g_rw_lock_writer_unlock (&self->sessionLock);
+    return;
   }
 
-  auto result = opencdm_gstreamer_session_decrypt (self->session, buffer,
-      subSamplesBuffer, subSampleCount, ivBuffer, keyIDBuffer, 0);
+  if (self->pending_session) {
+    GST_DEBUG_OBJECT (self, "Session expired. Switching to pending session");
+    promotePendingSession (self);
 
-  if (result == ERROR_INVALID_SESSION) {
-    if (self->pending_session) {
-      GST_DEBUG_OBJECT (self, "Session expired. Switching to pending session");
-      opencdm_destruct_session (self->session);
-      self->session = self->pending_session;
-      self->pending_session = nullptr;
-      {
-        GstMapInfo info GST_MAP_INFO_INIT;
-        gst_buffer_map (keyIDBuffer, &info, GST_MAP_READ);
-        self->provisioned = opencdm_session_status (self->session, info.data, info.size) == Usable;
-        gst_buffer_unmap (keyIDBuffer, &info);
-      }
-    } else {
-      GST_DEBUG_OBJECT (self, "Session expired, waiting for pending session");
-      renewSession (self);
-      self->provisioned = false;
-    }
-    goto retry;
+    GstMapInfo info GST_MAP_INFO_INIT;
+    gst_buffer_map (keyIDBuffer, &info, GST_MAP_READ);
+    gboolean usable =
+        opencdm_session_status (self->session, info.data, info.size) == Usable;
+    gst_buffer_unmap (keyIDBuffer, &info);
+    g_rw_lock_writer_unlock (&self->sessionLock);
+
+    GMutexHolder lock (self->cdmAttachmentMutex);
+    self->provisioned = usable;
+    return;
   }
+  g_rw_lock_writer_unlock (&self->sessionLock);
 
-  if (result != ERROR_NONE) {
-    auto *srcPad = GST_BASE_TRANSFORM_SRC_PAD (self);
-    g_autoptr (GstCaps) outputCaps = gst_pad_get_current_caps (srcPad);
-    auto *structure = gst_caps_get_structure (outputCaps, 0);
-    const char *mediaType = gst_structure_get_name (structure);
+  GST_DEBUG_OBJECT (self, "Session expired, waiting for pending session");
+  g_mutex_lock (&self->cdmAttachmentMutex);
+  self->provisioned = FALSE;
+  g_mutex_unlock (&self->cdmAttachmentMutex);
+  renewSession (self);
+}
+
+// Decrypts a parsed sample, this can be called from any thread. caps are
+// handed to modules requiring them, and must stay alive during the call.
+// Unless wait is set, it fails right away when the keys are not usable.
+static GstFlowReturn
+decryptParsedSample (SparkleDecryptor * self, GstBuffer * buffer,
+    SparkleSample * sample, GstCaps * caps, gboolean wait)
+{
+  SprklCapsMeta *capsMeta = nullptr;
+
+  renewSessionIfNeeded (self);
+
+retry:
+  if (!self->provisioned) {
+    GMutexHolder lock (self->cdmAttachmentMutex);
+    if (!wait && !self->provisioned && !self->flushing) {
+      GST_ERROR_OBJECT (self, "Keys not usable, not waiting for them");
+      return GST_FLOW_NOT_SUPPORTED;
+    }
+    auto endTime = g_get_monotonic_time () +
+        GST_TIME_AS_USECONDS (self->backlogTimeout);
+    auto ret = waitForProvisioning (self, endTime);
+    if (ret != GST_FLOW_OK)
+      return ret;
+  }
+
+  g_rw_lock_reader_lock (&self->sessionLock);
+  auto *session = lookupKeySession (self, sample->keyID);
+  if (!session) {
+    g_rw_lock_reader_unlock (&self->sessionLock);
+    session = resolveKeySession (self, sample->keyID);
+    if (!session)
+      goto retry;
+
+    g_rw_lock_reader_lock (&self->sessionLock);
+    if (session != self->session && session != self->pending_session) {
+      // Released in the meantime.
+      g_rw_lock_reader_unlock (&self->sessionLock);
+      goto retry;
+    }
+  }
+
+  if (!capsMeta && caps && sprkl_session_requires_caps (session))
+    capsMeta = sprkl_gst_buffer_add_caps_meta (buffer, gst_caps_ref (caps));
+
+  auto start = g_get_monotonic_time ();
+  auto result = opencdm_gstreamer_session_decrypt (session, buffer,
+      sample->subSamples, sample->subSampleCount, sample->iv, sample->keyID,
+      0);
+  auto duration = g_get_monotonic_time () - start;
+  g_rw_lock_reader_unlock (&self->sessionLock);
+
+  if (result == ERROR_INVALID_SESSION) {
+    switchSession (self, session, sample->keyID);
+    goto retry;
+  }
+
+  if (result != ERROR_NONE) {
+    auto *srcPad = GST_BASE_TRANSFORM_SRC_PAD (self);
+    g_autoptr (GstCaps) outputCaps = gst_pad_get_current_caps (srcPad);
+    auto *structure = gst_caps_get_structure (outputCaps, 0);
+    const char *mediaType = gst_structure_get_name (structure);
 
     /* *INDENT-OFF* */
-    gst_buffer_remove_meta (buffer, reinterpret_cast<GstMeta*>(capsMeta));
+    if (capsMeta)
+      gst_buffer_remove_meta (buffer, reinterpret_cast<GstMeta*>(capsMeta));
     /* *INDENT-ON* */
 
     GST_WARNING_OBJECT (self,
         "Decryption failed for %s (caps: %" GST_PTR_FORMAT ")",
-        mediaType, inputCaps);
+        mediaType, caps);
     GST_ERROR_OBJECT (self, "Decryption failed");
+    recordFailure (self);
     return GST_FLOW_NOT_SUPPORTED;
   }
 
+  recordDecryption (self, 1, gst_buffer_get_size (buffer), duration);
+
   /* *INDENT-OFF* */
-  gst_buffer_remove_meta (buffer, reinterpret_cast<GstMeta*>(protectionMeta));
-  gst_buffer_remove_meta (buffer, reinterpret_cast<GstMeta*>(capsMeta));
+  gst_buffer_remove_meta (buffer, reinterpret_cast<GstMeta*>(sample->protectionMeta));
+  if (capsMeta)
+    gst_buffer_remove_meta (buffer, reinterpret_cast<GstMeta*>(capsMeta));
   /* *INDENT-ON* */
 
   return GST_FLOW_OK;
 }
 
+// Sample of lazy memories, decrypted on first map. The input caps are those
+// of the sample, the element ones might have changed in the meantime.
+struct SparkleLazySample
+{
+  SparkleDecryptor *decryptor;
+  SparkleSample sample;
+  GstCaps *caps;
+};
+
+static gboolean
+decryptLazySample (GstBuffer * encrypted, gpointer userData)
+{
+  /* *INDENT-OFF* */
+  auto *lazySample = static_cast<SparkleLazySample*>(userData);
+  /* *INDENT-ON* */
+  // Mapping happens on the consumer thread, which must not be held until the
+  // keys become usable.
+  auto ret = decryptParsedSample (lazySample->decryptor, encrypted,
+      &lazySample->sample, lazySample->caps, FALSE);
+  if (ret != GST_FLOW_OK)
+    GST_ERROR_OBJECT (lazySample->decryptor, "Lazy decryption failed: %s",
+        gst_flow_get_name (ret));
+  return ret == GST_FLOW_OK;
+}
+
+static void
+freeLazySample (gpointer userData)
+{
+  /* *INDENT-OFF* */
+  auto *lazySample = static_cast<SparkleLazySample*>(userData);
+  /* *INDENT-ON* */
+  gst_object_unref (lazySample->decryptor);
+  gst_clear_caps (&lazySample->caps);
+  g_free (lazySample);
+}
+
+// Moves the ciphertext and its protection info to memories decrypting them
+// when first mapped, typically by the decoder on its own thread.
+static void
+deferDecryption (SparkleDecryptor * self, GstBuffer * buffer,
+    SparkleSample * sample)
+{
+  auto *encrypted = gst_buffer_new ();
+  gst_buffer_copy_into (encrypted, buffer, GST_BUFFER_COPY_MEMORY, 0, -1);
+
+  // The copied info holds references to the subsamples, key ID and IV.
+  auto *lazySample = g_new0 (SparkleLazySample, 1);
+  lazySample->decryptor = SPKL_DECRYPTOR (gst_object_ref (self));
+  lazySample->sample = *sample;
+  if (self->inputCaps)
+    lazySample->caps = gst_caps_ref (self->inputCaps);
+  /* *INDENT-OFF* */
+  lazySample->sample.protectionMeta = reinterpret_cast<GstProtectionMeta*>(gst_buffer_add_protection_meta (encrypted, gst_structure_copy (sample->protectionMeta->info)));
+  gst_buffer_remove_meta (buffer, reinterpret_cast<GstMeta*>(sample->protectionMeta));
+  /* *INDENT-ON* */
+
+  gst_buffer_remove_all_memory (buffer);
+  spkl_lazy_memory_append (buffer, encrypted, decryptLazySample, lazySample,
+      freeLazySample);
+}
+
+static GstFlowReturn
+decryptSample (SparkleDecryptor * self, GstBuffer * buffer)
+{
+  SparkleSample sample;
+
+  auto ret = parseSample (self, buffer, &sample);
+  if (ret != GST_FLOW_OK || !sample.protectionMeta)
+    return ret;
+
+  // Until the keys are usable, samples are decrypted here, where waiting for
+  // them does not hold downstream threads.
+  if (self->lazy && self->provisioned) {
+    deferDecryption (self, buffer, &sample);
+    return GST_FLOW_OK;
+  }
+  return decryptParsedSample (self, buffer, &sample, self->inputCaps, TRUE);
+}
+
+static gboolean
+filterListBuffer (GstBuffer ** buffer, G_GNUC_UNUSED guint index,
+    gpointer userData)
+{
+  auto *self = SPKL_DECRYPTOR (userData);
+  if (!sampleIsEncrypted (*buffer))
+    return TRUE;
+
+  if (self->capture)
+    recordSample (self, *buffer);
+  if (shouldDrop (self, *buffer))
+    gst_clear_buffer (buffer);
+  return TRUE;
+}
+
+// Records the samples of a buffer list, in order, and removes the ones
+// downstream would discard, as submitInputBuffer() does for single buffers,
+// so that they are not decrypted.
+static void
+filterList (SparkleDecryptor * self, GstBufferList * list)
+{
+  gst_buffer_list_foreach (list, filterListBuffer, self);
+}
+
+// Decrypts the encrypted samples of a buffer list with a single call to the
+// CDM. Samples that cannot be handled this way are left untouched for the
+// per-buffer path, which takes care of waiting for keys, switching sessions
+// and reporting errors.
+static void
+decryptList (SparkleDecryptor * self, GstBufferList * list)
+{
+  {
+    GMutexHolder lock (self->cdmAttachmentMutex);
+    if (!self->provisioned || self->flushing
+        || !g_queue_is_empty (&self->backlog))
+      return;
+  }
+
+  // Samples handed to the thread pool are decrypted there, lazy samples by
+  // their consumer.
+  if (self->workerPool || self->lazy)
+    return;
+
+  g_autoptr (GArray) samples =
+      g_array_new (FALSE, FALSE, sizeof (SparkleCDMSample));
+  g_autoptr (GPtrArray) protectionMetas = g_ptr_array_new ();
+  guint length = gst_buffer_list_length (list);
+  for (guint i = 0; i < length; i++) {
+    if (!sampleIsEncrypted (gst_buffer_list_get (list, i)))
+      continue;
+
+    auto *buffer = gst_buffer_list_get_writable (list, i);
+    SparkleSample sample;
+    if (parseSample (self, buffer, &sample) != GST_FLOW_OK)
+      break;
+
+    SparkleCDMSample cdmSample = { buffer, sample.subSamples,
+      sample.subSampleCount, sample.iv, sample.keyID
+    };
+    g_array_append_val (samples, cdmSample);
+    g_ptr_array_add (protectionMetas, sample.protectionMeta);
+  }
+
+  if (!samples->len)
+    return;
+
+  renewSessionIfNeeded (self);
+
+  uint32_t decrypted = 0;
+  OpenCDMError result = ERROR_NONE;
+  auto start = g_get_monotonic_time ();
+  g_rw_lock_reader_lock (&self->sessionLock);
+  // Only the leading samples whose keys are held by the same session are
+  // batched, the others go through the per-buffer path.
+  auto *session = lookupKeySession (self,
+      g_array_index (samples, SparkleCDMSample, 0).keyID);
+  guint count = session ? 1 : 0;
+  for (; count && count < samples->len; count++) {
+    auto *keyID = g_array_index (samples, SparkleCDMSample, count).keyID;
+    if (keyID != g_array_index (samples, SparkleCDMSample, count - 1).keyID
+        && lookupKeySession (self, keyID) != session)
+      break;
+  }
+
+  // Modules inspecting the caps go through the per-buffer path.
+  if (count && !sprkl_session_requires_caps (session)) {
+    /* *INDENT-OFF* */
+    result = sprkl_session_decrypt_list (session, reinterpret_cast<const SparkleCDMSample*>(samples->data), count, &decrypted);
+    /* *INDENT-ON* */
+  }
+  g_rw_lock_reader_unlock (&self->sessionLock);
+  auto duration = g_get_monotonic_time () - start;
+
+  GST_LOG_OBJECT (self, "Decrypted %u of %u samples in list", decrypted,
+      samples->len);
+  if (result != ERROR_NONE)
+    GST_DEBUG_OBJECT (self, "List decryption stopped with error %d", result);
+
+  gsize bytes = 0;
+  for (guint i = 0; i < decrypted; i++) {
+    auto *buffer = g_array_index (samples, SparkleCDMSample, i).buffer;
+    bytes += gst_buffer_get_size (buffer);
+    /* *INDENT-OFF* */
+    gst_buffer_remove_meta (buffer, static_cast<GstMeta*>(g_ptr_array_index (protectionMetas, i)));
+    /* *INDENT-ON* */
+  }
+  if (decrypted)
+    recordDecryption (self, decrypted, bytes, duration);
+}
+
+struct SparkleChainData
+{
+  GstPad *pad;
+  GstObject *parent;
+  GstPadChainFunction chain;
+  GstFlowReturn ret;
+};
+
+static gboolean
+chainListBuffer (GstBuffer ** buffer, G_GNUC_UNUSED guint index,
+    gpointer userData)
+{
+  /* *INDENT-OFF* */
+  auto *data = static_cast<SparkleChainData*>(userData);
+  /* *INDENT-ON* */
+
+  // Hand over the buffer, so that it stays writable.
+  auto *input = *buffer;
+  *buffer = nullptr;
+  data->ret = data->chain (data->pad, data->parent, input);
+  return data->ret == GST_FLOW_OK;
+}
+
+// Fragments pushed as buffer lists are decrypted in a single CDM call, the
+// buffers then go through the regular chain function, in passthrough mode
+// unless something was left to decrypt.
+static GstFlowReturn
+chainList (GstPad * pad, GstObject * parent, GstBufferList * list)
+{
+  auto *self = SPKL_DECRYPTOR (parent);
+
+  list = gst_buffer_list_make_writable (list);
+  filterList (self, list);
+  decryptList (self, list);
+
+  SparkleChainData data = { pad, parent, GST_PAD_CHAINFUNC (pad),
+    GST_FLOW_OK
+  };
+  self->listFiltered = TRUE;
+  gst_buffer_list_foreach (list, chainListBuffer, &data);
+  self->listFiltered = FALSE;
+  gst_buffer_list_unref (list);
+  return data.ret;
+}
+
+static void
+clearBacklog (SparkleDecryptor * self)
+{
+  GMutexHolder lock (self->cdmAttachmentMutex);
+  if (!g_queue_is_empty (&self->backlog))
+    GST_DEBUG_OBJECT (self, "Dropping %u parked buffers",
+        g_queue_get_length (&self->backlog));
+  g_queue_clear_full (&self->backlog, (GDestroyNotify) gst_buffer_unref);
+}
+
+// Pushes the parked buffers downstream, must be called with the sink pad
+// stream lock held.
+static GstFlowReturn
+drainBacklog (SparkleDecryptor * self)
+{
+  auto *srcPad = GST_BASE_TRANSFORM_SRC_PAD (self);
+
+  // Buffers still being decrypted by the thread pool came first.
+  GstFlowReturn ret = finishJobs (self);
+
+  g_mutex_lock (&self->cdmAttachmentMutex);
+  while (ret == GST_FLOW_OK) {
+    /* *INDENT-OFF* */
+    auto *buffer = static_cast<GstBuffer*>(g_queue_pop_head (&self->backlog));
+    /* *INDENT-ON* */
+    if (!buffer)
+      break;
+    g_mutex_unlock (&self->cdmAttachmentMutex);
+
+    if (sampleIsEncrypted (buffer))
+      buffer = gst_buffer_make_writable (buffer);
+    ret = decryptSample (self, buffer);
+    if (ret == GST_FLOW_OK)
+      ret = gst_pad_push (srcPad, buffer);
+    else
+      gst_buffer_unref (buffer);
+
+    g_mutex_lock (&self->cdmAttachmentMutex);
+  }
+  g_mutex_unlock (&self->cdmAttachmentMutex);
+
+  if (ret != GST_FLOW_OK)
+    clearBacklog (self);
+  return ret;
+}
+
+// Waits for the license if needed and pushes the parked buffers, so that
+// serialized events are not reordered with them.
+static GstFlowReturn
+finishBacklog (SparkleDecryptor * self)
+{
+  GstFlowReturn ret;
+  {
+    GMutexHolder lock (self->cdmAttachmentMutex);
+    if (g_queue_is_empty (&self->backlog))
+      return GST_FLOW_OK;
+    ret = waitForProvisioning (self, self->backlogStart +
+        GST_TIME_AS_USECONDS (self->backlogTimeout));
+  }
+
+  if (ret != GST_FLOW_OK) {
+    clearBacklog (self);
+    return ret;
+  }
+  return drainBacklog (self);
+}
+
+static void
+postQoS (SparkleDecryptor * self, GstBuffer * buffer, GstClockTime runningTime)
+{
+  auto *segment = &GST_BASE_TRANSFORM (self)->segment;
+  guint64 processed, dropped;
+  {
+    GMutexHolder lock (self->statsMutex);
+    processed = self->stats.buffers;
+    dropped = self->stats.dropped;
+  }
+
+  auto *message = gst_message_new_qos (GST_OBJECT_CAST (self), FALSE,
+      runningTime, gst_segment_to_stream_time (segment, GST_FORMAT_TIME,
+          GST_BUFFER_PTS (buffer)), GST_BUFFER_PTS (buffer),
+      GST_BUFFER_DURATION (buffer));
+  gst_message_set_qos_stats (message, GST_FORMAT_BUFFERS, processed, dropped);
+  gst_element_post_message (GST_ELEMENT_CAST (self), message);
+}
+
+// Whether downstream is bound to discard the buffer, in which case it is not
+// worth decrypting it. Only non-reference buffers qualify, the buffers others
+// depend on must be decrypted even when they are not displayed.
+static gboolean
+shouldDrop (SparkleDecryptor * self, GstBuffer * buffer)
+{
+  if (!sampleIsEncrypted (buffer))
+    return FALSE;
+
+  // Only key units are decoded in key unit trick modes.
+  auto *segment = &GST_BASE_TRANSFORM (self)->segment;
+  if (segment->flags & GST_SEGMENT_FLAG_TRICKMODE_KEY_UNITS
+      && GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    GST_LOG_OBJECT (self, "Dropping delta unit %p in key unit trick mode",
+        buffer);
+    recordDrop (self);
+    return TRUE;
+  }
+
+  auto timestamp = GST_BUFFER_PTS (buffer);
+  if (segment->format != GST_FORMAT_TIME
+      || !GST_CLOCK_TIME_IS_VALID (timestamp)
+      || !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DROPPABLE))
+    return FALSE;
+
+  auto end = timestamp;
+  if (GST_BUFFER_DURATION_IS_VALID (buffer))
+    end += GST_BUFFER_DURATION (buffer);
+  if (!gst_segment_clip (segment, GST_FORMAT_TIME, timestamp, end, nullptr,
+          nullptr)) {
+    GST_LOG_OBJECT (self, "Dropping buffer %p outside of the segment", buffer);
+    recordDrop (self);
+    return TRUE;
+  }
+
+  GST_OBJECT_LOCK (self);
+  auto earliestTime = self->earliestTime;
+  GST_OBJECT_UNLOCK (self);
+
+  auto runningTime =
+      gst_segment_to_running_time (segment, GST_FORMAT_TIME, end);
+  if (!GST_CLOCK_TIME_IS_VALID (earliestTime)
+      || !GST_CLOCK_TIME_IS_VALID (runningTime) || runningTime > earliestTime)
+    return FALSE;
+
+  GST_LOG_OBJECT (self, "Dropping late buffer %p, running time %"
+      GST_TIME_FORMAT " earlier than %" GST_TIME_FORMAT, buffer,
+      GST_TIME_ARGS (runningTime), GST_TIME_ARGS (earliestTime));
+  recordDrop (self);
+  postQoS (self, buffer, runningTime);
+  return TRUE;
+}
+
+// Samples are recorded as received, including those dropped afterwards.
+static void
+recordSample (SparkleDecryptor * self, GstBuffer * buffer)
+{
+  if (!sampleIsEncrypted (buffer))
+    return;
+
+  SparkleSample sample;
+  if (parseSample (self, buffer, &sample) != GST_FLOW_OK
+      || !sample.protectionMeta)
+    return;
+
+  spkl_capture_add_sample (self->capture, buffer, sample.keyID, sample.iv,
+      sample.subSamples, sample.subSampleCount);
+}
+
+static GstFlowReturn
+submitInputBuffer (GstBaseTransform * base, gboolean isDiscont,
+    GstBuffer * input)
+{
+  auto *self = SPKL_DECRYPTOR (base);
+
+  auto ret =
+      GST_BASE_TRANSFORM_CLASS (parent_class)->submit_input_buffer (base,
+      isDiscont, input);
+  if (ret != GST_FLOW_OK || !base->queued_buf)
+    return ret;
+
+  // Buffers of lists were filtered by chainList() already.
+  if (self->capture && !self->listFiltered)
+    recordSample (self, base->queued_buf);
+
+  if (!self->listFiltered && shouldDrop (self, base->queued_buf)) {
+    gst_clear_buffer (&base->queued_buf);
+    return GST_FLOW_OK;
+  }
+
+  postStatsIfNeeded (self);
+
+  GST_OBJECT_LOCK (self);
+  guint maxBacklogSize = self->maxBacklogSize;
+  GST_OBJECT_UNLOCK (self);
+
+  g_mutex_lock (&self->cdmAttachmentMutex);
+  if (!self->provisioned && (!g_queue_is_empty (&self->backlog)
+          || sampleIsEncrypted (base->queued_buf))) {
+    auto now = g_get_monotonic_time ();
+    auto timeout = GST_TIME_AS_USECONDS (self->backlogTimeout);
+
+    if (g_queue_is_empty (&self->backlog))
+      self->backlogStart = now;
+
+    if (now - self->backlogStart > timeout) {
+      g_mutex_unlock (&self->cdmAttachmentMutex);
+      GST_ERROR_OBJECT (self, "CDM still not configured after %"
+          GST_TIME_FORMAT " of waiting", GST_TIME_ARGS (self->backlogTimeout));
+      clearBacklog (self);
+      return GST_FLOW_NOT_SUPPORTED;
+    }
+
+    if (g_queue_get_length (&self->backlog) < maxBacklogSize) {
+      // Keep the buffer aside and let upstream carry on while the license is
+      // being acquired.
+      GST_LOG_OBJECT (self, "Keys pending, parking buffer %p", base->queued_buf);
+      g_queue_push_tail (&self->backlog, g_steal_pointer (&base->queued_buf));
+      g_mutex_unlock (&self->cdmAttachmentMutex);
+      return GST_FLOW_OK;
+    }
+
+    GST_DEBUG_OBJECT (self, "Backlog full, waiting for the license");
+    ret = waitForProvisioning (self, self->backlogStart + timeout);
+  }
+  gboolean parked = !g_queue_is_empty (&self->backlog);
+  g_mutex_unlock (&self->cdmAttachmentMutex);
+
+  if (ret == GST_FLOW_OK && parked)
+    ret = drainBacklog (self);
+
+  if (ret != GST_FLOW_OK) {
+    clearBacklog (self);
+    gst_clear_buffer (&base->queued_buf);
+  }
+  return ret;
+}
+
+static void
+decryptJob (gpointer data, gpointer userData)
+{
+  /* *INDENT-OFF* */
+  auto *job = static_cast<SparkleDecryptJob*>(data);
+  /* *INDENT-ON* */
+  auto *self = SPKL_DECRYPTOR (userData);
+
+  g_mutex_lock (&self->cdmAttachmentMutex);
+  gboolean flushing = self->flushing;
+  g_mutex_unlock (&self->cdmAttachmentMutex);
+
+  // Jobs are finished before caps events, so the input caps cannot change
+  // under this one.
+  auto ret = flushing ? GST_FLOW_FLUSHING :
+      decryptParsedSample (self, job->buffer, &job->sample, self->inputCaps,
+      TRUE);
+
+  GMutexHolder lock (self->workerMutex);
+  job->ret = ret;
+  job->done = TRUE;
+  g_cond_broadcast (&self->workerCondition);
+}
+
+static void
+freeJob (SparkleDecryptJob * job)
+{
+  gst_clear_buffer (&job->buffer);
+  g_free (job);
+}
+
+static SparkleDecryptJob *
+peekJob (SparkleDecryptor * self)
+{
+  /* *INDENT-OFF* */
+  return static_cast<SparkleDecryptJob*>(g_queue_peek_head (&self->jobs));
+  /* *INDENT-ON* */
+}
+
+// Takes the job at the head of the queue once it is done. With wait unset,
+// only blocks when the maximum number of buffers in flight is exceeded.
+static GstFlowReturn
+popJob (SparkleDecryptor * self, GstBuffer ** outbuf, gboolean wait)
+{
+  GMutexHolder lock (self->workerMutex);
+  guint maxInFlight = 2 * self->nThreads;
+
+  *outbuf = nullptr;
+  auto *job = peekJob (self);
+  while (job && !job->done && (wait
+          || g_queue_get_length (&self->jobs) > maxInFlight)) {
+    g_cond_wait (&self->workerCondition, &self->workerMutex);
+    job = peekJob (self);
+  }
+
+  if (!job || !job->done)
+    return GST_FLOW_OK;
+
+  g_queue_pop_head (&self->jobs);
+  auto ret = job->ret;
+  if (ret == GST_FLOW_OK) {
+    *outbuf = job->buffer;
+    job->buffer = nullptr;
+  }
+  freeJob (job);
+  return ret;
+}
+
+// Waits for the jobs in flight and drops them.
+static void
+discardJobs (SparkleDecryptor * self)
+{
+  GMutexHolder lock (self->workerMutex);
+
+  while (!g_queue_is_empty (&self->jobs)) {
+    auto *job = peekJob (self);
+    if (!job->done) {
+      g_cond_wait (&self->workerCondition, &self->workerMutex);
+      continue;
+    }
+    g_queue_pop_head (&self->jobs);
+    freeJob (job);
+  }
+}
+
+// Pushes all the buffers handed to the thread pool downstream, must be called
+// with the sink pad stream lock held.
+static GstFlowReturn
+finishJobs (SparkleDecryptor * self)
+{
+  auto *srcPad = GST_BASE_TRANSFORM_SRC_PAD (self);
+  GstFlowReturn ret = GST_FLOW_OK;
+
+  if (!self->workerPool)
+    return GST_FLOW_OK;
+
+  while (ret == GST_FLOW_OK) {
+    GstBuffer *outbuf;
+    ret = popJob (self, &outbuf, TRUE);
+    if (!outbuf)
+      break;
+    ret = gst_pad_push (srcPad, outbuf);
+  }
+
+  if (ret != GST_FLOW_OK)
+    discardJobs (self);
+  return ret;
+}
+
+static GstFlowReturn
+generateOutput (GstBaseTransform * base, GstBuffer ** outbuf)
+{
+  auto *self = SPKL_DECRYPTOR (base);
+
+  if (!self->workerPool)
+    return GST_BASE_TRANSFORM_CLASS (parent_class)->generate_output (base,
+        outbuf);
+
+  if (base->queued_buf) {
+    auto *job = g_new0 (SparkleDecryptJob, 1);
+    job->buffer = g_steal_pointer (&base->queued_buf);
+    if (sampleIsEncrypted (job->buffer))
+      job->buffer = gst_buffer_make_writable (job->buffer);
+    job->ret = parseSample (self, job->buffer, &job->sample);
+    job->done = job->ret != GST_FLOW_OK || !job->sample.protectionMeta;
+
+    g_mutex_lock (&self->workerMutex);
+    g_queue_push_tail (&self->jobs, job);
+    g_mutex_unlock (&self->workerMutex);
+
+    if (!job->done)
+      g_thread_pool_push (self->workerPool, job, nullptr);
+  }
+
+  return popJob (self, outbuf, FALSE);
+}
+
+// Clear buffers are forwarded as-is, without the base class making them
+// writable, until the next protected buffer.
+static void
+beforeTransform (GstBaseTransform * base, GstBuffer * buffer)
+{
+  gboolean passthrough = !sampleIsEncrypted (buffer);
+
+  if (passthrough == gst_base_transform_is_passthrough (base))
+    return;
+
+  GST_DEBUG_OBJECT (base, "Switching to %s mode",
+      passthrough ? "passthrough" : "decryption");
+  gst_base_transform_set_passthrough (base, passthrough);
+}
+
+static GstFlowReturn
+transformInPlace (GstBaseTransform * base, GstBuffer * buffer)
+{
+  return decryptSample (SPKL_DECRYPTOR (base), buffer);
+}
+
 static const gchar *
 systemIdHumanReadable (const gchar * uuid)
 {
@@ -558,6 +1933,84 @@ systemIdHumanReadable (const gchar * uuid)
   return nullptr;
 }
 
+// Requests a license for all the keys announced so far, unless the current
+// session already covers them. The current session is kept until the keys of
+// the new one are usable.
+static gboolean
+requestKeys (SparkleDecryptor * self, const gchar * keySystem)
+{
+  const gchar *initDataType;
+  g_autoptr (GBytes) initData =
+      sessionInitData (self, keySystem, &initDataType);
+
+  if (self->initData && g_bytes_equal (self->initData, initData)
+      && !g_strcmp0 (self->keySystem, keySystem)) {
+    GST_DEBUG_OBJECT (self, "License already requested for these keys");
+    return TRUE;
+  }
+
+  auto *system = spkl_session_broker_acquire_system (keySystem);
+  if (!system)
+    return FALSE;
+
+  gsize initDataSize;
+  auto *data = g_bytes_get_data (initData, &initDataSize);
+  auto *session = spkl_session_broker_acquire (system, Temporary,
+      initDataType, (const guint8 *) data, initDataSize,
+      GST_ELEMENT_CAST (self), &self->sessionCallbacks, spklProcessChallenge);
+  GST_DEBUG_OBJECT (self, "Session: %p", session);
+  if (!session) {
+    spkl_session_broker_release_system (system);
+    return FALSE;
+  }
+
+  if (self->capture) {
+    spkl_capture_add_key_system (self->capture, keySystem);
+    spkl_capture_add_init_data (self->capture, initDataType, initData);
+  }
+
+  auto *previousSystem = self->system;
+  self->system = system;
+  self->keySystem = keySystem;
+  g_clear_pointer (&self->initData, g_bytes_unref);
+  self->initData = g_bytes_ref (initData);
+
+  struct OpenCDMSession *previousSession = nullptr;
+  struct OpenCDMSession *previousPendingSession = nullptr;
+  g_rw_lock_writer_lock (&self->sessionLock);
+  if (self->session && system == previousSystem) {
+    // The current session keeps decrypting the samples of the keys it holds,
+    // the new session takes over the others as soon as its keys are usable.
+    GST_DEBUG_OBJECT (self, "New keys announced, requesting a new license");
+    previousPendingSession = self->pending_session;
+    self->pending_session = session;
+    self->pendingSessionReady = FALSE;
+  } else {
+    previousSession = self->session;
+    previousPendingSession = self->pending_session;
+    self->session = session;
+    self->pending_session = nullptr;
+    self->pendingSessionReady = FALSE;
+  }
+  if (previousSession)
+    forgetKeySessions (self, previousSession, nullptr, 0);
+  if (previousPendingSession)
+    forgetKeySessions (self, previousPendingSession, nullptr, 0);
+  g_rw_lock_writer_unlock (&self->sessionLock);
+
+  if (previousSession)
+    spkl_session_broker_release (previousSession, GST_ELEMENT_CAST (self));
+  if (previousPendingSession)
+    spkl_session_broker_release (previousPendingSession,
+        GST_ELEMENT_CAST (self));
+  if (previousSystem)
+    spkl_session_broker_release_system (previousSystem);
+
+  if (spkl_session_broker_keys_ready (session))
+    spklKeysUpdated (session, self);
+  return TRUE;
+}
+
 static gboolean
 sinkEventHandler (GstBaseTransform * trans, GstEvent * event)
 {
@@ -575,6 +2028,9 @@ sinkEventHandler (GstBaseTransform * trans, GstEvent * event)
       GST_DEBUG_OBJECT (self, "Got protection event %" GST_PTR_FORMAT, event);
       gst_event_parse_protection (event, &systemUUID, &protectionData, &origin);
       systemId = systemIdHumanReadable (systemUUID);
+      if (self->capture)
+        spkl_capture_add_protection (self->capture, systemUUID, origin,
+            protectionData);
 
       if (g_str_equal (systemUUID, "dash:mp4protection:2011")) {
         g_autoptr (GError) error = NULL;
@@ -587,6 +2043,10 @@ sinkEventHandler (GstBaseTransform * trans, GstEvent * event)
           break;
         }
         gst_buffer_unmap (protectionData, &info);
+
+        // Representations or periods might use keys not covered yet.
+        if (self->keySystem)
+          requestKeys (self, self->keySystem);
       }
 
       if (g_str_equal (origin, "dash/mpd") && systemId) {
@@ -613,23 +2073,9 @@ sinkEventHandler (GstBaseTransform * trans, GstEvent * event)
         }
         gst_buffer_unmap (protectionData, &info);
 
-        self->system = opencdm_create_system (systemId);
-        gsize initDataSize;
-        gconstpointer initData;
-        const gchar *initDataType = "cenc";
-        if (self->pssh)
-          initData = g_bytes_get_data (self->pssh, &initDataSize);
-        else {
-          initData = self->kid;
-          initDataSize = strlen (self->kid);
-          initDataType = "keyids";
-        }
-
-        opencdm_construct_session (self->system, Temporary, initDataType,
-            (const uint8_t *) initData, initDataSize, nullptr, 0,
-            &self->sessionCallbacks, self, &self->session);
-        GST_DEBUG_OBJECT (self, "Session: %p", self->session);
-        if (self->session) {
+        // Decryptors of other tracks and periods using the same keys share
+        // the session, and its license.
+        if (requestKeys (self, systemId)) {
           forward = FALSE;
           result = TRUE;
           gst_event_unref (event);
@@ -644,32 +2090,115 @@ sinkEventHandler (GstBaseTransform * trans, GstEvent * event)
       if (gst_event_has_name (event, "spkl-session-update")) {
         GST_DEBUG_OBJECT (self, "Updating session");
         const auto *structure = gst_event_get_structure (event);
-        GstBuffer *message;
+        g_autoptr (GstBuffer) message = nullptr;
         gst_structure_get (structure, "message", GST_TYPE_BUFFER, &message,
             nullptr);
-        GstMapInfo info GST_MAP_INFO_INIT;
-        gst_buffer_map (message, &info, GST_MAP_READ);
-        struct OpenCDMSession *session =
-            self->pending_session ? self->pending_session : self->session;
-        auto success = opencdm_session_update (session, info.data, info.size);
-        gst_buffer_unmap (message, &info);
+        const gchar *sessionId =
+            gst_structure_get_string (structure, "session-id");
+
+        // The session is referenced so that it cannot be destroyed during
+        // the update, even if requestKeys() replaces it meanwhile. Licenses
+        // not tagged with the session-id of their challenge are meant for the
+        // latest one.
+        struct OpenCDMSession *session = nullptr;
+        if (sessionId) {
+          session = spkl_session_broker_lookup (sessionId);
+        } else {
+          g_rw_lock_reader_lock (&self->sessionLock);
+          session =
+              self->pending_session ? self->pending_session : self->session;
+          if (session && !spkl_session_broker_ref (session))
+            session = nullptr;
+          g_rw_lock_reader_unlock (&self->sessionLock);
+        }
+
+        auto success = ERROR_INVALID_SESSION;
+        if (session && message) {
+          GstMapInfo info GST_MAP_INFO_INIT;
+          gst_buffer_map (message, &info, GST_MAP_READ);
+          success = opencdm_session_update (session, info.data, info.size);
+          gst_buffer_unmap (message, &info);
+        }
+        if (session)
+          spkl_session_broker_unref (session);
+        else
+          GST_WARNING_OBJECT (self, "No session %s to update",
+              GST_STR_NULL (sessionId));
+        if (success == ERROR_NONE && self->capture
+            && !g_strcmp0 (self->keySystem, "org.w3.clearkey"))
+          spkl_capture_add_license (self->capture, message);
         if (success == ERROR_NONE) {
           forward = FALSE;
           result = TRUE;
           gst_event_unref (event);
         }
-        break;
       }
+      break;
     }
+    case GST_EVENT_FLUSH_START:
+      g_mutex_lock (&self->cdmAttachmentMutex);
+      self->flushing = TRUE;
+      g_cond_broadcast (&self->cdmAttachmentCondition);
+      g_mutex_unlock (&self->cdmAttachmentMutex);
+      clearBacklog (self);
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      GST_OBJECT_LOCK (self);
+      self->earliestTime = GST_CLOCK_TIME_NONE;
+      GST_OBJECT_UNLOCK (self);
+      discardJobs (self);
+      g_mutex_lock (&self->cdmAttachmentMutex);
+      self->flushing = FALSE;
+      g_mutex_unlock (&self->cdmAttachmentMutex);
+      clearBacklog (self);
+      break;
     default:
       break;
   }
 
+  // Serialized events must not overtake buffers that are parked or being
+  // decrypted.
+  if (forward && GST_EVENT_IS_SERIALIZED (event)
+      && GST_EVENT_TYPE (event) != GST_EVENT_FLUSH_STOP
+      && GST_EVENT_TYPE (event) != GST_EVENT_PROTECTION) {
+    auto ret = finishJobs (self);
+    if (ret == GST_FLOW_OK)
+      ret = finishBacklog (self);
+    if (ret != GST_FLOW_OK && ret != GST_FLOW_FLUSHING)
+      GST_ELEMENT_ERROR (self, STREAM, DECRYPT_NOKEY, (nullptr),
+          ("Unable to decrypt pending buffers: %s", gst_flow_get_name (ret)));
+  }
+
   if (forward)
     result = GST_BASE_TRANSFORM_CLASS (parent_class)->sink_event (trans, event);
   return result;
 }
 
+static gboolean
+srcEventHandler (GstBaseTransform * trans, GstEvent * event)
+{
+  auto *self = SPKL_DECRYPTOR (trans);
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_QOS) {
+    GstQOSType type;
+    gdouble proportion;
+    GstClockTimeDiff diff;
+    GstClockTime timestamp;
+    gst_event_parse_qos (event, &type, &proportion, &diff, &timestamp);
+
+    GST_OBJECT_LOCK (self);
+    if (type != GST_QOS_TYPE_THROTTLE && diff > 0
+        && (GstClockTime) diff > self->qosDropThreshold
+        && GST_CLOCK_TIME_IS_VALID (timestamp))
+      self->earliestTime = timestamp + diff;
+    else
+      self->earliestTime = GST_CLOCK_TIME_NONE;
+    GST_OBJECT_UNLOCK (self);
+  }
+
+  return GST_BASE_TRANSFORM_CLASS (parent_class)->src_event (trans, event);
+}
+
 static GstStateChangeReturn
 changeState (GstElement * element, GstStateChange transition)
 {
@@ -678,32 +2207,100 @@ changeState (GstElement * element, GstStateChange transition)
   GST_DEBUG_OBJECT (self, "%s", gst_state_change_get_name (transition));
 
   switch (transition) {
+    case GST_STATE_CHANGE_READY_TO_PAUSED:
+      g_mutex_lock (&self->cdmAttachmentMutex);
+      self->flushing = FALSE;
+      g_mutex_unlock (&self->cdmAttachmentMutex);
+
+      GST_OBJECT_LOCK (self);
+      self->earliestTime = GST_CLOCK_TIME_NONE;
+      GST_OBJECT_UNLOCK (self);
+
+      if (self->nThreads && self->lazy)
+        GST_WARNING_OBJECT (self, "Lazy decryption enabled, not starting "
+            "decryption threads");
+
+      if (self->recordLocation) {
+        g_autoptr (GError) error = nullptr;
+        self->capture = spkl_capture_new (self->recordLocation, &error);
+        if (!self->capture) {
+          GST_ELEMENT_ERROR (self, RESOURCE, OPEN_WRITE, (nullptr),
+              ("%s", error->message));
+          return GST_STATE_CHANGE_FAILURE;
+        }
+      }
+
+      if (self->nThreads && !self->lazy) {
+        g_autoptr (GError) error = nullptr;
+        GST_DEBUG_OBJECT (self, "Starting %u decryption threads",
+            self->nThreads);
+        self->workerPool = g_thread_pool_new (decryptJob, self,
+            self->nThreads, TRUE, &error);
+        if (!self->workerPool) {
+          GST_ELEMENT_ERROR (self, RESOURCE, FAILED, (nullptr),
+              ("Unable to start decryption threads: %s", error->message));
+          g_clear_pointer (&self->capture, spkl_capture_free);
+          return GST_STATE_CHANGE_FAILURE;
+        }
+      }
+      break;
     case GST_STATE_CHANGE_PAUSED_TO_READY:
-      g_cond_signal (&self->cdmAttachmentCondition);
+      g_mutex_lock (&self->cdmAttachmentMutex);
+      self->flushing = TRUE;
+      g_cond_broadcast (&self->cdmAttachmentCondition);
+      g_mutex_unlock (&self->cdmAttachmentMutex);
       break;
     case GST_STATE_CHANGE_READY_TO_NULL:
+      clearBacklog (self);
+      gst_clear_caps (&self->inputCaps);
+      clearCapsCache (self);
 
+      g_array_set_size (self->keySessions, 0);
       if (self->session) {
-        opencdm_destruct_session (self->session);
+        spkl_session_broker_release (self->session, GST_ELEMENT_CAST (self));
         self->session = nullptr;
       }
 
       if (self->pending_session) {
-        opencdm_destruct_session (self->pending_session);
+        spkl_session_broker_release (self->pending_session,
+            GST_ELEMENT_CAST (self));
         self->pending_session = nullptr;
       }
+      self->pendingSessionReady = FALSE;
+      self->keyExpiration = -1;
 
       if (self->system) {
-        opencdm_destruct_system (self->system);
+        spkl_session_broker_release_system (self->system);
         self->system = nullptr;
       }
+      self->keySystem = nullptr;
+      g_clear_pointer (&self->initData, g_bytes_unref);
+      g_ptr_array_set_size (self->kids, 0);
+      g_ptr_array_set_size (self->psshs, 0);
+      self->parsingPssh = FALSE;
 
       break;
     default:
       break;
   }
 
-  return GST_ELEMENT_CLASS (parent_class)->change_state (element, transition);
+  auto ret = GST_ELEMENT_CLASS (parent_class)->change_state (element,
+      transition);
+
+  // The streaming thread is stopped by now.
+  if (transition == GST_STATE_CHANGE_PAUSED_TO_READY && self->workerPool) {
+    g_thread_pool_free (self->workerPool, FALSE, TRUE);
+    self->workerPool = nullptr;
+    discardJobs (self);
+  }
+
+  // Buffers parked in this run must not leak into the next one.
+  if (transition == GST_STATE_CHANGE_PAUSED_TO_READY) {
+    clearBacklog (self);
+    g_clear_pointer (&self->capture, spkl_capture_free);
+  }
+
+  return ret;
 }
 
 static void
@@ -722,48 +2319,231 @@ spkl_decryptor_finalize (GObject * object)
   GST_DEBUG_OBJECT (self, "Finalizing");
 
   if (self->session) {
-    opencdm_destruct_session (self->session);
+    spkl_session_broker_release (self->session, GST_ELEMENT_CAST (self));
     self->session = nullptr;
   }
 
   if (self->pending_session) {
-    opencdm_destruct_session (self->pending_session);
+    spkl_session_broker_release (self->pending_session,
+        GST_ELEMENT_CAST (self));
     self->pending_session = nullptr;
   }
 
   if (self->system) {
-    opencdm_destruct_system (self->system);
+    spkl_session_broker_release_system (self->system);
     self->system = nullptr;
   }
 
-  if (self->pssh)
-    g_bytes_unref (self->pssh);
-
-  if (self->kid)
-    g_free (self->kid);
+  g_ptr_array_unref (self->psshs);
+  g_ptr_array_unref (self->kids);
+  g_array_unref (self->keySessions);
+  g_clear_pointer (&self->initData, g_bytes_unref);
+  g_clear_pointer (&self->capture, spkl_capture_free);
+  g_free (self->recordLocation);
 
+  clearBacklog (self);
+  gst_clear_caps (&self->inputCaps);
+  clearCapsCache (self);
   g_markup_parse_context_unref (self->markupParseContext);
   g_cond_clear (&self->cdmAttachmentCondition);
   g_mutex_clear (&self->cdmAttachmentMutex);
+  g_rw_lock_clear (&self->sessionLock);
+  g_mutex_clear (&self->workerMutex);
+  g_cond_clear (&self->workerCondition);
+  g_mutex_clear (&self->statsMutex);
 
   GST_CALL_PARENT (G_OBJECT_CLASS, finalize, (object));
 }
 
+static void
+spkl_decryptor_set_property (GObject * object, guint propertyId,
+    const GValue * value, GParamSpec * pspec)
+{
+  auto *self = SPKL_DECRYPTOR (object);
+
+  switch (propertyId) {
+    case PROP_BACKLOG_SIZE:
+      GST_OBJECT_LOCK (self);
+      self->maxBacklogSize = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_BACKLOG_TIMEOUT:
+      g_mutex_lock (&self->cdmAttachmentMutex);
+      self->backlogTimeout = g_value_get_uint64 (value);
+      g_mutex_unlock (&self->cdmAttachmentMutex);
+      break;
+    case PROP_N_THREADS:
+      self->nThreads = g_value_get_uint (value);
+      break;
+    case PROP_LAZY:
+      self->lazy = g_value_get_boolean (value);
+      break;
+    case PROP_RECORD_LOCATION:
+      g_free (self->recordLocation);
+      self->recordLocation = g_value_dup_string (value);
+      break;
+    case PROP_RENEWAL_MARGIN:
+      g_rw_lock_writer_lock (&self->sessionLock);
+      self->renewalMargin = g_value_get_uint64 (value);
+      g_rw_lock_writer_unlock (&self->sessionLock);
+      break;
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (self);
+      self->statsInterval = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_QOS_DROP_THRESHOLD:
+      GST_OBJECT_LOCK (self);
+      self->qosDropThreshold = g_value_get_uint64 (value);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, propertyId, pspec);
+      break;
+  }
+}
+
+static void
+spkl_decryptor_get_property (GObject * object, guint propertyId,
+    GValue * value, GParamSpec * pspec)
+{
+  auto *self = SPKL_DECRYPTOR (object);
+
+  switch (propertyId) {
+    case PROP_BACKLOG_SIZE:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint (value, self->maxBacklogSize);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_BACKLOG_TIMEOUT:
+      g_mutex_lock (&self->cdmAttachmentMutex);
+      g_value_set_uint64 (value, self->backlogTimeout);
+      g_mutex_unlock (&self->cdmAttachmentMutex);
+      break;
+    case PROP_N_THREADS:
+      g_value_set_uint (value, self->nThreads);
+      break;
+    case PROP_LAZY:
+      g_value_set_boolean (value, self->lazy);
+      break;
+    case PROP_RECORD_LOCATION:
+      g_value_set_string (value, self->recordLocation);
+      break;
+    case PROP_RENEWAL_MARGIN:
+      g_rw_lock_reader_lock (&self->sessionLock);
+      g_value_set_uint64 (value, self->renewalMargin);
+      g_rw_lock_reader_unlock (&self->sessionLock);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed (value, buildStats (self));
+      break;
+    case PROP_STATS_INTERVAL:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint64 (value, self->statsInterval);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    case PROP_QOS_DROP_THRESHOLD:
+      GST_OBJECT_LOCK (self);
+      g_value_set_uint64 (value, self->qosDropThreshold);
+      GST_OBJECT_UNLOCK (self);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, propertyId, pspec);
+      break;
+  }
+}
+
 static void
 spkl_decryptor_class_init (SparkleDecryptorClass * klass)
 {
   GObjectClass *gobjectClass = G_OBJECT_CLASS (klass);
   gobjectClass->finalize = spkl_decryptor_finalize;
   gobjectClass->dispose = spkl_decryptor_dispose;
+  gobjectClass->set_property = spkl_decryptor_set_property;
+  gobjectClass->get_property = spkl_decryptor_get_property;
+
+  g_object_class_install_property (gobjectClass, PROP_BACKLOG_SIZE,
+      g_param_spec_uint ("backlog-size", "Backlog size",
+          "Maximum number of encrypted buffers kept aside while the license "
+          "is pending, the streaming thread blocks once it is reached",
+          0, G_MAXUINT, DEFAULT_BACKLOG_SIZE,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobjectClass, PROP_BACKLOG_TIMEOUT,
+      g_param_spec_uint64 ("backlog-timeout", "Backlog timeout",
+          "Maximum time (in nanoseconds) to wait for the license before "
+          "failing", 0, G_MAXUINT64, DEFAULT_BACKLOG_TIMEOUT,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobjectClass, PROP_N_THREADS,
+      g_param_spec_uint ("n-threads", "Number of threads",
+          "Number of threads decrypting buffers off the streaming thread, "
+          "0 decrypts on the streaming thread", 0, G_MAXUINT16,
+          DEFAULT_N_THREADS,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+              GST_PARAM_MUTABLE_READY)));
+
+  g_object_class_install_property (gobjectClass, PROP_LAZY,
+      g_param_spec_boolean ("lazy", "Lazy decryption",
+          "Decrypt buffers when downstream first maps them instead of on the "
+          "streaming thread", DEFAULT_LAZY,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+              GST_PARAM_MUTABLE_READY)));
+
+  g_object_class_install_property (gobjectClass, PROP_RECORD_LOCATION,
+      g_param_spec_string ("record-location", "Record location",
+          "File to record the protected stream into, for offline replay "
+          "with sprkl-replay", nullptr,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+              GST_PARAM_MUTABLE_READY)));
+
+  g_object_class_install_property (gobjectClass, PROP_RENEWAL_MARGIN,
+      g_param_spec_uint64 ("renewal-margin", "Renewal margin",
+          "Time (in nanoseconds) before the expiration of the session keys "
+          "at which the session is renewed", 0, G_MAXUINT64,
+          DEFAULT_RENEWAL_MARGIN,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobjectClass, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Decryption statistics, with the same fields as spkl-stats messages",
+          GST_TYPE_STRUCTURE,
+          (GParamFlags) (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobjectClass, PROP_STATS_INTERVAL,
+      g_param_spec_uint64 ("stats-interval", "Statistics interval",
+          "Interval (in nanoseconds) between spkl-stats messages, 0 disables "
+          "them", 0, G_MAXUINT64, DEFAULT_STATS_INTERVAL,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+  g_object_class_install_property (gobjectClass, PROP_QOS_DROP_THRESHOLD,
+      g_param_spec_uint64 ("qos-drop-threshold", "QoS drop threshold",
+          "Lateness (in nanoseconds) reported by downstream QoS events above "
+          "which droppable encrypted buffers are dropped instead of decrypted",
+          0, G_MAXUINT64, DEFAULT_QOS_DROP_THRESHOLD,
+          (GParamFlags) (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
 
   GstBaseTransformClass *baseTransformClass = GST_BASE_TRANSFORM_CLASS (klass);
   baseTransformClass->transform_ip = GST_DEBUG_FUNCPTR (transformInPlace);
+  baseTransformClass->submit_input_buffer =
+      GST_DEBUG_FUNCPTR (submitInputBuffer);
+  baseTransformClass->generate_output = GST_DEBUG_FUNCPTR (generateOutput);
+  baseTransformClass->before_transform = GST_DEBUG_FUNCPTR (beforeTransform);
   baseTransformClass->transform_caps = GST_DEBUG_FUNCPTR (transformCaps);
+  baseTransformClass->set_caps = GST_DEBUG_FUNCPTR (setCaps);
   baseTransformClass->transform_ip_on_passthrough = FALSE;
   baseTransformClass->sink_event = GST_DEBUG_FUNCPTR (sinkEventHandler);
+  baseTransformClass->src_event = GST_DEBUG_FUNCPTR (srcEventHandler);
   baseTransformClass->propose_allocation =
       GST_DEBUG_FUNCPTR (proposeAllocation);
 
+  ivSizeQuark = g_quark_from_static_string ("iv_size");
+  encryptedQuark = g_quark_from_static_string ("encrypted");
+  subSampleCountQuark = g_quark_from_static_string ("subsample_count");
+  subSamplesQuark = g_quark_from_static_string ("subsamples");
+  kidQuark = g_quark_from_static_string ("kid");
+  ivQuark = g_quark_from_static_string ("iv");
+
   GstElementClass *elementClass = GST_ELEMENT_CLASS (klass);
   gst_element_class_add_pad_template (elementClass,
       gst_static_pad_template_get (&sinkTemplate));
@@ -5,6 +5,7 @@
 #include <glib.h>
 #include <gst/base/gstbasetransform.h>
 #include <gst/gst.h>
+#include "capture.h"
 #include "open_cdm.h"
 
 G_BEGIN_DECLS
@@ -14,17 +15,60 @@ G_BEGIN_DECLS
     (G_TYPE_CHECK_INSTANCE_CAST((obj), SPKL_TYPE_DECRYPTOR, SparkleDecryptor))
 #define SPKL_DECRYPTOR_CLASS(klass) \
     (G_TYPE_CHECK_CLASS_CAST((klass), SPKL_TYPE_DECRYPTOR, SparkleDecryptorClass))
+#define SPKL_IS_DECRYPTOR(obj) \
+    (G_TYPE_CHECK_INSTANCE_TYPE((obj), SPKL_TYPE_DECRYPTOR))
 
 GType spkl_decryptor_get_type(void);
 
+// Result of a transformCaps() call.
+struct SparkleCapsCacheEntry {
+    GstPadDirection direction;
+    GstCaps* caps;
+    GstCaps* filter;
+    GstCaps* result;
+};
+
+// Session holding a key, among the current and pending sessions.
+struct SparkleKeySession {
+    guint8 keyID[16];
+    gsize keyIDSize;
+    struct OpenCDMSession* session;
+};
+
+#define SPKL_DECRYPTOR_LATENCY_WINDOW 512
+
+// Counters exposed through the stats property and spkl-stats messages.
+struct SparkleDecryptorStats {
+    guint64 buffers;
+    guint64 bytes;
+    guint64 dropped; // Buffers downstream would have discarded.
+    guint failures;
+    guint renewals;
+    GstClockTime decryptTime;
+    GstClockTime waitTime; // Time spent blocked until keys were usable.
+
+    // Decryption times of the most recent buffers.
+    GstClockTime latencies[SPKL_DECRYPTOR_LATENCY_WINDOW];
+    guint latencyCount;
+    guint latencyIndex;
+};
+
 struct SparkleDecryptor {
     GstBaseTransform parent;
 
     GstEvent* protectionEvent;
+    GstCaps* inputCaps;
+    GQueue capsCache; // Most recently used entry first, protected by the object lock.
 
     struct OpenCDMSystem* system;
     struct OpenCDMSession* session;
     struct OpenCDMSession* pending_session;
+    GRWLock sessionLock; // Protects the session fields below.
+    gboolean renewing;
+    gboolean pendingSessionReady;
+    gint64 keyExpiration; // In microseconds since the Epoch, -1 if none.
+    GstClockTime renewalMargin;
+    GArray* keySessions; // SparkleKeySession entries of the usable keys.
     OpenCDMSessionCallbacks sessionCallbacks;
     gboolean provisioned;
     gboolean clearBufferNotified;
@@ -32,15 +76,62 @@ struct SparkleDecryptor {
     GMarkupParser markupParser;
     GMarkupParseContext *markupParseContext;
     gboolean parsingPssh;
-    GBytes* pssh;
-    gchar* kid;
+    GPtrArray* psshs; // All the PSSH boxes announced, as GBytes.
+    GPtrArray* kids; // All the key IDs announced, Base64-URL encoded.
+    const gchar* keySystem;
+    GBytes* initData; // Init data of the last license request.
 
     GMutex cdmAttachmentMutex;
     GCond cdmAttachmentCondition;
+
+    // Encrypted buffers parked while the license is pending, protected by
+    // cdmAttachmentMutex.
+    GQueue backlog;
+    gint64 backlogStart;
+    guint maxBacklogSize;
+    GstClockTime backlogTimeout;
+    gboolean flushing;
+
+    // Set while the buffers of a list, already recorded and filtered, go
+    // through the chain function. Only used by the streaming thread.
+    gboolean listFiltered;
+
+    // Encrypted buffers are decrypted by whoever maps them first.
+    gboolean lazy;
+
+    // Decryption thread pool, buffers are queued in jobs in submission order.
+    guint nThreads;
+    GThreadPool* workerPool;
+    GQueue jobs;
+    GMutex workerMutex;
+    GCond workerCondition;
+
+    // Encrypted buffers later than earliestTime (running time) by more than
+    // qosDropThreshold are dropped when droppable, protected by the object
+    // lock.
+    GstClockTime qosDropThreshold;
+    GstClockTime earliestTime;
+
+    // Capture of the protected stream, open between READY and PAUSED when
+    // recordLocation is set.
+    gchar* recordLocation;
+    SparkleCapture* capture;
+
+    SparkleDecryptorStats stats; // Protected by statsMutex.
+    GMutex statsMutex;
+    GstClockTime statsInterval;
+    gint64 lastStatsTime;
 };
 
 struct SparkleDecryptorClass {
     GstBaseTransformClass parentClass;
 };
 
+// Cumulative time spent decrypting and waiting for keys, for the tracer.
+void spkl_decryptor_get_times(SparkleDecryptor*, GstClockTime* decryptTime, GstClockTime* waitTime);
+
+// Whether buffers are decrypted by the streaming thread before being pushed,
+// so that the times spent between two pushes belong to the buffers pushed.
+gboolean spkl_decryptor_decrypts_in_order(SparkleDecryptor*);
+
 G_END_DECLS
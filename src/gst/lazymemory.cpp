@@ -0,0 +1,249 @@
+// SPDX-License-Identifier: MIT
+
+#include "lazymemory.h"
+
+GST_DEBUG_CATEGORY_STATIC (spkl_lazy_memory_debug_category);
+#define GST_CAT_DEFAULT spkl_lazy_memory_debug_category
+
+#define SPKL_LAZY_MEMORY_TYPE "SparkleLazyMemory"
+
+// Encrypted buffer shared by the lazy memories wrapping its memories.
+struct SparkleLazyBuffer
+{
+  gint refCount;
+  GMutex mutex;                 // Protects the buffer and the flags.
+  GstBuffer *buffer;
+  SparkleLazyDecryptFunc decrypt;
+  gpointer userData;
+  GDestroyNotify notify;
+  gboolean decrypted;
+  gboolean failed;
+};
+
+struct SparkleLazyMemory
+{
+  GstMemory memory;
+
+  SparkleLazyBuffer *sample;
+  gsize offset;                 // In the encrypted buffer.
+
+  // The decrypted range stays mapped until the memory is freed. skip is the
+  // offset of the range in the mapped memories.
+  GstMapInfo map;
+  gsize skip;
+  gboolean mapped;
+};
+
+struct SparkleLazyAllocator
+{
+  GstAllocator parent;
+};
+
+struct SparkleLazyAllocatorClass
+{
+  GstAllocatorClass parentClass;
+};
+
+G_DEFINE_TYPE (SparkleLazyAllocator, spkl_lazy_allocator, GST_TYPE_ALLOCATOR);
+
+static void
+unrefLazyBuffer (SparkleLazyBuffer * sample)
+{
+  if (!g_atomic_int_dec_and_test (&sample->refCount))
+    return;
+
+  gst_buffer_unref (sample->buffer);
+  if (sample->notify)
+    sample->notify (sample->userData);
+  g_mutex_clear (&sample->mutex);
+  g_free (sample);
+}
+
+// Must be called with the sample mutex held.
+static gboolean
+mapRange (SparkleLazyMemory * self)
+{
+  auto *sample = self->sample;
+  auto size = GST_MEMORY_CAST (self)->maxsize;
+
+  // Decryption might have replaced or merged the memories of the buffer, only
+  // the ones overlapping this range are mapped.
+  guint index, length;
+  gsize skip;
+  if (!gst_buffer_find_memory (sample->buffer, self->offset, size, &index,
+          &length, &skip)
+      || !gst_buffer_map_range (sample->buffer, index, length, &self->map,
+          GST_MAP_READWRITE))
+    return FALSE;
+
+  self->skip = skip;
+  self->mapped = TRUE;
+  return TRUE;
+}
+
+static gpointer
+lazyMemoryMap (GstMemory * memory, G_GNUC_UNUSED gsize maxSize,
+    G_GNUC_UNUSED GstMapFlags flags)
+{
+  /* *INDENT-OFF* */
+  auto *self = reinterpret_cast<SparkleLazyMemory*>(memory);
+  /* *INDENT-ON* */
+
+  auto *sample = self->sample;
+  g_mutex_lock (&sample->mutex);
+  if (!sample->decrypted && !sample->failed) {
+    GST_TRACE ("Decrypting %p on first map", sample->buffer);
+    if (sample->decrypt (sample->buffer, sample->userData))
+      sample->decrypted = TRUE;
+    else
+      sample->failed = TRUE;
+  }
+  if (sample->decrypted && !self->mapped && !mapRange (self))
+    GST_ERROR ("Unable to map %p at offset %" G_GSIZE_FORMAT, sample->buffer,
+        self->offset);
+  gpointer data = self->mapped ? self->map.data + self->skip : nullptr;
+  gboolean failed = sample->failed;
+  g_mutex_unlock (&sample->mutex);
+
+  if (failed)
+    GST_ERROR ("Unable to decrypt %p", sample->buffer);
+  return data;
+}
+
+static void
+lazyMemoryUnmap (G_GNUC_UNUSED GstMemory * memory)
+{
+}
+
+static GstMemory *
+lazyMemoryCopy (GstMemory * memory, gssize offset, gssize size)
+{
+  GstMapInfo info;
+  if (!gst_memory_map (memory, &info, GST_MAP_READ))
+    return nullptr;
+
+  if (size == -1)
+    size = (gssize) info.size > offset ? info.size - offset : 0;
+
+  auto *copy = gst_allocator_alloc (nullptr, size, nullptr);
+  GstMapInfo copyInfo;
+  if (copy && gst_memory_map (copy, &copyInfo, GST_MAP_WRITE)) {
+    memcpy (copyInfo.data, info.data + offset, size);
+    gst_memory_unmap (copy, &copyInfo);
+  }
+  gst_memory_unmap (memory, &info);
+  return copy;
+}
+
+// Memories are flagged as not shareable, so that sub-buffers are copies.
+static GstMemory *
+lazyMemoryShare (G_GNUC_UNUSED GstMemory * memory,
+    G_GNUC_UNUSED gssize offset, G_GNUC_UNUSED gssize size)
+{
+  return nullptr;
+}
+
+static gboolean
+lazyMemoryIsSpan (G_GNUC_UNUSED GstMemory * first,
+    G_GNUC_UNUSED GstMemory * second, G_GNUC_UNUSED gsize * offset)
+{
+  return FALSE;
+}
+
+static GstMemory *
+lazyAllocatorAlloc (G_GNUC_UNUSED GstAllocator * allocator,
+    G_GNUC_UNUSED gsize size, G_GNUC_UNUSED GstAllocationParams * params)
+{
+  // Lazy memories are only created by spkl_lazy_memory_append().
+  return nullptr;
+}
+
+static void
+lazyAllocatorFree (G_GNUC_UNUSED GstAllocator * allocator, GstMemory * memory)
+{
+  /* *INDENT-OFF* */
+  auto *self = reinterpret_cast<SparkleLazyMemory*>(memory);
+  /* *INDENT-ON* */
+
+  if (self->mapped) {
+    g_mutex_lock (&self->sample->mutex);
+    gst_buffer_unmap (self->sample->buffer, &self->map);
+    g_mutex_unlock (&self->sample->mutex);
+  }
+  unrefLazyBuffer (self->sample);
+  g_free (self);
+}
+
+static void
+spkl_lazy_allocator_init (SparkleLazyAllocator * self)
+{
+  auto *allocator = GST_ALLOCATOR_CAST (self);
+
+  allocator->mem_type = SPKL_LAZY_MEMORY_TYPE;
+  allocator->mem_map = lazyMemoryMap;
+  allocator->mem_unmap = lazyMemoryUnmap;
+  allocator->mem_copy = lazyMemoryCopy;
+  allocator->mem_share = lazyMemoryShare;
+  allocator->mem_is_span = lazyMemoryIsSpan;
+
+  GST_OBJECT_FLAG_SET (allocator, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+}
+
+static void
+spkl_lazy_allocator_class_init (SparkleLazyAllocatorClass * klass)
+{
+  auto *allocatorClass = GST_ALLOCATOR_CLASS (klass);
+
+  allocatorClass->alloc = lazyAllocatorAlloc;
+  allocatorClass->free = lazyAllocatorFree;
+}
+
+static GstAllocator *
+lazyAllocator ()
+{
+  static gsize allocator = 0;
+
+  if (g_once_init_enter (&allocator)) {
+    GST_DEBUG_CATEGORY_INIT (spkl_lazy_memory_debug_category,
+        "sprkllazymemory", 0, "Sparkle decrypt-on-map memory");
+    auto *instance = GST_ALLOCATOR_CAST (g_object_new
+        (spkl_lazy_allocator_get_type (), nullptr));
+    gst_object_ref_sink (instance);
+    GST_OBJECT_FLAG_SET (instance, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+    g_once_init_leave (&allocator, (gsize) instance);
+  }
+  return GST_ALLOCATOR_CAST (allocator);
+}
+
+void
+spkl_lazy_memory_append (GstBuffer * buffer, GstBuffer * encrypted,
+    SparkleLazyDecryptFunc decrypt, gpointer userData, GDestroyNotify notify)
+{
+  auto *sample = g_new0 (SparkleLazyBuffer, 1);
+  g_mutex_init (&sample->mutex);
+  sample->buffer = encrypted;
+  sample->decrypt = decrypt;
+  sample->userData = userData;
+  sample->notify = notify;
+
+  // Held until all the memories are appended, in case there are none.
+  sample->refCount = 1;
+
+  gsize offset = 0;
+  for (guint i = 0; i < gst_buffer_n_memory (encrypted); i++) {
+    auto size = gst_memory_get_sizes (gst_buffer_peek_memory (encrypted, i),
+        nullptr, nullptr);
+    if (!size)
+      continue;
+
+    auto *self = g_new0 (SparkleLazyMemory, 1);
+    gst_memory_init (GST_MEMORY_CAST (self), GST_MEMORY_FLAG_NO_SHARE,
+        lazyAllocator (), nullptr, size, 0, 0, size);
+    g_atomic_int_inc (&sample->refCount);
+    self->sample = sample;
+    self->offset = offset;
+    gst_buffer_append_memory (buffer, GST_MEMORY_CAST (self));
+    offset += size;
+  }
+  unrefLazyBuffer (sample);
+}
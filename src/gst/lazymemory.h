@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+// Decrypts the buffer in place, returns FALSE on failure.
+typedef gboolean (*SparkleLazyDecryptFunc)(GstBuffer*, gpointer userData);
+
+// Appends to buffer one memory per memory of the encrypted buffer. The whole
+// encrypted buffer is decrypted with the given function the first time one of
+// them is mapped, each of them then only maps its own range of the decrypted
+// buffer. Buffers that are never mapped are never decrypted. userData is
+// released with notify along with the last memory. Takes ownership of
+// encrypted.
+void spkl_lazy_memory_append(GstBuffer* buffer, GstBuffer* encrypted, SparkleLazyDecryptFunc, gpointer userData,
+    GDestroyNotify notify);
+
+G_END_DECLS
@@ -2,13 +2,18 @@
 
 #include "sparkle-cdm-config.h"
 #include "decryptor.h"
+#include "tracer.h"
 #include <gst/gst.h>
 
 static gboolean
 plugin_init (GstPlugin * plugin)
 {
-  return gst_element_register (plugin, "sprkldecryptor", GST_RANK_PRIMARY,
-      SPKL_TYPE_DECRYPTOR);
+  if (!gst_element_register (plugin, "sprkldecryptor", GST_RANK_PRIMARY,
+          SPKL_TYPE_DECRYPTOR))
+    return FALSE;
+
+  return gst_tracer_register (plugin, "sprkldecrypt",
+      SPKL_TYPE_DECRYPT_TRACER);
 }
 
 GST_PLUGIN_DEFINE (GST_VERSION_MAJOR,
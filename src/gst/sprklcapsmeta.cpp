@@ -44,9 +44,10 @@ sprkl_caps_meta_transform (GstBuffer * transbuf, GstMeta * meta,
   if (GST_META_TRANSFORM_IS_COPY (type)) {
     auto *copy = (GstMetaTransformCopy *) data;
     if (!copy->region) {
-      /* only copy if the complete data is copied as well */
+      /* only copy if the complete data is copied as well, caps are immutable
+       * once shared so a new reference is enough */
       sprkl_gst_buffer_add_caps_meta (transbuf,
-          gst_caps_copy (sprkl_caps_meta->caps));
+          gst_caps_ref (sprkl_caps_meta->caps));
     } else {
       return FALSE;
     }
@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: MIT
+
+#include "tracer.h"
+#include "decryptor.h"
+
+/**
+ *
+ * The sprkldecrypt tracer attributes the time sprkldecryptor elements spend on
+ * each output buffer to decryption and to waiting for the CDM to provide
+ * usable keys, e.g.:
+ *
+ * GST_TRACERS=sprkldecrypt GST_DEBUG=GST_TRACER:7 gst-launch-1.0 ...
+ *
+ * A sprkldecrypt-buffer record is logged for each buffer pushed by the
+ * decryptor source pads, with the time elapsed in the element since the
+ * previous push. With a backlog, the key wait is thus attributed to the first
+ * buffer released once keys are usable. A sprkldecrypt-summary record with
+ * the totals of the pad is logged when it pushes EOS.
+ *
+ * With `n-threads` or `lazy`, decryption is not performed between the pushes
+ * of the buffers it belongs to, so no sprkldecrypt-buffer record is logged and
+ * the maximums of the summary are left to zero. Its totals still cover the
+ * decryptions done before EOS is pushed, which with `lazy` excludes the
+ * buffers not mapped yet.
+ *
+ */
+
+GST_DEBUG_CATEGORY_STATIC (spkl_decrypt_tracer_debug_category);
+#define GST_CAT_DEFAULT spkl_decrypt_tracer_debug_category
+
+#define spkl_decrypt_tracer_parent_class parent_class
+G_DEFINE_TYPE_WITH_CODE (SparkleDecryptTracer, spkl_decrypt_tracer,
+    GST_TYPE_TRACER,
+    GST_DEBUG_CATEGORY_INIT (spkl_decrypt_tracer_debug_category,
+        "sprkldecrypt", 0, "Sparkle decryption tracer");
+    );
+
+static GstTracerRecord *bufferRecord;
+static GstTracerRecord *summaryRecord;
+static GQuark padDataQuark;
+
+// Accounting of a decryptor source pad, only accessed from its streaming
+// thread.
+struct SparklePadTrace
+{
+  gchar *name;
+  GstClockTime lastDecryptTime;
+  GstClockTime lastWaitTime;
+
+  guint64 buffers;
+  GstClockTime decryptTime;
+  GstClockTime waitTime;
+  GstClockTime maxDecryptTime;
+  GstClockTime maxWaitTime;
+};
+
+static void
+freePadTrace (gpointer data)
+{
+  /* *INDENT-OFF* */
+  auto *trace = static_cast<SparklePadTrace*>(data);
+  /* *INDENT-ON* */
+  g_free (trace->name);
+  g_free (trace);
+}
+
+static SparkleDecryptor *
+padDecryptor (GstPad * pad)
+{
+  auto *parent = GST_OBJECT_PARENT (pad);
+  if (GST_PAD_DIRECTION (pad) != GST_PAD_SRC || !parent
+      || !SPKL_IS_DECRYPTOR (parent))
+    return nullptr;
+  return SPKL_DECRYPTOR (parent);
+}
+
+static SparklePadTrace *
+padTrace (GstPad * pad, SparkleDecryptor * decryptor)
+{
+  /* *INDENT-OFF* */
+  auto *trace = static_cast<SparklePadTrace*>(g_object_get_qdata (G_OBJECT (pad), padDataQuark));
+  /* *INDENT-ON* */
+  if (trace)
+    return trace;
+
+  trace = g_new0 (SparklePadTrace, 1);
+  trace->name = g_strdup_printf ("%s_%s", GST_OBJECT_NAME (decryptor),
+      GST_OBJECT_NAME (pad));
+  spkl_decryptor_get_times (decryptor, &trace->lastDecryptTime,
+      &trace->lastWaitTime);
+  g_object_set_qdata_full (G_OBJECT (pad), padDataQuark, trace,
+      freePadTrace);
+  return trace;
+}
+
+// Adds the times spent by the decryptor since the previous call to the
+// totals, without attributing them to buffers.
+static void
+addTimes (SparklePadTrace * trace, SparkleDecryptor * decryptor)
+{
+  GstClockTime decryptTime, waitTime;
+  spkl_decryptor_get_times (decryptor, &decryptTime, &waitTime);
+  trace->decryptTime += decryptTime - trace->lastDecryptTime;
+  trace->waitTime += waitTime - trace->lastWaitTime;
+  trace->lastDecryptTime = decryptTime;
+  trace->lastWaitTime = waitTime;
+}
+
+static void
+logBuffers (GstPad * pad, guint64 ts, guint count)
+{
+  auto *decryptor = padDecryptor (pad);
+  if (!decryptor || !count)
+    return;
+
+  auto *trace = padTrace (pad, decryptor);
+  trace->buffers += count;
+  if (!spkl_decryptor_decrypts_in_order (decryptor)) {
+    addTimes (trace, decryptor);
+    return;
+  }
+
+  GstClockTime decryptTime, waitTime;
+  spkl_decryptor_get_times (decryptor, &decryptTime, &waitTime);
+
+  // Buffers of a list are accounted as taking the same time.
+  GstClockTime bufferDecryptTime =
+      (decryptTime - trace->lastDecryptTime) / count;
+  GstClockTime bufferWaitTime = (waitTime - trace->lastWaitTime) / count;
+  trace->lastDecryptTime = decryptTime;
+  trace->lastWaitTime = waitTime;
+
+  trace->decryptTime += bufferDecryptTime * count;
+  trace->waitTime += bufferWaitTime * count;
+  trace->maxDecryptTime = MAX (trace->maxDecryptTime, bufferDecryptTime);
+  trace->maxWaitTime = MAX (trace->maxWaitTime, bufferWaitTime);
+
+  for (guint i = 0; i < count; i++)
+    gst_tracer_record_log (bufferRecord, trace->name, bufferDecryptTime,
+        bufferWaitTime, ts);
+}
+
+static void
+pushBufferPre (G_GNUC_UNUSED GstTracer * tracer, guint64 ts, GstPad * pad,
+    G_GNUC_UNUSED GstBuffer * buffer)
+{
+  logBuffers (pad, ts, 1);
+}
+
+static void
+pushListPre (G_GNUC_UNUSED GstTracer * tracer, guint64 ts, GstPad * pad,
+    GstBufferList * list)
+{
+  logBuffers (pad, ts, gst_buffer_list_length (list));
+}
+
+static void
+pushEventPre (G_GNUC_UNUSED GstTracer * tracer, guint64 ts, GstPad * pad,
+    GstEvent * event)
+{
+  if (GST_EVENT_TYPE (event) != GST_EVENT_EOS)
+    return;
+
+  auto *decryptor = padDecryptor (pad);
+  if (!decryptor)
+    return;
+
+  auto *trace = padTrace (pad, decryptor);
+  if (!spkl_decryptor_decrypts_in_order (decryptor))
+    addTimes (trace, decryptor);
+
+  gst_tracer_record_log (summaryRecord, trace->name, trace->buffers,
+      trace->decryptTime, trace->waitTime, trace->maxDecryptTime,
+      trace->maxWaitTime, ts);
+
+  // Subsequent EOS (after a seek) summarize the buffers pushed since this one.
+  trace->buffers = 0;
+  trace->decryptTime = 0;
+  trace->waitTime = 0;
+  trace->maxDecryptTime = 0;
+  trace->maxWaitTime = 0;
+}
+
+static GstStructure *
+timeValue (const gchar * description)
+{
+  return gst_structure_new ("value",
+      "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+      "description", G_TYPE_STRING, description,
+      "min", G_TYPE_UINT64, G_GUINT64_CONSTANT (0),
+      "max", G_TYPE_UINT64, G_MAXUINT64, nullptr);
+}
+
+static GstStructure *
+padScope ()
+{
+  return gst_structure_new ("scope",
+      "type", G_TYPE_GTYPE, G_TYPE_STRING,
+      "related-to", GST_TYPE_TRACER_VALUE_SCOPE, GST_TRACER_VALUE_SCOPE_PAD,
+      nullptr);
+}
+
+static void
+spkl_decrypt_tracer_init (SparkleDecryptTracer * self)
+{
+  auto *tracer = GST_TRACER (self);
+
+  gst_tracing_register_hook (tracer, "pad-push-pre",
+      G_CALLBACK (pushBufferPre));
+  gst_tracing_register_hook (tracer, "pad-push-list-pre",
+      G_CALLBACK (pushListPre));
+  gst_tracing_register_hook (tracer, "pad-push-event-pre",
+      G_CALLBACK (pushEventPre));
+}
+
+static void
+spkl_decrypt_tracer_class_init (G_GNUC_UNUSED SparkleDecryptTracerClass *
+    klass)
+{
+  padDataQuark = g_quark_from_static_string ("spkl-decrypt-tracer-pad");
+
+  bufferRecord = gst_tracer_record_new ("sprkldecrypt-buffer.class",
+      "pad", GST_TYPE_STRUCTURE, padScope (),
+      "decrypt-time", GST_TYPE_STRUCTURE,
+      timeValue ("time spent decrypting the buffer in ns"),
+      "wait-time", GST_TYPE_STRUCTURE,
+      timeValue ("time spent waiting for usable keys in ns"),
+      "ts", GST_TYPE_STRUCTURE, timeValue ("ts when the buffer was pushed"),
+      nullptr);
+  GST_OBJECT_FLAG_SET (bufferRecord, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+
+  summaryRecord = gst_tracer_record_new ("sprkldecrypt-summary.class",
+      "pad", GST_TYPE_STRUCTURE, padScope (),
+      "buffers", GST_TYPE_STRUCTURE, gst_structure_new ("value",
+          "type", G_TYPE_GTYPE, G_TYPE_UINT64,
+          "description", G_TYPE_STRING, "number of buffers pushed",
+          "min", G_TYPE_UINT64, G_GUINT64_CONSTANT (0),
+          "max", G_TYPE_UINT64, G_MAXUINT64, nullptr),
+      "decrypt-time", GST_TYPE_STRUCTURE,
+      timeValue ("total time spent decrypting in ns"),
+      "wait-time", GST_TYPE_STRUCTURE,
+      timeValue ("total time spent waiting for usable keys in ns"),
+      "max-decrypt-time", GST_TYPE_STRUCTURE,
+      timeValue ("longest decryption of a buffer in ns"),
+      "max-wait-time", GST_TYPE_STRUCTURE,
+      timeValue ("longest wait for usable keys of a buffer in ns"),
+      "ts", GST_TYPE_STRUCTURE, timeValue ("ts when EOS was pushed"),
+      nullptr);
+  GST_OBJECT_FLAG_SET (summaryRecord, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+}
@@ -0,0 +1,24 @@
+// SPDX-License-Identifier: MIT
+
+#pragma once
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define SPKL_TYPE_DECRYPT_TRACER (spkl_decrypt_tracer_get_type())
+#define SPKL_DECRYPT_TRACER(obj) \
+    (G_TYPE_CHECK_INSTANCE_CAST((obj), SPKL_TYPE_DECRYPT_TRACER, SparkleDecryptTracer))
+
+GType spkl_decrypt_tracer_get_type(void);
+
+struct SparkleDecryptTracer {
+    GstTracer parent;
+};
+
+struct SparkleDecryptTracerClass {
+    GstTracerClass parentClass;
+};
+
+G_END_DECLS
@@ -1,54 +1,192 @@
 // SPDX-License-Identifier: MIT
 
+// Simulated CDM, decrypting nothing but behaving like a real module towards
+// the shim and the decryptor. Its behaviour is configured from the
+// environment, so that the shim and element overhead can be measured without
+// crypto, and backlog, renewal and threading behaviour reproduced
+// deterministically:
+//
+// - SPRKL_MOCK_DECRYPT_NS_PER_BYTE, SPRKL_MOCK_DECRYPT_NS_PER_SAMPLE: CPU
+//   time burnt by each decryption, 0 by default.
+// - SPRKL_MOCK_LICENSE_DELAY_MS: delay between a session update and its keys
+//   becoming usable, 0 by default. Keys are then usable when update() returns.
+// - SPRKL_MOCK_KEY_EXPIRY_MS: lifetime of the keys of each license, keys do
+//   not expire by default. Decryption then fails with ERROR_INVALID_SESSION.
+// - SPRKL_MOCK_DECRYPT_FAIL_EVERY, SPRKL_MOCK_UPDATE_FAIL_EVERY: fail every
+//   Nth decryption or session update of a session, never by default.
+//
+// Challenges use the WebKit license-request format, with the init data as
+// payload. Any license response is accepted and provides all the key IDs
+// found in the init data.
+
+#include <atomic>
 #include <gst/gst.h>
-#include <stdio.h>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include "open_cdm.h"
 #include "sprkl/sprkl-cdm.h"
 
+GST_DEBUG_CATEGORY_STATIC(mock_debug_category);
+#define GST_CAT_DEFAULT mock_debug_category
+
 #define UNUSED(v) (void)v
-#define LOG(fmt, ...) \
-    fprintf(stderr, "mock %s : " fmt "\n", __PRETTY_FUNCTION__, __VA_ARGS__)
 
-OpenCDMError opencdm_is_type_supported(const char keySystem[],
-    const char mimeType[])
+class GMutexHolder {
+public:
+    GMutexHolder(GMutex& mutex)
+        : m(mutex)
+    {
+        g_mutex_lock(&m);
+    }
+    ~GMutexHolder()
+    {
+        g_mutex_unlock(&m);
+    }
+
+private:
+    GMutex& m;
+};
+
+struct MockConfig {
+    MockConfig();
+
+    guint64 decryptNsPerByte { 0 };
+    guint64 decryptNsPerSample { 0 };
+    guint64 licenseDelayMs { 0 };
+    guint64 keyExpiryMs { 0 };
+    guint64 decryptFailEvery { 0 };
+    guint64 updateFailEvery { 0 };
+};
+
+static guint64 envValue(const char* name)
+{
+    const char* value = g_getenv(name);
+    return value ? g_ascii_strtoull(value, nullptr, 10) : 0;
+}
+
+MockConfig::MockConfig()
+    : decryptNsPerByte(envValue("SPRKL_MOCK_DECRYPT_NS_PER_BYTE"))
+    , decryptNsPerSample(envValue("SPRKL_MOCK_DECRYPT_NS_PER_SAMPLE"))
+    , licenseDelayMs(envValue("SPRKL_MOCK_LICENSE_DELAY_MS"))
+    , keyExpiryMs(envValue("SPRKL_MOCK_KEY_EXPIRY_MS"))
+    , decryptFailEvery(envValue("SPRKL_MOCK_DECRYPT_FAIL_EVERY"))
+    , updateFailEvery(envValue("SPRKL_MOCK_UPDATE_FAIL_EVERY"))
 {
-    LOG("%s -- %s", keySystem, mimeType);
-    return ERROR_NONE;
 }
 
+class MockCDMSession final : public SparkleCDMSession {
+public:
+    MockCDMSession(const MockConfig&, std::string id, const char initDataType[], std::span<const uint8_t> initData,
+        OpenCDMSessionCallbacks*, void* userData);
+    ~MockCDMSession();
+
+    const std::string& getId() const final { return m_id; }
+    KeyStatus status(std::span<const uint8_t> keyId) final;
+    uint32_t hasKeyId(std::span<const uint8_t> keyId) final;
+    OpenCDMError load() final;
+    OpenCDMError update(std::span<const uint8_t> message) final;
+    OpenCDMError remove() final;
+    OpenCDMError close() final;
+    OpenCDMError decrypt(GstBuffer* buffer, GstBuffer* subSamples, const uint32_t subSampleCount,
+        GstBuffer* IV, GstBuffer* keyID, uint32_t initWithLast15) final;
+    OpenCDMError decryptBuffer(GstBuffer* buffer, GstCaps* caps, GstBuffer* subSamples,
+        const uint32_t subSampleCount, GstBuffer* IV, GstBuffer* keyID) final;
+    int64_t expiration() const;
+
+    void challenge(std::span<const uint8_t> initData);
+
+private:
+    void parseKeyIDs(const std::string& initDataType, std::span<const uint8_t> initData);
+    void applyLicense();
+    void expireKeys();
+    void notifyKeys(bool keysUpdated);
+    void startTimer();
+    static gpointer runTimer(gpointer);
+
+    const MockConfig m_config;
+    std::string m_id;
+    OpenCDMSessionCallbacks* m_callbacks;
+    void* m_userData;
+    std::vector<std::string> m_keyIDs;
+
+    mutable GMutex m_mutex; // Protects the members below, decrypt() may run on several threads.
+    GCond m_cond;
+    KeyStatus m_status { StatusPending };
+    int64_t m_expiration { -1 }; // Milliseconds since the Epoch.
+    gint64 m_licenseDeadline { -1 }; // Monotonic time.
+    gint64 m_expiryDeadline { -1 }; // Monotonic time.
+    GThread* m_timer { nullptr };
+    bool m_closing { false };
+
+    std::atomic<uint64_t> m_decryptions { 0 };
+    std::atomic<uint64_t> m_updates { 0 };
+};
+
 class MockCDMSystem final : public SparkleCDMSystem {
 public:
     MockCDMSystem(const char keySystem[]) { UNUSED(keySystem); }
     OpenCDMBool supportsServerCertificate() final;
     OpenCDMError setServerCertificate(std::span<const uint8_t>) final;
     OpenCDMError constructSession(const LicenseType, const char initDataType[], std::span<const uint8_t> initData, std::span<const uint8_t> cdmData, OpenCDMSessionCallbacks*, void*, SparkleCDMSession**) final;
+
+private:
+    MockConfig m_config;
+    std::atomic<unsigned> m_sessionId { 0 };
 };
 
+OpenCDMError opencdm_is_type_supported(const char keySystem[],
+    const char mimeType[])
+{
+    GST_DEBUG("%s -- %s", keySystem, mimeType);
+    return ERROR_NONE;
+}
+
 SparkleCDMSystem* sprkl_cdm_create_system(const char keySystem[])
 {
-    LOG("%s", keySystem);
+    static std::once_flag initFlag;
+    std::call_once(initFlag, [] {
+        GST_DEBUG_CATEGORY_INIT(mock_debug_category, "sprklmock", 0, "Simulated decryption module");
+    });
+
     auto* system = new MockCDMSystem(keySystem);
+    GST_DEBUG("System %p created for %s", system, keySystem);
     return static_cast<SparkleCDMSystem*>(system);
 }
 
 OpenCDMError sprkl_cdm_destruct_system(SparkleCDMSystem* system)
 {
-    LOG("%p", system);
+    GST_DEBUG("Destroying system %p", system);
     delete static_cast<MockCDMSystem*>(system);
     return ERROR_NONE;
 }
 
+OpenCDMError sprkl_cdm_destruct_session(SparkleCDMSession* session)
+{
+    GST_DEBUG("Destroying session %p", session);
+    delete static_cast<MockCDMSession*>(session);
+    return ERROR_NONE;
+}
+
+OpenCDMBool sprkl_cdm_session_requires_caps(SparkleCDMSession* session)
+{
+    UNUSED(session);
+    return OPENCDM_BOOL_FALSE;
+}
+
+int64_t sprkl_cdm_session_expiration(SparkleCDMSession* session)
+{
+    return static_cast<MockCDMSession*>(session)->expiration();
+}
+
 OpenCDMBool MockCDMSystem::supportsServerCertificate()
 {
-    LOG("%p", this);
     return OPENCDM_BOOL_FALSE;
 }
 
 OpenCDMError MockCDMSystem::setServerCertificate(std::span<const uint8_t> certificate)
 {
-    LOG("%p", this);
     UNUSED(certificate);
     return ERROR_NONE;
 }
@@ -57,104 +195,294 @@ OpenCDMError MockCDMSystem::constructSession(const LicenseType licenseType,
     const char initDataType[], std::span<const uint8_t> initData, std::span<const uint8_t> cdmData, OpenCDMSessionCallbacks* callbacks,
     void* userData, SparkleCDMSession** session)
 {
-    LOG("%p", this);
     UNUSED(licenseType);
-    UNUSED(initDataType);
-    UNUSED(initData);
     UNUSED(cdmData);
-    UNUSED(callbacks);
-    UNUSED(userData);
-    *session = nullptr;
+
+    auto* mockSession = new MockCDMSession(m_config, std::to_string(m_sessionId++), initDataType, initData, callbacks, userData);
+    *session = mockSession;
+    mockSession->challenge(initData);
     return ERROR_NONE;
 }
 
-OpenCDMError spkrl_cdm_destruct_session(SparkleCDMSession* session)
+MockCDMSession::MockCDMSession(const MockConfig& config, std::string id, const char initDataType[], std::span<const uint8_t> initData,
+    OpenCDMSessionCallbacks* callbacks, void* userData)
+    : m_config(config)
+    , m_id(id)
+    , m_callbacks(callbacks)
+    , m_userData(userData)
 {
-    LOG("%p", session);
-    return ERROR_NONE;
+    g_mutex_init(&m_mutex);
+    g_cond_init(&m_cond);
+    parseKeyIDs(initDataType, initData);
+    GST_DEBUG("Session %s created with %zu key IDs", m_id.c_str(), m_keyIDs.size());
 }
 
-const char* opencdm_session_id(const struct OpenCDMSession* session)
+MockCDMSession::~MockCDMSession()
 {
-    LOG("%p", session);
-    return "mock";
+    {
+        GMutexHolder lock(m_mutex);
+        m_closing = true;
+        g_cond_signal(&m_cond);
+    }
+    if (m_timer)
+        g_thread_join(m_timer);
+    GST_DEBUG("Session %s: %" G_GUINT64_FORMAT " decryptions, %" G_GUINT64_FORMAT " updates",
+        m_id.c_str(), m_decryptions.load(), m_updates.load());
+    g_cond_clear(&m_cond);
+    g_mutex_clear(&m_mutex);
 }
 
-KeyStatus opencdm_session_status(const struct OpenCDMSession* session,
-    const uint8_t keyId[], const uint8_t length)
+static std::string decodeBase64Url(const char* data, size_t size)
 {
-    LOG("%p", session);
-    UNUSED(keyId);
-    UNUSED(length);
-    return Usable;
+    std::string encoded(data, size);
+    for (auto& c : encoded) {
+        if (c == '-')
+            c = '+';
+        else if (c == '_')
+            c = '/';
+    }
+    encoded.append((4 - encoded.size() % 4) % 4, '=');
+
+    gsize decodedSize;
+    g_autofree guchar* decoded = g_base64_decode(encoded.c_str(), &decodedSize);
+    return { decoded, decoded + decodedSize };
 }
 
-uint32_t opencdm_session_has_key_id(struct OpenCDMSession* session,
-    const uint8_t length, const uint8_t keyId[])
+void MockCDMSession::parseKeyIDs(const std::string& initDataType, std::span<const uint8_t> initData)
 {
-    LOG("%p", session);
-    UNUSED(length);
-    UNUSED(keyId);
-    return true;
+    if (initDataType == "cenc") {
+        // Version 1 PSSH boxes list their key IDs after the system ID.
+        size_t offset = 0;
+        while (offset + 32 <= initData.size()) {
+            uint32_t boxSize = GST_READ_UINT32_BE(initData.data() + offset);
+            if (boxSize < 32 || offset + boxSize > initData.size())
+                break;
+            if (initData[offset + 8] >= 1) {
+                uint32_t count = GST_READ_UINT32_BE(initData.data() + offset + 28);
+                for (uint32_t i = 0; i < count && 32 + (i + 1) * 16 <= boxSize; i++) {
+                    auto* kid = initData.data() + offset + 32 + i * 16;
+                    m_keyIDs.emplace_back(kid, kid + 16);
+                }
+            }
+            offset += boxSize;
+        }
+    } else if (initDataType == "keyids") {
+        // {"kids":["base64url", ...]}, no need for a JSON parser.
+        std::string json(initData.begin(), initData.end());
+        auto position = json.find("\"kids\"");
+        position = position == std::string::npos ? position : json.find('[', position);
+        auto end = position == std::string::npos ? position : json.find(']', position);
+        while (position != std::string::npos && position < end) {
+            auto start = json.find('"', position);
+            if (start == std::string::npos || start > end)
+                break;
+            auto stop = json.find('"', start + 1);
+            if (stop == std::string::npos)
+                break;
+            m_keyIDs.push_back(decodeBase64Url(json.data() + start + 1, stop - start - 1));
+            position = stop + 1;
+        }
+    } else if (initDataType == "webm") {
+        m_keyIDs.emplace_back(initData.begin(), initData.end());
+    }
 }
 
-OpenCDMError opencdm_session_load(struct OpenCDMSession* session)
+void MockCDMSession::challenge(std::span<const uint8_t> initData)
 {
-    LOG("%p", session);
-    return ERROR_NONE;
+    // WebKit license-request message type.
+    std::string message = "0:Type:";
+    message.append(initData.begin(), initData.end());
+    m_callbacks->process_challenge_callback(parent(), m_userData, nullptr, reinterpret_cast<const uint8_t*>(message.data()), message.size());
+}
+
+KeyStatus MockCDMSession::status(std::span<const uint8_t> keyId)
+{
+    if (!hasKeyId(keyId))
+        return InternalError;
+    GMutexHolder lock(m_mutex);
+    return m_status;
+}
+
+uint32_t MockCDMSession::hasKeyId(std::span<const uint8_t> keyId)
+{
+    // Without key IDs in the init data, e.g. version 0 PSSH boxes, the
+    // license is assumed to provide all of them.
+    if (m_keyIDs.empty())
+        return true;
+
+    std::string key { keyId.begin(), keyId.end() };
+    for (const auto& keyID : m_keyIDs) {
+        if (keyID == key)
+            return true;
+    }
+    return false;
 }
 
-OpenCDMError opencdm_session_update(struct OpenCDMSession* session,
-    const uint8_t keyMessage[],
-    const uint16_t keyLength)
+OpenCDMError MockCDMSession::load()
 {
-    LOG("%p", session);
-    UNUSED(keyMessage);
-    UNUSED(keyLength);
     return ERROR_NONE;
 }
 
-OpenCDMError opencdm_session_remove(struct OpenCDMSession* session)
+OpenCDMError MockCDMSession::update(std::span<const uint8_t> message)
 {
-    LOG("%p", session);
+    GST_MEMDUMP("License response", message.data(), message.size());
+    auto updates = ++m_updates;
+    if (m_config.updateFailEvery && !(updates % m_config.updateFailEvery)) {
+        GST_DEBUG("Session %s: failing update %" G_GUINT64_FORMAT, m_id.c_str(), updates);
+        m_callbacks->error_message_callback(parent(), m_userData, "Simulated license failure");
+        return ERROR_FAIL;
+    }
+
+    if (!m_config.licenseDelayMs) {
+        applyLicense();
+        return ERROR_NONE;
+    }
+
+    GMutexHolder lock(m_mutex);
+    m_licenseDeadline = g_get_monotonic_time() + m_config.licenseDelayMs * G_TIME_SPAN_MILLISECOND;
+    startTimer();
+    g_cond_signal(&m_cond);
     return ERROR_NONE;
 }
 
-OpenCDMError opencdm_session_close(struct OpenCDMSession* session)
+void MockCDMSession::applyLicense()
+{
+    {
+        GMutexHolder lock(m_mutex);
+        m_status = Usable;
+        if (m_config.keyExpiryMs) {
+            m_expiration = g_get_real_time() / 1000 + m_config.keyExpiryMs;
+            m_expiryDeadline = g_get_monotonic_time() + m_config.keyExpiryMs * G_TIME_SPAN_MILLISECOND;
+            startTimer();
+            g_cond_signal(&m_cond);
+        }
+    }
+    GST_DEBUG("Session %s: keys usable", m_id.c_str());
+    notifyKeys(true);
+}
+
+void MockCDMSession::expireKeys()
+{
+    {
+        GMutexHolder lock(m_mutex);
+        m_status = Expired;
+    }
+    GST_DEBUG("Session %s: keys expired", m_id.c_str());
+    notifyKeys(false);
+}
+
+void MockCDMSession::notifyKeys(bool keysUpdated)
+{
+    for (const auto& keyID : m_keyIDs)
+        m_callbacks->key_update_callback(parent(), m_userData, reinterpret_cast<const uint8_t*>(keyID.data()), keyID.size());
+    if (keysUpdated)
+        m_callbacks->keys_updated_callback(parent(), m_userData);
+}
+
+// Called with m_mutex held.
+void MockCDMSession::startTimer()
 {
-    LOG("%p", session);
+    if (!m_timer)
+        m_timer = g_thread_new("mock-cdm-timer", runTimer, this);
+}
+
+gpointer MockCDMSession::runTimer(gpointer data)
+{
+    auto* self = static_cast<MockCDMSession*>(data);
+    g_mutex_lock(&self->m_mutex);
+    while (!self->m_closing) {
+        gint64 now = g_get_monotonic_time();
+        if (self->m_licenseDeadline != -1 && self->m_licenseDeadline <= now) {
+            self->m_licenseDeadline = -1;
+            g_mutex_unlock(&self->m_mutex);
+            self->applyLicense();
+            g_mutex_lock(&self->m_mutex);
+            continue;
+        }
+        if (self->m_expiryDeadline != -1 && self->m_expiryDeadline <= now) {
+            self->m_expiryDeadline = -1;
+            g_mutex_unlock(&self->m_mutex);
+            self->expireKeys();
+            g_mutex_lock(&self->m_mutex);
+            continue;
+        }
+
+        gint64 deadline = self->m_licenseDeadline;
+        if (deadline == -1 || (self->m_expiryDeadline != -1 && self->m_expiryDeadline < deadline))
+            deadline = self->m_expiryDeadline;
+        if (deadline == -1)
+            g_cond_wait(&self->m_cond, &self->m_mutex);
+        else
+            g_cond_wait_until(&self->m_cond, &self->m_mutex, deadline);
+    }
+    g_mutex_unlock(&self->m_mutex);
+    return nullptr;
+}
+
+OpenCDMError MockCDMSession::remove()
+{
+    GMutexHolder lock(m_mutex);
+    m_status = Released;
+    m_licenseDeadline = -1;
+    m_expiryDeadline = -1;
     return ERROR_NONE;
 }
 
-OpenCDMError opencdm_gstreamer_session_decrypt(struct OpenCDMSession* session,
-    GstBuffer* buffer,
-    GstBuffer* subSamples,
-    const uint32_t subSampleCount,
-    GstBuffer* IV, GstBuffer* keyID,
-    uint32_t initWithLast15)
+OpenCDMError MockCDMSession::close()
+{
+    return remove();
+}
+
+int64_t MockCDMSession::expiration() const
+{
+    GMutexHolder lock(m_mutex);
+    return m_expiration;
+}
+
+OpenCDMError MockCDMSession::decrypt(GstBuffer* buffer, GstBuffer* subSamples, const uint32_t subSampleCount,
+    GstBuffer* IV, GstBuffer* keyID, uint32_t initWithLast15)
 {
-    LOG("%p", session);
-    UNUSED(buffer);
     UNUSED(subSamples);
     UNUSED(subSampleCount);
     UNUSED(IV);
-    UNUSED(keyID);
     UNUSED(initWithLast15);
+
+    GstMapInfo info;
+    if (!gst_buffer_map(keyID, &info, GST_MAP_READ))
+        return ERROR_INVALID_DECRYPT_BUFFER;
+    auto keyStatus = status({ info.data, info.size });
+    gst_buffer_unmap(keyID, &info);
+    if (keyStatus != Usable) {
+        GST_DEBUG("Session %s: key not usable (%d)", m_id.c_str(), keyStatus);
+        // Keys that were usable make the decryptor switch to its renewed
+        // session, as with real modules.
+        return keyStatus == Expired || keyStatus == Released ? ERROR_INVALID_SESSION : ERROR_FAIL;
+    }
+
+    auto decryptions = ++m_decryptions;
+    if (m_config.decryptFailEvery && !(decryptions % m_config.decryptFailEvery)) {
+        GST_DEBUG("Session %s: failing decryption %" G_GUINT64_FORMAT, m_id.c_str(), decryptions);
+        return ERROR_FAIL;
+    }
+
+    // Writable mapping, as real modules decrypt in place.
+    if (!gst_buffer_map(buffer, &info, GST_MAP_READWRITE))
+        return ERROR_INVALID_DECRYPT_BUFFER;
+
+    // Busy-wait rather than sleep, decryption contends for the CPU.
+    GstClockTime cost = m_config.decryptNsPerSample + m_config.decryptNsPerByte * info.size;
+    if (cost) {
+        GstClockTime deadline = gst_util_get_timestamp() + cost;
+        while (gst_util_get_timestamp() < deadline) { }
+    }
+
+    gst_buffer_unmap(buffer, &info);
     return ERROR_NONE;
 }
 
-OpenCDMError opencdm_gstreamer_session_decrypt_v2(struct OpenCDMSession* session,
-    GstBuffer* buffer,
-    GstCaps*,
-    GstBuffer* subSample,
-    const uint32_t subSampleCount,
-    GstBuffer* IV, GstBuffer* keyID)
+OpenCDMError MockCDMSession::decryptBuffer(GstBuffer* buffer, GstCaps* caps, GstBuffer* subSamples,
+    const uint32_t subSampleCount, GstBuffer* IV, GstBuffer* keyID)
 {
-    LOG("%p", session);
-    UNUSED(buffer);
-    UNUSED(subSample);
-    UNUSED(subSampleCount);
-    UNUSED(IV);
-    UNUSED(keyID);
-    return ERROR_NONE;
+    UNUSED(caps);
+    return decrypt(buffer, subSamples, subSampleCount, IV, keyID, 0);
 }
@@ -57,7 +57,9 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifdef __cplusplus
 #include <list>
+#endif
 #include <stdio.h>
 
 #ifndef EXTERNAL
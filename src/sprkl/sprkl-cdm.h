@@ -6,6 +6,15 @@
 #include <string>
 #include <span>
 
+// Encrypted sample handed to sprkl_cdm_session_decrypt_list().
+struct SparkleCDMSample {
+    GstBuffer* buffer;
+    GstBuffer* subSamples;
+    uint32_t subSampleCount;
+    GstBuffer* IV;
+    GstBuffer* keyID;
+};
+
 class SparkleCDMSession {
 public:
     virtual const std::string& getId() const = 0;
@@ -24,7 +33,7 @@ public:
     OpenCDMSession* parent() const { return m_parent; }
 
 private:
-    OpenCDMSession* m_parent;
+    OpenCDMSession* m_parent { nullptr };
 };
 
 class SparkleCDMSystem {
@@ -42,6 +51,30 @@ EXTERNAL SparkleCDMSystem* sprkl_cdm_create_system(const char keySystem[]);
 EXTERNAL OpenCDMError sprkl_cdm_destruct_system(SparkleCDMSystem*);
 EXTERNAL OpenCDMError sprkl_cdm_destruct_session(SparkleCDMSession*);
 
+// Optional module entry points, looked up at session construction. Modules
+// not exporting them get the default behaviour, so adding hooks here does not
+// break the ABI of the SparkleCDMSession vtable.
+
+// Modules not inspecting the SprklCapsMeta of the buffers handed to decrypt()
+// can opt-out by returning OPENCDM_BOOL_FALSE. Caps are attached otherwise.
+EXTERNAL OpenCDMBool sprkl_cdm_session_requires_caps(SparkleCDMSession*);
+
+// Expiration time of the session keys, in milliseconds since the Epoch, or -1
+// if they do not expire, the default. The decryptor renews the session ahead
+// of it.
+EXTERNAL int64_t sprkl_cdm_session_expiration(SparkleCDMSession*);
+
+// Decrypts a batch of samples, usually a whole fragment, stopping at the first
+// failure. decrypted is set to the number of samples processed successfully.
+// Modules can export it to amortise the per-call setup, samples are handed one
+// by one to decrypt() otherwise.
+EXTERNAL OpenCDMError sprkl_cdm_session_decrypt_list(SparkleCDMSession*, const SparkleCDMSample* samples, uint32_t count, uint32_t* decrypted);
+
+// Sparkle-CDM extensions of the OpenCDM API, implemented by libocdm.
+EXTERNAL OpenCDMBool sprkl_session_requires_caps(const struct OpenCDMSession*);
+EXTERNAL int64_t sprkl_session_expiration(const struct OpenCDMSession*);
+EXTERNAL OpenCDMError sprkl_session_decrypt_list(struct OpenCDMSession*, const SparkleCDMSample* samples, uint32_t count, uint32_t* decrypted);
+
 #ifdef __cplusplus
 }
 #endif
@@ -15,6 +15,10 @@ GST_DEBUG_CATEGORY(sparkle_cdm_debug_category);
 
 #define UNUSED_PARAM(x) (void)x
 
+typedef OpenCDMBool (*RequiresCapsFunc)(SparkleCDMSession* session);
+typedef int64_t (*ExpirationFunc)(SparkleCDMSession* session);
+typedef OpenCDMError (*DecryptListFunc)(SparkleCDMSession* session, const SparkleCDMSample* samples, uint32_t count, uint32_t* decrypted);
+
 struct OpenCDMSession {
     OpenCDMSession(OpenCDMSystem* system, SparkleCDMSession* sprklSession);
     ~OpenCDMSession();
@@ -25,9 +29,26 @@ struct OpenCDMSession {
 
     SparkleCDMSession* sprklSession() const { return m_sprklSession; }
 
+    // Optional hooks exported by the module, null when missing.
+    void lookupHooks(GModule* module)
+    {
+        if (!g_module_symbol(module, "sprkl_cdm_session_requires_caps", (gpointer*)&requiresCaps))
+            requiresCaps = nullptr;
+        if (!g_module_symbol(module, "sprkl_cdm_session_expiration", (gpointer*)&expiration))
+            expiration = nullptr;
+        if (!g_module_symbol(module, "sprkl_cdm_session_decrypt_list", (gpointer*)&decryptList))
+            decryptList = nullptr;
+    }
+
+    RequiresCapsFunc requiresCaps{ nullptr };
+    ExpirationFunc expiration{ nullptr };
+    DecryptListFunc decryptList{ nullptr };
+
 private:
     OpenCDMSystem* m_system;
     SparkleCDMSession* m_sprklSession{ nullptr };
+    // Modules may free their session before this one is deleted.
+    std::string m_id;
 };
 
 struct OpenCDMSystem {
@@ -74,6 +95,7 @@ private:
 OpenCDMSession::OpenCDMSession(OpenCDMSystem* system, SparkleCDMSession* sprklSession)
     : m_system(system)
     , m_sprklSession(sprklSession)
+    , m_id(sprklSession->getId())
 {
     m_system->registerSession(this);
     m_sprklSession->setParent(this);
@@ -81,7 +103,7 @@ OpenCDMSession::OpenCDMSession(OpenCDMSystem* system, SparkleCDMSession* sprklSe
 
 OpenCDMSession::~OpenCDMSession()
 {
-    m_system->unregisterSession(m_sprklSession->getId());
+    m_system->unregisterSession(m_id);
 }
 
 namespace {
@@ -356,6 +378,7 @@ OpenCDMError opencdm_construct_session(
     auto result = system->sprklSystem()->constructSession(licenseType, initDataType, init, cdmData, callbacks, userData, &sprklSession);
     if (result == ERROR_NONE) {
         *session = new OpenCDMSession(system, sprklSession);
+        (*session)->lookupHooks(module);
         cacheSession(*session, module);
     }
     return result;
@@ -488,3 +511,42 @@ OpenCDMError opencdm_gstreamer_session_decrypt_buffer(struct OpenCDMSession* ses
 
     return session->sprklSession()->decryptBuffer(buffer, caps, subSample, subSampleCount, IV, keyID);
 }
+
+OpenCDMBool sprkl_session_requires_caps(const struct OpenCDMSession* session)
+{
+    if (!session)
+        return OPENCDM_BOOL_FALSE;
+    if (!session->requiresCaps)
+        return OPENCDM_BOOL_TRUE;
+    return session->requiresCaps(session->sprklSession());
+}
+
+int64_t sprkl_session_expiration(const struct OpenCDMSession* session)
+{
+    if (!session || !session->expiration)
+        return -1;
+    return session->expiration(session->sprklSession());
+}
+
+OpenCDMError sprkl_session_decrypt_list(struct OpenCDMSession* session, const SparkleCDMSample* samples, uint32_t count, uint32_t* decrypted)
+{
+    uint32_t processed = 0;
+    OpenCDMError result = ERROR_INVALID_SESSION;
+    if (session) {
+        GST_TRACE("sprkl_session_decrypt_list: %p, %u samples", session, count);
+        if (session->decryptList)
+            result = session->decryptList(session->sprklSession(), samples, count, &processed);
+        else {
+            auto* sprklSession = session->sprklSession();
+            for (result = ERROR_NONE; processed < count; processed++) {
+                const auto& sample = samples[processed];
+                result = sprklSession->decrypt(sample.buffer, sample.subSamples, sample.subSampleCount, sample.IV, sample.keyID, 0);
+                if (result != ERROR_NONE)
+                    break;
+            }
+        }
+    }
+    if (decrypted)
+        *decrypted = processed;
+    return result;
+}
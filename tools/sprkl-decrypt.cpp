@@ -0,0 +1,723 @@
+// SPDX-License-Identifier: MIT
+
+#include "open_cdm.h"
+#include "sprkl-tool.h"
+#include "sprkl/sprkl-cdm.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <glib/gstdio.h>
+#include <gst/base/gstbytereader.h>
+#include <gst/gst.h>
+#include <map>
+#include <span>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+
+// Decrypts ClearKey protected fragmented MP4 files, 'cenc' scheme, without a
+// GStreamer pipeline, for batch jobs. The input is mapped privately,
+// fragments are decrypted in place and in parallel through the batch
+// decryption entry point of the session, and written out in order as soon as
+// they are ready. Throughput is printed as JSON.
+//
+// Usage: sprkl-decrypt [--threads N] --key KID:KEY [--key KID:KEY...] INPUT OUTPUT
+//
+// KID and KEY are 16 bytes in hexadecimal. Sample data is decrypted in place
+// and the protection boxes (sinf, pssh, senc, saiz, saio) are turned into free
+// boxes, the sample entries getting back their original format, so that all
+// the offsets remain valid. All the samples of a protected track are decrypted
+// with its default key ID, sample groups are not supported. The ClearKey
+// module is looked up in WEBKIT_SPARKLE_CDM_MODULE_PATH.
+
+#define CLEARKEY_KEY_SYSTEM "org.w3.clearkey"
+
+G_DEFINE_QUARK(sprkl-decrypt-error-quark, sprkl_decrypt_error)
+#define SPRKL_DECRYPT_ERROR (sprkl_decrypt_error_quark())
+
+namespace {
+
+constexpr guint32 boxFree = GST_MAKE_FOURCC('f', 'r', 'e', 'e');
+constexpr guint32 boxEnca = GST_MAKE_FOURCC('e', 'n', 'c', 'a');
+constexpr guint32 boxEncv = GST_MAKE_FOURCC('e', 'n', 'c', 'v');
+constexpr guint32 boxFrma = GST_MAKE_FOURCC('f', 'r', 'm', 'a');
+constexpr guint32 boxMdia = GST_MAKE_FOURCC('m', 'd', 'i', 'a');
+constexpr guint32 boxMinf = GST_MAKE_FOURCC('m', 'i', 'n', 'f');
+constexpr guint32 boxMoof = GST_MAKE_FOURCC('m', 'o', 'o', 'f');
+constexpr guint32 boxMoov = GST_MAKE_FOURCC('m', 'o', 'o', 'v');
+constexpr guint32 boxMvex = GST_MAKE_FOURCC('m', 'v', 'e', 'x');
+constexpr guint32 boxPssh = GST_MAKE_FOURCC('p', 's', 's', 'h');
+constexpr guint32 boxSaio = GST_MAKE_FOURCC('s', 'a', 'i', 'o');
+constexpr guint32 boxSaiz = GST_MAKE_FOURCC('s', 'a', 'i', 'z');
+constexpr guint32 boxSchi = GST_MAKE_FOURCC('s', 'c', 'h', 'i');
+constexpr guint32 boxSchm = GST_MAKE_FOURCC('s', 'c', 'h', 'm');
+constexpr guint32 boxSenc = GST_MAKE_FOURCC('s', 'e', 'n', 'c');
+constexpr guint32 boxSinf = GST_MAKE_FOURCC('s', 'i', 'n', 'f');
+constexpr guint32 boxStbl = GST_MAKE_FOURCC('s', 't', 'b', 'l');
+constexpr guint32 boxStsd = GST_MAKE_FOURCC('s', 't', 's', 'd');
+constexpr guint32 boxTenc = GST_MAKE_FOURCC('t', 'e', 'n', 'c');
+constexpr guint32 boxTfhd = GST_MAKE_FOURCC('t', 'f', 'h', 'd');
+constexpr guint32 boxTkhd = GST_MAKE_FOURCC('t', 'k', 'h', 'd');
+constexpr guint32 boxTraf = GST_MAKE_FOURCC('t', 'r', 'a', 'f');
+constexpr guint32 boxTrak = GST_MAKE_FOURCC('t', 'r', 'a', 'k');
+constexpr guint32 boxTrex = GST_MAKE_FOURCC('t', 'r', 'e', 'x');
+constexpr guint32 boxTrun = GST_MAKE_FOURCC('t', 'r', 'u', 'n');
+constexpr guint32 boxUuid = GST_MAKE_FOURCC('u', 'u', 'i', 'd');
+
+// Smooth Streaming (PIFF) flavour of the senc box.
+const guint8 piffSampleEncryptionUuid[16] = { 0xa2, 0x39, 0x4f, 0x52, 0x5a, 0x9b, 0x4f, 0x14, 0xa2, 0x44, 0x6c, 0x42, 0x7c, 0x64, 0x8d, 0xf4 };
+
+constexpr gsize subSampleEntrySize = 6;
+
+struct Track {
+    bool isProtected { false };
+    guint8 ivSize { 0 };
+    guint8 keyID[16] { };
+    guint32 defaultSampleSize { 0 }; // From the trex box.
+};
+
+struct Box {
+    guint32 type;
+    guint8* start;
+    gsize size;
+    std::span<guint8> payload;
+};
+
+// Input range starting with a moof box, up to the next one, decrypted in
+// place by the worker threads.
+struct Fragment {
+    guint64 fileOffset;
+    std::span<guint8> data;
+    guint samples { 0 };
+    guint64 encryptedBytes { 0 };
+    GError* error { nullptr };
+    bool done { false };
+};
+
+struct DecryptStats {
+    gsize fragments { 0 };
+    guint64 samples { 0 };
+    guint64 encryptedBytes { 0 };
+};
+
+struct Decrypter {
+    struct OpenCDMSession* session { nullptr };
+    std::map<guint32, Track> tracks; // By track ID, read-only once fragments are processed.
+    GMutex mutex;
+    GCond condition; // Signalled when a fragment is done.
+};
+
+// Auxiliary information of an encrypted sample, pointing into the fragment.
+struct SampleAuxInfo {
+    const guint8* iv;
+    guint8 ivSize; // PIFF sample encryption boxes may override the track one.
+    const guint8* subSamples;
+    guint16 subSampleCount;
+};
+
+static bool readBox(std::span<guint8> data, gsize offset, Box& box)
+{
+    if (data.size() - offset < 8)
+        return false;
+
+    auto* start = data.data() + offset;
+    guint64 size = GST_READ_UINT32_BE(start);
+    gsize headerSize = 8;
+    if (size == 1) {
+        if (data.size() - offset < 16)
+            return false;
+        size = GST_READ_UINT64_BE(start + 8);
+        headerSize = 16;
+    } else if (!size)
+        size = data.size() - offset;
+    if (size < headerSize || size > data.size() - offset)
+        return false;
+
+    box.type = GST_READ_UINT32_LE(start + 4);
+    box.start = start;
+    box.size = size;
+    box.payload = data.subspan(offset + headerSize, size - headerSize);
+    return true;
+}
+
+// Boxes following each other in data, up to the first malformed one.
+static std::vector<Box> childBoxes(std::span<guint8> data)
+{
+    std::vector<Box> boxes;
+    Box box;
+    for (gsize offset = 0; offset < data.size() && readBox(data, offset, box); offset += box.size)
+        boxes.push_back(box);
+    return boxes;
+}
+
+static bool findBox(std::span<guint8> data, guint32 type, Box& result)
+{
+    for (const auto& box : childBoxes(data)) {
+        if (box.type == type) {
+            result = box;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void renameBox(const Box& box, guint32 type)
+{
+    GST_WRITE_UINT32_LE(box.start + 4, type);
+}
+
+static bool isPiffSampleEncryption(const Box& box)
+{
+    return box.type == boxUuid && box.payload.size() >= sizeof(piffSampleEncryptionUuid)
+        && !memcmp(box.payload.data(), piffSampleEncryptionUuid, sizeof(piffSampleEncryptionUuid));
+}
+
+static bool parseTenc(std::span<guint8> payload, Track& track)
+{
+    GstByteReader reader;
+    gst_byte_reader_init(&reader, payload.data(), payload.size());
+    guint8 isProtected, ivSize;
+    const guint8* keyID;
+    // Version and flags, then reserved or pattern bytes.
+    if (!gst_byte_reader_skip(&reader, 6) || !gst_byte_reader_get_uint8(&reader, &isProtected)
+        || !gst_byte_reader_get_uint8(&reader, &ivSize) || !gst_byte_reader_get_data(&reader, sizeof(track.keyID), &keyID))
+        return false;
+
+    track.isProtected = isProtected;
+    track.ivSize = ivSize;
+    memcpy(track.keyID, keyID, sizeof(track.keyID));
+    return true;
+}
+
+static bool processSampleEntry(const Box& entry, Track& track, GError** error)
+{
+    // Fields of VisualSampleEntry and AudioSampleEntry preceding the child
+    // boxes, the latter growing with its version.
+    gsize childrenOffset = entry.type == boxEncv ? 78 : 28;
+    if (entry.type == boxEnca && entry.payload.size() >= 10) {
+        auto version = GST_READ_UINT16_BE(entry.payload.data() + 8);
+        childrenOffset += version == 1 ? 16 : version == 2 ? 36 : 0;
+    }
+
+    Box sinf, frma, schm, schi, tenc;
+    if (entry.payload.size() < childrenOffset || !findBox(entry.payload.subspan(childrenOffset), boxSinf, sinf)
+        || !findBox(sinf.payload, boxFrma, frma) || frma.payload.size() < 4
+        || !findBox(sinf.payload, boxSchm, schm) || schm.payload.size() < 8
+        || !findBox(sinf.payload, boxSchi, schi) || !findBox(schi.payload, boxTenc, tenc)) {
+        g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Invalid protected sample entry");
+        return false;
+    }
+
+    if (memcmp(schm.payload.data() + 4, "cenc", 4)) {
+        g_set_error(error, SPRKL_DECRYPT_ERROR, 0, "Unsupported protection scheme %.4s", schm.payload.data() + 4);
+        return false;
+    }
+
+    if (!parseTenc(tenc.payload, track) || (track.isProtected && track.ivSize != 8 && track.ivSize != 16)) {
+        g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Invalid tenc box");
+        return false;
+    }
+
+    memcpy(entry.start + 4, frma.payload.data(), 4);
+    renameBox(sinf, boxFree);
+    return true;
+}
+
+static bool processTrak(Decrypter* decrypter, const Box& trak, GError** error)
+{
+    Box tkhd, mdia, minf, stbl, stsd;
+    if (!findBox(trak.payload, boxTkhd, tkhd) || !findBox(trak.payload, boxMdia, mdia)
+        || !findBox(mdia.payload, boxMinf, minf) || !findBox(minf.payload, boxStbl, stbl)
+        || !findBox(stbl.payload, boxStsd, stsd) || stsd.payload.size() < 8)
+        return true;
+
+    GstByteReader reader;
+    gst_byte_reader_init(&reader, tkhd.payload.data(), tkhd.payload.size());
+    guint8 version;
+    guint32 trackID;
+    if (!gst_byte_reader_get_uint8(&reader, &version) || !gst_byte_reader_skip(&reader, version == 1 ? 19 : 11)
+        || !gst_byte_reader_get_uint32_be(&reader, &trackID)) {
+        g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Invalid tkhd box");
+        return false;
+    }
+
+    // Version, flags and entry count.
+    for (const auto& entry : childBoxes(stsd.payload.subspan(8))) {
+        if ((entry.type == boxEncv || entry.type == boxEnca) && !processSampleEntry(entry, decrypter->tracks[trackID], error))
+            return false;
+    }
+    return true;
+}
+
+static bool processMoov(Decrypter* decrypter, const Box& moov, GError** error)
+{
+    for (const auto& box : childBoxes(moov.payload)) {
+        if (box.type == boxPssh)
+            renameBox(box, boxFree);
+        else if (box.type == boxTrak && !processTrak(decrypter, box, error))
+            return false;
+        else if (box.type == boxMvex) {
+            for (const auto& trex : childBoxes(box.payload)) {
+                if (trex.type != boxTrex || trex.payload.size() < 24)
+                    continue;
+                auto trackID = GST_READ_UINT32_BE(trex.payload.data() + 4);
+                decrypter->tracks[trackID].defaultSampleSize = GST_READ_UINT32_BE(trex.payload.data() + 16);
+            }
+        }
+    }
+    return true;
+}
+
+static bool parseSampleEncryption(const Box& box, guint8 ivSize, std::vector<SampleAuxInfo>& auxInfo)
+{
+    GstByteReader reader;
+    gst_byte_reader_init(&reader, box.payload.data(), box.payload.size());
+    if (box.type == boxUuid)
+        gst_byte_reader_skip(&reader, sizeof(piffSampleEncryptionUuid));
+
+    guint32 flags, count;
+    if (!gst_byte_reader_get_uint32_be(&reader, &flags))
+        return false;
+    // PIFF boxes may override the track encryption parameters.
+    if (box.type == boxUuid && flags & 0x1 && (!gst_byte_reader_skip(&reader, 3) || !gst_byte_reader_get_uint8(&reader, &ivSize) || !gst_byte_reader_skip(&reader, 16) || (ivSize != 8 && ivSize != 16)))
+        return false;
+    if (!gst_byte_reader_get_uint32_be(&reader, &count))
+        return false;
+
+    for (guint32 i = 0; i < count; i++) {
+        SampleAuxInfo info = { };
+        info.ivSize = ivSize;
+        if (!gst_byte_reader_get_data(&reader, ivSize, &info.iv))
+            return false;
+        if (flags & 0x2 && (!gst_byte_reader_get_uint16_be(&reader, &info.subSampleCount) || !gst_byte_reader_get_data(&reader, info.subSampleCount * subSampleEntrySize, &info.subSamples)))
+            return false;
+        auxInfo.push_back(info);
+    }
+    return true;
+}
+
+// Auxiliary information located by saiz and saio boxes, relative to the base
+// data offset of the track fragment.
+static bool parseAuxInfo(std::span<const guint8> data, const Box& saiz, const Box& saio, gsize base, guint8 ivSize, std::vector<SampleAuxInfo>& auxInfo)
+{
+    GstByteReader reader;
+    gst_byte_reader_init(&reader, saiz.payload.data(), saiz.payload.size());
+    guint32 flags, count;
+    guint8 defaultSize;
+    const guint8* sizes = nullptr;
+    if (!gst_byte_reader_get_uint32_be(&reader, &flags) || (flags & 0x1 && !gst_byte_reader_skip(&reader, 8))
+        || !gst_byte_reader_get_uint8(&reader, &defaultSize) || !gst_byte_reader_get_uint32_be(&reader, &count)
+        || (!defaultSize && !gst_byte_reader_get_data(&reader, count, &sizes)))
+        return false;
+
+    gst_byte_reader_init(&reader, saio.payload.data(), saio.payload.size());
+    guint8 version;
+    guint32 entryCount;
+    guint64 offset;
+    guint32 shortOffset;
+    if (!gst_byte_reader_get_uint32_be(&reader, &flags) || (flags & 0x1 && !gst_byte_reader_skip(&reader, 8))
+        || !gst_byte_reader_get_uint32_be(&reader, &entryCount) || entryCount != 1)
+        return false;
+    version = flags >> 24;
+    if (version ? !gst_byte_reader_get_uint64_be(&reader, &offset) : !gst_byte_reader_get_uint32_be(&reader, &shortOffset))
+        return false;
+    if (!version)
+        offset = shortOffset;
+
+    gsize position = base + offset;
+    for (guint32 i = 0; i < count; i++) {
+        gsize size = defaultSize ? defaultSize : sizes[i];
+        if (position > data.size() || data.size() - position < size || size < ivSize)
+            return false;
+
+        SampleAuxInfo info = { data.data() + position, ivSize, nullptr, 0 };
+        if (size > ivSize) {
+            if (size < ivSize + 2u)
+                return false;
+            info.subSampleCount = GST_READ_UINT16_BE(info.iv + ivSize);
+            info.subSamples = info.iv + ivSize + 2;
+            if (size < ivSize + 2u + info.subSampleCount * subSampleEntrySize)
+                return false;
+        }
+        auxInfo.push_back(info);
+        position += size;
+    }
+    return true;
+}
+
+static bool decryptSamples(Decrypter* decrypter, Fragment* fragment, const Track& track, const std::vector<std::pair<gsize, gsize>>& ranges, const std::vector<SampleAuxInfo>& auxInfo, GError** error)
+{
+    auto* keyID = gst_buffer_new_memdup(track.keyID, sizeof(track.keyID));
+    std::vector<SparkleCDMSample> samples;
+    samples.reserve(ranges.size());
+    for (gsize i = 0; i < ranges.size(); i++) {
+        if (!ranges[i].second)
+            continue;
+        const auto& info = auxInfo[i];
+        samples.push_back({
+            gst_buffer_new_wrapped_full(static_cast<GstMemoryFlags>(0), fragment->data.data(), fragment->data.size(), ranges[i].first, ranges[i].second, nullptr, nullptr),
+            info.subSampleCount ? gst_buffer_new_memdup(info.subSamples, info.subSampleCount * subSampleEntrySize) : nullptr,
+            info.subSampleCount,
+            gst_buffer_new_memdup(info.iv, info.ivSize),
+            keyID,
+        });
+        fragment->encryptedBytes += ranges[i].second;
+    }
+
+    guint32 decrypted = 0;
+    auto result = samples.empty() ? ERROR_NONE : sprkl_session_decrypt_list(decrypter->session, samples.data(), samples.size(), &decrypted);
+    for (auto& sample : samples) {
+        gst_buffer_unref(sample.buffer);
+        if (sample.subSamples)
+            gst_buffer_unref(sample.subSamples);
+        gst_buffer_unref(sample.IV);
+    }
+    gst_buffer_unref(keyID);
+
+    if (result != ERROR_NONE) {
+        g_set_error(error, SPRKL_DECRYPT_ERROR, 0, "Decryption of sample %u of track fragment at offset %" G_GUINT64_FORMAT " failed with error %d", decrypted, fragment->fileOffset, result);
+        return false;
+    }
+    fragment->samples += samples.size();
+    return true;
+}
+
+static bool processTraf(Decrypter* decrypter, Fragment* fragment, const Box& traf, gsize& nextBase, GError** error)
+{
+    std::span<guint8> data(fragment->data);
+    auto boxes = childBoxes(traf.payload);
+
+    const Box* tfhd = nullptr;
+    for (const auto& box : boxes) {
+        if (box.type == boxTfhd)
+            tfhd = &box;
+    }
+
+    GstByteReader reader;
+    guint32 flags, trackID;
+    if (tfhd)
+        gst_byte_reader_init(&reader, tfhd->payload.data(), tfhd->payload.size());
+    if (!tfhd || !gst_byte_reader_get_uint32_be(&reader, &flags) || !gst_byte_reader_get_uint32_be(&reader, &trackID)) {
+        g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Invalid tfhd box");
+        return false;
+    }
+
+    auto trackIterator = decrypter->tracks.find(trackID);
+    Track track = trackIterator != decrypter->tracks.end() ? trackIterator->second : Track();
+
+    // Data offsets are relative to the explicit base, to the moof box, or to
+    // the end of the data of the previous track fragment.
+    guint64 baseDataOffset = 0;
+    if (flags & 0x1 && !gst_byte_reader_get_uint64_be(&reader, &baseDataOffset))
+        return false;
+    if ((flags & 0x2 && !gst_byte_reader_skip(&reader, 4)) || (flags & 0x8 && !gst_byte_reader_skip(&reader, 4))
+        || (flags & 0x10 && !gst_byte_reader_get_uint32_be(&reader, &track.defaultSampleSize))) {
+        g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Invalid tfhd box");
+        return false;
+    }
+    gint64 base = nextBase;
+    if (flags & 0x1)
+        base = static_cast<gint64>(baseDataOffset - fragment->fileOffset);
+    else if (flags & 0x20000)
+        base = 0;
+
+    std::vector<std::pair<gsize, gsize>> ranges;
+    gint64 position = base;
+    for (const auto& trun : boxes) {
+        if (trun.type != boxTrun)
+            continue;
+
+        guint32 trunFlags, count;
+        gst_byte_reader_init(&reader, trun.payload.data(), trun.payload.size());
+        if (!gst_byte_reader_get_uint32_be(&reader, &trunFlags) || !gst_byte_reader_get_uint32_be(&reader, &count))
+            return false;
+        gint32 dataOffset;
+        if (trunFlags & 0x1) {
+            if (!gst_byte_reader_get_int32_be(&reader, &dataOffset))
+                return false;
+            position = base + dataOffset;
+        }
+        if (trunFlags & 0x4 && !gst_byte_reader_skip(&reader, 4))
+            return false;
+
+        for (guint32 i = 0; i < count; i++) {
+            guint32 size = track.defaultSampleSize;
+            if ((trunFlags & 0x100 && !gst_byte_reader_skip(&reader, 4)) || (trunFlags & 0x200 && !gst_byte_reader_get_uint32_be(&reader, &size))
+                || (trunFlags & 0x400 && !gst_byte_reader_skip(&reader, 4)) || (trunFlags & 0x800 && !gst_byte_reader_skip(&reader, 4))) {
+                g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Invalid trun box");
+                return false;
+            }
+            if (position < 0 || static_cast<guint64>(position) > data.size() || data.size() - position < size) {
+                g_set_error(error, SPRKL_DECRYPT_ERROR, 0, "Sample data outside of the fragment at offset %" G_GUINT64_FORMAT, fragment->fileOffset);
+                return false;
+            }
+            ranges.emplace_back(position, size);
+            position += size;
+        }
+    }
+    nextBase = MAX(position, 0);
+
+    if (!track.isProtected)
+        return true;
+
+    std::vector<SampleAuxInfo> auxInfo;
+    const Box* saiz = nullptr;
+    const Box* saio = nullptr;
+    bool parsed = false;
+    for (const auto& box : boxes) {
+        if (box.type == boxSenc || isPiffSampleEncryption(box)) {
+            if (!parsed)
+                parsed = parseSampleEncryption(box, track.ivSize, auxInfo);
+            renameBox(box, boxFree);
+        } else if (box.type == boxSaiz || box.type == boxSaio) {
+            (box.type == boxSaiz ? saiz : saio) = &box;
+            renameBox(box, boxFree);
+        }
+    }
+    if (!parsed && saiz && saio && base >= 0)
+        parsed = parseAuxInfo(data, *saiz, *saio, base, track.ivSize, auxInfo);
+    if (!parsed || auxInfo.size() != ranges.size()) {
+        g_set_error(error, SPRKL_DECRYPT_ERROR, 0, "Missing or invalid sample encryption information at offset %" G_GUINT64_FORMAT, fragment->fileOffset);
+        return false;
+    }
+
+    return decryptSamples(decrypter, fragment, track, ranges, auxInfo, error);
+}
+
+static bool processFragment(Decrypter* decrypter, Fragment* fragment, GError** error)
+{
+    Box moof;
+    std::span<guint8> data(fragment->data);
+    if (!readBox(data, 0, moof) || moof.type != boxMoof) {
+        g_set_error(error, SPRKL_DECRYPT_ERROR, 0, "Invalid moof box at offset %" G_GUINT64_FORMAT, fragment->fileOffset);
+        return false;
+    }
+
+    gsize nextBase = 0;
+    for (const auto& box : childBoxes(moof.payload)) {
+        if (box.type == boxPssh)
+            renameBox(box, boxFree);
+        else if (box.type == boxTraf && !processTraf(decrypter, fragment, box, nextBase, error))
+            return false;
+    }
+    return true;
+}
+
+static void fragmentWorker(gpointer data, gpointer userData)
+{
+    auto* fragment = static_cast<Fragment*>(data);
+    auto* decrypter = static_cast<Decrypter*>(userData);
+
+    GError* error = nullptr;
+    if (!processFragment(decrypter, fragment, &error) && !error)
+        g_set_error(&error, SPRKL_DECRYPT_ERROR, 0, "Invalid fragment at offset %" G_GUINT64_FORMAT, fragment->fileOffset);
+
+    g_mutex_lock(&decrypter->mutex);
+    fragment->error = error;
+    fragment->done = true;
+    g_cond_broadcast(&decrypter->condition);
+    g_mutex_unlock(&decrypter->mutex);
+}
+
+static bool parseHex(const gchar* hex, guint8 bytes[16])
+{
+    gsize length = 0;
+    for (; *hex && length < 32; hex++) {
+        // Key IDs are often written as UUIDs.
+        if (*hex == '-')
+            continue;
+        int value = g_ascii_xdigit_value(*hex);
+        if (value < 0)
+            return false;
+        bytes[length / 2] = length % 2 ? bytes[length / 2] | value : value << 4;
+        length++;
+    }
+    return length == 32 && !*hex;
+}
+
+// The input pages modified in place are private copies, they are given back
+// once written so that memory use does not grow with the input size.
+static void releasePages(std::span<guint8> data)
+{
+    auto pageSize = static_cast<guintptr>(sysconf(_SC_PAGESIZE));
+    auto start = (reinterpret_cast<guintptr>(data.data()) + pageSize - 1) & ~(pageSize - 1);
+    auto end = reinterpret_cast<guintptr>(data.data() + data.size()) & ~(pageSize - 1);
+    if (end > start)
+        madvise(reinterpret_cast<void*>(start), end - start, MADV_DONTNEED);
+}
+
+static bool decryptFile(Decrypter* decrypter, std::span<guint8> input, FILE* output, guint nThreads, DecryptStats& stats, GError** error)
+{
+    // Everything before the first fragment, usually ftyp and moov, is handled
+    // on this thread, then each fragment spans up to the next moof box.
+    std::span<guint8> header;
+    std::vector<Fragment> fragments;
+    Box box;
+    gsize offset = 0;
+    for (; offset < input.size() && readBox(input, offset, box); offset += box.size) {
+        if (box.type != boxMoof)
+            continue;
+        if (fragments.empty())
+            header = input.first(offset);
+        else
+            fragments.back().data = input.subspan(fragments.back().fileOffset, offset - fragments.back().fileOffset);
+        fragments.emplace_back().fileOffset = offset;
+    }
+    if (offset < input.size())
+        g_printerr("Trailing garbage at offset %" G_GSIZE_FORMAT ", copied as is\n", offset);
+    if (fragments.empty()) {
+        g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Not a fragmented MP4 file");
+        return false;
+    }
+    fragments.back().data = input.subspan(fragments.back().fileOffset);
+
+    for (const auto& box : childBoxes(header)) {
+        if (box.type == boxPssh)
+            renameBox(box, boxFree);
+        else if (box.type == boxMoov && !processMoov(decrypter, box, error))
+            return false;
+    }
+    if (fwrite(header.data(), 1, header.size(), output) != header.size()) {
+        g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Unable to write the output");
+        return false;
+    }
+
+    GThreadPool* pool = g_thread_pool_new(fragmentWorker, decrypter, nThreads, TRUE, error);
+    if (!pool)
+        return false;
+
+    // Fragments are processed a few at a time ahead of the writer, so that
+    // memory use does not grow with the input size.
+    gsize window = nThreads * 2;
+    gsize submitted = 0;
+    bool success = true;
+    for (gsize written = 0; written < fragments.size() && success; written++) {
+        for (; submitted < fragments.size() && submitted < written + window; submitted++)
+            g_thread_pool_push(pool, &fragments[submitted], nullptr);
+
+        auto& fragment = fragments[written];
+        g_mutex_lock(&decrypter->mutex);
+        while (!fragment.done)
+            g_cond_wait(&decrypter->condition, &decrypter->mutex);
+        g_mutex_unlock(&decrypter->mutex);
+
+        if (fragment.error) {
+            g_propagate_error(error, fragment.error);
+            fragment.error = nullptr;
+            success = false;
+        } else if (fwrite(fragment.data.data(), 1, fragment.data.size(), output) != fragment.data.size()) {
+            g_set_error_literal(error, SPRKL_DECRYPT_ERROR, 0, "Unable to write the output");
+            success = false;
+        }
+        releasePages(fragment.data);
+    }
+    // Pending fragments are dropped on failure.
+    g_thread_pool_free(pool, !success, TRUE);
+
+    stats.fragments = fragments.size();
+    for (auto& fragment : fragments) {
+        stats.samples += fragment.samples;
+        stats.encryptedBytes += fragment.encryptedBytes;
+        g_clear_error(&fragment.error);
+    }
+    return success;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    gint nThreads = 0;
+    g_auto(GStrv) keySpecs = nullptr;
+    GOptionEntry entries[] = {
+        { "key", 'k', 0, G_OPTION_ARG_STRING_ARRAY, &keySpecs, "Content key, repeated for each key", "KID:KEY" },
+        { "threads", 't', 0, G_OPTION_ARG_INT, &nThreads, "Number of decryption threads, one per core by default", "N" },
+        { nullptr, 0, 0, G_OPTION_ARG_NONE, nullptr, nullptr, nullptr },
+    };
+
+    g_autoptr(GError) error = nullptr;
+    g_autoptr(GOptionContext) context = g_option_context_new("INPUT OUTPUT");
+    g_option_context_set_summary(context, "Decrypts ClearKey protected fragmented MP4 files.");
+    g_option_context_add_main_entries(context, entries, nullptr);
+    g_option_context_add_group(context, gst_init_get_option_group());
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<SprklToolKey> keys;
+    for (auto* spec = keySpecs; spec && *spec; spec++) {
+        SprklToolKey key;
+        g_auto(GStrv) parts = g_strsplit(*spec, ":", 2);
+        if (g_strv_length(parts) != 2 || !parseHex(parts[0], key.id) || !parseHex(parts[1], key.value)) {
+            g_printerr("Invalid key %s\n", *spec);
+            return EXIT_FAILURE;
+        }
+        keys.push_back(key);
+    }
+    if (argc != 3 || keys.empty() || nThreads < 0) {
+        g_autofree gchar* help = g_option_context_get_help(context, TRUE, nullptr);
+        g_printerr("%s", help);
+        return EXIT_FAILURE;
+    }
+    if (!nThreads)
+        nThreads = g_get_num_processors();
+
+    // Private mapping, samples are decrypted in place without touching the
+    // input file.
+    GMappedFile* file = g_mapped_file_new(argv[1], TRUE, &error);
+    if (!file) {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    struct OpenCDMSystem* system = opencdm_create_system(CLEARKEY_KEY_SYSTEM);
+    if (!system) {
+        g_printerr("ClearKey module not found, check WEBKIT_SPARKLE_CDM_MODULE_PATH\n");
+        g_mapped_file_unref(file);
+        return EXIT_FAILURE;
+    }
+
+    Decrypter decrypter;
+    g_mutex_init(&decrypter.mutex);
+    g_cond_init(&decrypter.condition);
+    decrypter.session = sprkl_tool_create_clearkey_session(system, keys.data(), keys.size());
+
+    bool success = false;
+    FILE* output = nullptr;
+    if (!decrypter.session)
+        g_printerr("Unable to set up the ClearKey session\n");
+    else if (!(output = g_fopen(argv[2], "wb")))
+        g_printerr("Unable to open %s: %s\n", argv[2], g_strerror(errno));
+    else {
+        std::span<guint8> input(reinterpret_cast<guint8*>(g_mapped_file_get_contents(file)), g_mapped_file_get_length(file));
+        DecryptStats stats;
+        gint64 start = g_get_monotonic_time();
+        success = decryptFile(&decrypter, input, output, nThreads, stats, &error);
+        if (fclose(output) && success) {
+            g_set_error(&error, SPRKL_DECRYPT_ERROR, 0, "Unable to write %s", argv[2]);
+            success = false;
+        }
+        gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+        if (success) {
+            g_autofree gchar* jsonInput = sprkl_tool_json_path(argv[1]);
+            g_print("{\"input\": %s, \"threads\": %d, \"fragments\": %" G_GSIZE_FORMAT ", \"samples\": %" G_GUINT64_FORMAT ", "
+                    "\"bytes\": %" G_GSIZE_FORMAT ", \"encrypted_bytes\": %" G_GUINT64_FORMAT ", \"seconds\": %.3f, \"gb_per_s\": %.3f}\n",
+                jsonInput, nThreads, stats.fragments, stats.samples, input.size(), stats.encryptedBytes, elapsed / 1e6, input.size() / 1e3 / elapsed);
+        } else {
+            g_printerr("%s\n", error->message);
+            g_unlink(argv[2]);
+        }
+    }
+
+    if (decrypter.session)
+        opencdm_destruct_session(decrypter.session);
+    opencdm_destruct_system(system);
+    g_cond_clear(&decrypter.condition);
+    g_mutex_clear(&decrypter.mutex);
+    g_mapped_file_unref(file);
+    gst_deinit();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: MIT
+
+#include "gst/capture.h"
+#include "open_cdm.h"
+#include "open_cdm_adapter.h"
+#include "sprkl-tool.h"
+#include <gst/gst.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Replays a capture recorded by sprkldecryptor through the record-location
+// property: sessions are created from the recorded init data, updated with
+// the recorded licenses, then all the samples are decrypted back to back
+// through the OpenCDM entry points, without demuxing nor decoding. Results
+// are printed as JSON.
+//
+// Usage: sprkl-replay [--loops N] CAPTURE
+//
+// The capture is mapped privately, samples are decrypted in place. Loops after
+// the first one decrypt the already decrypted data, which costs the same. CDM
+// modules are looked up in WEBKIT_SPARKLE_CDM_MODULE_PATH.
+
+typedef struct _ReplaySample {
+    GstBuffer* buffer;
+    GstBuffer* keyID;
+    GstBuffer* iv;
+    GstBuffer* subSamples;
+    guint subSampleCount;
+    struct OpenCDMSession* session;
+} ReplaySample;
+
+typedef struct _Replay {
+    GHashTable* systems; // Key system name to OpenCDMSystem.
+    struct OpenCDMSystem* system; // Of the last KEY_SYSTEM record.
+    GPtrArray* sessions; // In creation order.
+    GArray* samples; // ReplaySample entries.
+    guint protectionEvents;
+    guint licenses;
+} Replay;
+
+static void
+clear_sample(gpointer data)
+{
+    ReplaySample* sample = data;
+    gst_buffer_unref(sample->buffer);
+    gst_buffer_unref(sample->keyID);
+    gst_buffer_unref(sample->iv);
+    if (sample->subSamples)
+        gst_buffer_unref(sample->subSamples);
+}
+
+static void
+destruct_session(gpointer session)
+{
+    opencdm_destruct_session(session);
+}
+
+static void
+destruct_system(gpointer system)
+{
+    opencdm_destruct_system(system);
+}
+
+// Reads a string prefixed with its 16 bits size, returns NULL if it does not
+// fit in the record.
+static gchar*
+read_string(const guint8** data, gsize* size)
+{
+    if (*size < 2)
+        return NULL;
+    guint16 length = GST_READ_UINT16_LE(*data);
+    if (*size - 2 < length)
+        return NULL;
+    gchar* string = g_strndup((const gchar*)*data + 2, length);
+    *data += 2 + length;
+    *size -= 2 + length;
+    return string;
+}
+
+static gboolean
+add_key_system(Replay* replay, const guint8* data, gsize size)
+{
+    g_autofree gchar* keySystem = g_strndup((const gchar*)data, size);
+    replay->system = g_hash_table_lookup(replay->systems, keySystem);
+    if (replay->system)
+        return TRUE;
+
+    replay->system = opencdm_create_system(keySystem);
+    if (!replay->system) {
+        g_printerr("No module for %s, check WEBKIT_SPARKLE_CDM_MODULE_PATH\n", keySystem);
+        return FALSE;
+    }
+    g_hash_table_insert(replay->systems, g_steal_pointer(&keySystem), replay->system);
+    return TRUE;
+}
+
+static gboolean
+add_session(Replay* replay, const guint8* data, gsize size)
+{
+    g_autofree gchar* initDataType = read_string(&data, &size);
+    if (!initDataType || !replay->system) {
+        g_printerr("Invalid init data record\n");
+        return FALSE;
+    }
+
+    struct OpenCDMSession* session = NULL;
+    if (opencdm_construct_session(replay->system, Temporary, initDataType, data, size, NULL, 0, &sprkl_tool_callbacks, NULL, &session) != ERROR_NONE) {
+        g_printerr("Unable to create a %s session\n", initDataType);
+        return FALSE;
+    }
+    g_ptr_array_add(replay->sessions, session);
+    return TRUE;
+}
+
+static gboolean
+add_license(Replay* replay, const guint8* data, gsize size)
+{
+    if (!replay->sessions->len) {
+        g_printerr("License recorded before any session\n");
+        return FALSE;
+    }
+
+    struct OpenCDMSession* session = g_ptr_array_index(replay->sessions, replay->sessions->len - 1);
+    if (opencdm_session_update(session, data, size) != ERROR_NONE) {
+        g_printerr("License rejected by the CDM\n");
+        return FALSE;
+    }
+    replay->licenses++;
+    return TRUE;
+}
+
+static gboolean
+add_sample(Replay* replay, GMappedFile* file, const guint8* data, gsize size)
+{
+    SparkleCaptureSample header;
+    if (size < sizeof(header)) {
+        g_printerr("Invalid sample record\n");
+        return FALSE;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    gsize subSamplesSize = (gsize)GUINT32_FROM_LE(header.subSampleCount) * SPKL_CAPTURE_SUBSAMPLE_ENTRY_SIZE;
+    gsize descriptionSize = sizeof(header) + header.keyIDSize + header.ivSize + subSamplesSize;
+    gsize payloadOffset = GST_ROUND_UP_8(descriptionSize);
+    if (payloadOffset > size) {
+        g_printerr("Invalid sample record\n");
+        return FALSE;
+    }
+
+    const guint8* description = data + sizeof(header);
+    ReplaySample sample = { 0, };
+    sample.keyID = gst_buffer_new_memdup(description, header.keyIDSize);
+    sample.iv = gst_buffer_new_memdup(description + header.keyIDSize, header.ivSize);
+    sample.subSampleCount = GUINT32_FROM_LE(header.subSampleCount);
+    if (sample.subSampleCount)
+        sample.subSamples = gst_buffer_new_memdup(description + header.keyIDSize + header.ivSize, subSamplesSize);
+
+    // The mapping outlives the buffers.
+    gchar* contents = g_mapped_file_get_contents(file);
+    sample.buffer = gst_buffer_new_wrapped_full(0, contents, g_mapped_file_get_length(file), (const gchar*)data + payloadOffset - contents, size - payloadOffset, NULL, NULL);
+    GST_BUFFER_PTS(sample.buffer) = GUINT64_FROM_LE(header.pts);
+    g_array_append_val(replay->samples, sample);
+    return TRUE;
+}
+
+static gboolean
+load_capture(Replay* replay, GMappedFile* file)
+{
+    const guint8* contents = (const guint8*)g_mapped_file_get_contents(file);
+    gsize length = g_mapped_file_get_length(file);
+    if (length < SPKL_CAPTURE_HEADER_SIZE || memcmp(contents, SPKL_CAPTURE_MAGIC, SPKL_CAPTURE_MAGIC_SIZE)) {
+        g_printerr("Not a capture file\n");
+        return FALSE;
+    }
+    if (GST_READ_UINT32_LE(contents + SPKL_CAPTURE_MAGIC_SIZE) != SPKL_CAPTURE_VERSION) {
+        g_printerr("Unsupported capture version %u\n", GST_READ_UINT32_LE(contents + SPKL_CAPTURE_MAGIC_SIZE));
+        return FALSE;
+    }
+
+    gsize offset = SPKL_CAPTURE_HEADER_SIZE;
+    while (length - offset >= 8) {
+        guint32 type = GST_READ_UINT32_LE(contents + offset);
+        guint32 size = GST_READ_UINT32_LE(contents + offset + 4);
+        offset += 8;
+        if (size > length - offset) {
+            // The recording pipeline did not shut down cleanly.
+            g_printerr("Truncated capture, ignoring its last record\n");
+            break;
+        }
+
+        const guint8* data = contents + offset;
+        gboolean success = TRUE;
+        switch (type) {
+        case SPKL_CAPTURE_RECORD_KEY_SYSTEM:
+            success = add_key_system(replay, data, size);
+            break;
+        case SPKL_CAPTURE_RECORD_PROTECTION:
+            replay->protectionEvents++;
+            break;
+        case SPKL_CAPTURE_RECORD_INIT_DATA:
+            success = add_session(replay, data, size);
+            break;
+        case SPKL_CAPTURE_RECORD_LICENSE:
+            success = add_license(replay, data, size);
+            break;
+        case SPKL_CAPTURE_RECORD_SAMPLE:
+            success = add_sample(replay, file, data, size);
+            break;
+        default:
+            break;
+        }
+        if (!success)
+            return FALSE;
+
+        offset += MIN((gsize)GST_ROUND_UP_8(size), length - offset);
+    }
+    return TRUE;
+}
+
+// Samples go to the most recent session holding a usable key for them, as
+// the decryptor does once licenses are in. Returns the number of samples left
+// without a session.
+static guint
+resolve_sessions(Replay* replay)
+{
+    guint unresolved = 0;
+    const ReplaySample* previous = NULL;
+    for (guint i = 0; i < replay->samples->len; i++) {
+        ReplaySample* sample = &g_array_index(replay->samples, ReplaySample, i);
+        GstMapInfo info;
+        gst_buffer_map(sample->keyID, &info, GST_MAP_READ);
+        if (previous && previous->session && gst_buffer_get_size(previous->keyID) == info.size && !gst_buffer_memcmp(previous->keyID, 0, info.data, info.size))
+            sample->session = previous->session;
+        for (guint j = replay->sessions->len; j && !sample->session; j--) {
+            struct OpenCDMSession* session = g_ptr_array_index(replay->sessions, j - 1);
+            if (opencdm_session_status(session, info.data, info.size) == Usable)
+                sample->session = session;
+        }
+        gst_buffer_unmap(sample->keyID, &info);
+
+        if (!sample->session)
+            unresolved++;
+        previous = sample;
+    }
+    return unresolved;
+}
+
+static gint
+compare_sizes(gconstpointer a, gconstpointer b)
+{
+    gsize first = *(const gsize*)a;
+    gsize second = *(const gsize*)b;
+    return first < second ? -1 : first > second;
+}
+
+static gboolean
+replay_samples(Replay* replay, const gchar* location, guint loops)
+{
+    guint64 bytes = 0;
+    guint64 subsampled = 0;
+    guint64 subSampleTotal = 0;
+    guint samples = 0;
+    GArray* sizes = g_array_new(FALSE, FALSE, sizeof(gsize));
+    for (guint i = 0; i < replay->samples->len; i++) {
+        const ReplaySample* sample = &g_array_index(replay->samples, ReplaySample, i);
+        if (!sample->session)
+            continue;
+        gsize size = gst_buffer_get_size(sample->buffer);
+        g_array_append_val(sizes, size);
+        bytes += size;
+        subsampled += sample->subSampleCount > 0;
+        subSampleTotal += sample->subSampleCount;
+        samples++;
+    }
+    if (!samples) {
+        g_array_unref(sizes);
+        g_printerr("No sample can be decrypted with the recorded licenses\n");
+        return FALSE;
+    }
+    g_array_sort(sizes, compare_sizes);
+
+    gboolean success = TRUE;
+    gint64 start = g_get_monotonic_time();
+    for (guint loop = 0; loop < loops && success; loop++) {
+        for (guint i = 0; i < replay->samples->len && success; i++) {
+            ReplaySample* sample = &g_array_index(replay->samples, ReplaySample, i);
+            if (sample->session)
+                success = opencdm_gstreamer_session_decrypt(sample->session, sample->buffer, sample->subSamples, sample->subSampleCount, sample->iv, sample->keyID, 0) == ERROR_NONE;
+        }
+    }
+    gint64 elapsed = MAX(g_get_monotonic_time() - start, 1);
+
+    if (!success) {
+        g_array_unref(sizes);
+        g_printerr("Decryption failed\n");
+        return FALSE;
+    }
+
+    g_autofree gchar* jsonLocation = sprkl_tool_json_path(location);
+    g_print("{\"capture\": %s, \"key_systems\": %u, \"protection_events\": %u, \"sessions\": %u, \"licenses\": %u, "
+            "\"samples\": %u, \"skipped\": %u, \"loops\": %u, \"bytes\": %" G_GUINT64_FORMAT ", \"subsampled_ratio\": %.3f, \"avg_subsamples\": %.2f, "
+            "\"sample_size\": {\"p50\": %" G_GSIZE_FORMAT ", \"p95\": %" G_GSIZE_FORMAT ", \"max\": %" G_GSIZE_FORMAT "}, "
+            "\"mb_per_s\": %.2f, \"us_per_sample\": %.2f}\n",
+        jsonLocation, g_hash_table_size(replay->systems), replay->protectionEvents, replay->sessions->len, replay->licenses,
+        samples, replay->samples->len - samples, loops, bytes, (double)subsampled / samples, (double)subSampleTotal / samples,
+        g_array_index(sizes, gsize, (sizes->len - 1) / 2), g_array_index(sizes, gsize, (sizes->len - 1) * 95 / 100), g_array_index(sizes, gsize, sizes->len - 1),
+        (double)bytes * loops / 1e6 / (elapsed / 1e6), (double)elapsed / ((guint64)samples * loops));
+    g_array_unref(sizes);
+    return TRUE;
+}
+
+int main(int argc, char** argv)
+{
+    gint loops = 1;
+    GOptionEntry entries[] = {
+        { "loops", 'l', 0, G_OPTION_ARG_INT, &loops, "Number of times the samples are decrypted", "N" },
+        { NULL, 0, 0, 0, NULL, NULL, NULL },
+    };
+
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GOptionContext) context = g_option_context_new("CAPTURE");
+    g_option_context_set_summary(context, "Decrypts the samples of a sprkldecryptor capture at full speed.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_add_group(context, gst_init_get_option_group());
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+    if (argc != 2 || loops < 1) {
+        g_autofree gchar* help = g_option_context_get_help(context, TRUE, NULL);
+        g_printerr("%s", help);
+        return EXIT_FAILURE;
+    }
+
+    // Writable for in-place decryption, changes are not written back.
+    GMappedFile* file = g_mapped_file_new(argv[1], TRUE, &error);
+    if (!file) {
+        g_printerr("%s\n", error->message);
+        return EXIT_FAILURE;
+    }
+
+    Replay replay = { 0, };
+    replay.systems = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, destruct_system);
+    replay.sessions = g_ptr_array_new_with_free_func(destruct_session);
+    replay.samples = g_array_new(FALSE, FALSE, sizeof(ReplaySample));
+    g_array_set_clear_func(replay.samples, clear_sample);
+
+    gboolean success = load_capture(&replay, file);
+    if (success) {
+        guint unresolved = resolve_sessions(&replay);
+        if (unresolved)
+            g_printerr("No usable key for %u samples, skipping them\n", unresolved);
+        success = replay_samples(&replay, argv[1], loops);
+    }
+
+    // Samples first, they reference the mapping, then sessions before their
+    // systems.
+    g_array_unref(replay.samples);
+    g_ptr_array_unref(replay.sessions);
+    g_hash_table_unref(replay.systems);
+    g_mapped_file_unref(file);
+    gst_deinit();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}